@@ -1,8 +1,9 @@
 #pragma once
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include <assert.h>
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -54,6 +55,7 @@ static bool cli_log_verbose = false;
 #define pg_assert(condition) assert(condition)
 
 #define pg_max(a, b) (((a) > (b)) ? (a) : (b))
+#define pg_min(a, b) (((a) < (b)) ? (a) : (b))
 
 #define PG_DBL_EPSILON (double)2.2e-16
 
@@ -75,6 +77,8 @@ typedef struct {
   u8 *_Nonnull start;
   u8 *_Nonnull end;
   Mem_profile *_Nullable profile;
+  // Where to jump when an allocation does not fit, instead of aborting.
+  jmp_buf *_Nullable out_of_memory;
 } Arena;
 
 __attribute__((warn_unused_result)) static u32
@@ -126,6 +130,9 @@ __attribute((malloc, alloc_size(2, 4), alloc_align(3))) static void
   // Ignore overflow for now.
   size_t offset = padding + size * count;
   if (available < offset) {
+    if (a->out_of_memory)
+      longjmp(*a->out_of_memory, 1);
+
     fprintf(stderr,
             "Out of memory: available=%lu "
             "allocation_size=%lu\n",
@@ -28,8 +28,12 @@ static void array_grow(u32 len, u32 *_Nonnull cap,
 
   // Optimization: if the current allocation is the last in the arena, do not
   // realloc, just bump the arena ptr.
-  if (arena_is_ptr_last_allocation(arena, data, old_cap)) {
-    arena->start += *cap - old_cap;
+  if (arena_is_ptr_last_allocation(arena, *data, old_cap * item_size)) {
+    pg_assert(arena->start + (*cap - old_cap) * item_size <= arena->end);
+    // Zeroed like `arena_alloc` does: the arena may have been rewound over
+    // older data.
+    memset(arena->start, 0, (*cap - old_cap) * item_size);
+    arena->start += (*cap - old_cap) * item_size;
     return;
   }
 
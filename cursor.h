@@ -127,7 +127,7 @@ read_cursor_utf8_rune(Read_cursor *_Nonnull self) {
       return (Unicode_character){0};
 
     const u8 c3 = read_cursor_next(self);
-    if (!utf8_is_continuation_byte(c2))
+    if (!utf8_is_continuation_byte(c3))
       return (Unicode_character){0};
 
     return (Unicode_character){.data = {c1, c2, c3}, .len = 3};
@@ -144,14 +144,14 @@ read_cursor_utf8_rune(Read_cursor *_Nonnull self) {
       return (Unicode_character){0};
 
     const u8 c3 = read_cursor_next(self);
-    if (!utf8_is_continuation_byte(c2))
+    if (!utf8_is_continuation_byte(c3))
       return (Unicode_character){0};
 
     if (read_cursor_is_at_end(*self))
       return (Unicode_character){0};
 
     const u8 c4 = read_cursor_next(self);
-    if (!utf8_is_continuation_byte(c2))
+    if (!utf8_is_continuation_byte(c4))
       return (Unicode_character){0};
 
     return (Unicode_character){.data = {c1, c2, c3, c4}, .len = 4};
@@ -1,8 +1,12 @@
 #pragma once
 
 #include "arena.h"
-#include "cursor.h"
+#include "array.h"
+#include "simd.h"
 #include "str.h"
+#include "utf8.h"
+
+#include <time.h>
 
 typedef enum {
   HTTP_METHOD_GET,
@@ -15,65 +19,786 @@ typedef enum {
   HTTP_METHOD_CONNECT,
 } Method;
 
-typedef struct Header Header;
-struct Header {
+typedef struct {
   Str key, value;
-  Header *next;
-};
+} Header;
+
+Array_struct(Header);
+
+// Headers the server itself looks at, recognized once when added so that
+// looking them up is a plain array access.
+typedef enum {
+  HTTP_HEADER_CONTENT_LENGTH,
+  HTTP_HEADER_CONNECTION,
+  HTTP_HEADER_TRANSFER_ENCODING,
+  HTTP_HEADER_HOST,
+  HTTP_HEADER_ACCEPT_ENCODING,
+  HTTP_HEADER_EXPECT,
+  HTTP_HEADER_KNOWN_COUNT,
+} Http_header_known;
+
+// Slot of the header index: the hash of a name, and the position plus one in
+// the list of its first occurrence. Zero marks an empty slot.
+typedef struct {
+  u32 hash;
+  u32 position;
+} Http_header_slot;
+
+// Header fields in order, indexed by their case-folded name with open
+// addressing (linear probing, at most half full).
+typedef struct {
+  Array(Header) list;
+  Http_header_slot *_Nullable index;
+  u32 index_cap;
+  // Position plus one in `list` of the first occurrence of each well-known
+  // header, zero if absent.
+  u32 known[HTTP_HEADER_KNOWN_COUNT];
+  pg_pad(4);
+} Http_headers;
+
+// Captured by the router from the path, e.g. `id` for `/users/:id`.
+typedef struct {
+  Str name, value;
+} Http_path_param;
+
+#define HTTP_PATH_PARAMS_MAX 8
+
+// `name=value` pair of the query string, still percent-encoded.
+typedef struct {
+  Str name, value;
+} Http_query_param;
 
-// TODO: headers.
 typedef struct {
   Method method;
   int error;
+  // Without the dot segments. Points into the received bytes unless there
+  // were some.
   Str path;
-  Str params;
+  // What follows `?` in the URL, without it, nor the fragment.
+  Str query;
   Str body;
-  Header *headers;
+  Http_headers headers;
+  Http_path_param *_Nullable path_params;
+  // `query` split on the first lookup of a parameter.
+  Http_query_param *_Nullable query_params;
+  // For streaming handlers, see `Http_body_handler`.
+  void *_Nullable body_context;
+  u32 path_params_count;
+  u32 query_params_count;
+  u8 version_minor;
+  // Whether the connection should be kept open after responding.
+  bool keep_alive;
+  bool query_indexed;
+  pg_pad(5);
 } Request;
 
-// TODO: headers.
+// See static_files.h.
+typedef struct File_cache_entry File_cache_entry;
+
 typedef struct {
   u16 status;
   pg_pad(6);
-  Header *headers;
+  Http_headers headers;
+  // Header lines formatted in advance, each ending with `\r\n`, e.g. the
+  // constant headers of the route, see `http_headers_serialize`.
+  Str headers_block;
   Str body;
+  // Sent after `body`, straight from the file without copying it. The
+  // response holds a reference on the file, released once sent.
+  File_cache_entry *_Nullable file;
+  u64 file_offset;
+  u64 file_len;
 } Response;
 
-// TODO: Store headers.
-__attribute__((warn_unused_result)) static Request
-parse_headers(Read_cursor *cursor, Request req, Arena *arena) {
-  Header *it = NULL;
+typedef Response (*Http_handler)(Request req, Arena *_Nonnull arena);
 
-  while (!read_cursor_is_at_end(*cursor)) {
-    if (read_cursor_match(cursor, str_from_c("\r\n")))
-      return req;
+// Receives the body of a request piece by piece as it arrives, for the routes
+// which stream it instead of getting it whole in `req.body`, so that large
+// uploads are not buffered. The handler of the route is then called with an
+// empty `req.body`. `req` is the same for all the calls of a request:
+// `req->body_context` can carry state over to the handler.
+typedef void (*Http_body_handler)(Request *_Nonnull req, Str chunk,
+                                  Arena *_Nonnull arena);
 
-    const Str key = read_cursor_match_until_excl_char(cursor, ':');
-    if (str_is_empty(key)) {
-      return req;
+__attribute__((warn_unused_result)) static Str
+http_method_to_str(Method method) {
+  switch (method) {
+  case HTTP_METHOD_GET:
+    return str_from_c("GET");
+  case HTTP_METHOD_POST:
+    return str_from_c("POST");
+  case HTTP_METHOD_PUT:
+    return str_from_c("PUT");
+  case HTTP_METHOD_PATCH:
+    return str_from_c("PATCH");
+  case HTTP_METHOD_HEAD:
+    return str_from_c("HEAD");
+  case HTTP_METHOD_DELETE:
+    return str_from_c("DELETE");
+  case HTTP_METHOD_TRACE:
+    return str_from_c("TRACE");
+  case HTTP_METHOD_CONNECT:
+    return str_from_c("CONNECT");
+  default:
+    pg_assert(0 && "unreachable");
+  }
+}
+
+// Value of the path parameter `name`, empty if absent.
+__attribute__((warn_unused_result)) static Str
+http_request_path_param(Request req, Str name) {
+  for (u32 i = 0; i < req.path_params_count; i++) {
+    if (str_eq(req.path_params[i].name, name))
+      return req.path_params[i].value;
+  }
+  return (Str){0};
+}
+
+// --------------------------- URL
+
+// Whether `path` has a `.` or `..` segment, which is rare: checked without
+// splitting the path.
+__attribute__((warn_unused_result)) static bool
+http_path_has_dot_segment(Str path) {
+  for (usize i = 0; i < path.len;) {
+    const u8 *const dot = memchr(path.data + i, '.', path.len - i);
+    if (dot == NULL)
+      return false;
+
+    const usize at = (usize)(dot - path.data);
+    const usize end = at + 1 < path.len && path.data[at + 1] == '.' ? at + 2
+                                                                     : at + 1;
+    if (at > 0 && path.data[at - 1] == '/' &&
+        (end == path.len || path.data[end] == '/'))
+      return true;
+    i = end;
+  }
+  return false;
+}
+
+// Remove the `.` and `..` segments of an absolute path (RFC 3986, section
+// 5.2.4), `..` stopping at the root. Allocates only if there are some.
+__attribute__((warn_unused_result)) static Str
+http_path_normalize(Str path, Arena *_Nonnull arena) {
+  if (str_first(path) != '/' || !http_path_has_dot_segment(path))
+    return path;
+
+  u8 *const out = arena_alloc(arena, sizeof(u8), _Alignof(u8), path.len);
+  usize len = 0;
+
+  Str remaining = str_advance(path, 1);
+  for (;;) {
+    const Str_split_result split = str_split(remaining, '/');
+    const Str segment = split.left;
+
+    if (str_eq_c(segment, "..")) {
+      // Drop the last output segment, with its slash.
+      while (len > 0 && out[len - 1] != '/') {
+        len -= 1;
+      }
+      if (len > 0)
+        len -= 1;
+    } else if (!str_eq_c(segment, ".")) {
+      out[len++] = '/';
+      memcpy(out + len, segment.data, segment.len);
+      len += segment.len;
+    }
+
+    if (!split.found) {
+      // A trailing dot segment still names a directory.
+      if (str_eq_c(segment, ".") || str_eq_c(segment, ".."))
+        out[len++] = '/';
+      break;
+    }
+    remaining = split.right;
+  }
+
+  if (len == 0)
+    out[len++] = '/';
+  return (Str){.data = out, .len = len};
+}
+
+__attribute__((warn_unused_result)) static bool
+http_hex_digit(u8 c, u8 *_Nonnull value) {
+  const u8 lower = c | 0x20;
+  if ('0' <= c && c <= '9')
+    *value = (u8)(c - '0');
+  else if ('a' <= lower && lower <= 'f')
+    *value = (u8)(lower - 'a' + 10);
+  else
+    return false;
+  return true;
+}
+
+// Decode `%XX` escapes, and `+` as a space in forms. Invalid escapes are kept
+// as is. Returns `s` itself when there is nothing to decode.
+__attribute__((warn_unused_result)) static Str
+http_percent_decode(Str s, bool plus_is_space, Arena *_Nonnull arena) {
+  usize i = 0;
+  while (i < s.len && s.data[i] != '%' &&
+         !(plus_is_space && s.data[i] == '+')) {
+    i += 1;
+  }
+  if (i == s.len)
+    return s;
+
+  u8 *const out = arena_alloc(arena, sizeof(u8), _Alignof(u8), s.len);
+  memcpy(out, s.data, i);
+  usize len = i;
+  for (; i < s.len; i++) {
+    u8 hi = 0, lo = 0;
+    if (s.data[i] == '%' && i + 2 < s.len &&
+        http_hex_digit(s.data[i + 1], &hi) &&
+        http_hex_digit(s.data[i + 2], &lo)) {
+      out[len++] = (u8)(hi << 4 | lo);
+      i += 2;
+    } else if (plus_is_space && s.data[i] == '+') {
+      out[len++] = ' ';
+    } else {
+      out[len++] = s.data[i];
+    }
+  }
+  return (Str){.data = out, .len = len};
+}
+
+// Split the query string in its parameters, once.
+static void http_request_query_index(Request *_Nonnull req,
+                                     Arena *_Nonnull arena) {
+  if (req->query_indexed)
+    return;
+  req->query_indexed = true;
+
+  if (str_is_empty(req->query))
+    return;
+
+  const u32 cap = str_count(req->query, '&') + 1;
+  req->query_params = arena_alloc(arena, sizeof(Http_query_param),
+                                  _Alignof(Http_query_param), cap);
+
+  Str remaining = req->query;
+  for (;;) {
+    const Str_split_result pair = str_split(remaining, '&');
+    if (!str_is_empty(pair.left)) {
+      const Str_split_result name_value = str_split(pair.left, '=');
+      req->query_params[req->query_params_count++] = (Http_query_param){
+          .name = name_value.left,
+          .value = name_value.found ? name_value.right : (Str){0},
+      };
+    }
+    if (!pair.found)
+      break;
+    remaining = pair.right;
+  }
+}
+
+// Decoded value of the first query parameter `name`, empty if absent. The
+// query string is only split by the first call, and only the value returned
+// is decoded.
+__attribute__((warn_unused_result)) static Str
+http_request_query_param(Request *_Nonnull req, Str name,
+                         Arena *_Nonnull arena) {
+  http_request_query_index(req, arena);
+
+  for (u32 i = 0; i < req->query_params_count; i++) {
+    const Http_query_param param = req->query_params[i];
+    if (str_eq(http_percent_decode(param.name, true, arena), name))
+      return http_percent_decode(param.value, true, arena);
+  }
+  return (Str){0};
+}
+
+// Hash of the name ignoring case, from its length and its first and last 8
+// bytes, so that hashing does not depend on the name length. Setting bit 5
+// lower-cases letters, and makes some other bytes collide, which the key
+// comparison sorts out.
+__attribute__((warn_unused_result)) static u32 http_header_hash(Str key) {
+  const u64 fold = 0x2020202020202020ULL;
+  const u64 multiplier = 0x9e3779b97f4a7c15ULL;
+  const usize n = pg_min(key.len, sizeof(u64));
+
+  u64 head = 0, tail = 0;
+  if (n > 0) {
+    memcpy(&head, key.data, n);
+    memcpy(&tail, key.data + key.len - n, n);
+  }
+
+  u64 hash = ((head | fold) * multiplier) ^ (tail | fold) ^ key.len;
+  hash *= multiplier;
+  return (u32)(hash >> 32);
+}
+
+// The well-known headers have distinct name lengths: one comparison tells.
+__attribute__((warn_unused_result)) static Http_header_known
+http_header_known_for(Str key) {
+  Http_header_known known = HTTP_HEADER_KNOWN_COUNT;
+  Str name = {0};
+  switch (key.len) {
+  case 14:
+    known = HTTP_HEADER_CONTENT_LENGTH, name = str_from_c("content-length");
+    break;
+  case 10:
+    known = HTTP_HEADER_CONNECTION, name = str_from_c("connection");
+    break;
+  case 17:
+    known = HTTP_HEADER_TRANSFER_ENCODING,
+    name = str_from_c("transfer-encoding");
+    break;
+  case 4:
+    known = HTTP_HEADER_HOST, name = str_from_c("host");
+    break;
+  case 15:
+    known = HTTP_HEADER_ACCEPT_ENCODING, name = str_from_c("accept-encoding");
+    break;
+  case 6:
+    known = HTTP_HEADER_EXPECT, name = str_from_c("expect");
+    break;
+  default:
+    return HTTP_HEADER_KNOWN_COUNT;
+  }
+  return str_eq_ignore_case(key, name) ? known : HTTP_HEADER_KNOWN_COUNT;
+}
+
+// Index `position` under `hash`, unless a header of the same name already is.
+static void http_headers_index(Http_headers *_Nonnull headers, u32 hash,
+                               u32 position) {
+  pg_assert(headers->index != NULL);
+
+  const Str key = headers->list.data[position].key;
+  for (u32 i = hash & (headers->index_cap - 1);;
+       i = (i + 1) & (headers->index_cap - 1)) {
+    Http_header_slot *const slot = &headers->index[i];
+    if (slot->position == 0) {
+      *slot = (Http_header_slot){.hash = hash, .position = position + 1};
+      return;
+    }
+    if (slot->hash == hash &&
+        str_eq_ignore_case(headers->list.data[slot->position - 1].key, key))
+      return;
+  }
+}
+
+static void http_headers_add(Http_headers *_Nonnull headers, Str key,
+                             Str value, Arena *_Nonnull arena) {
+  if (headers->list.cap == 0) {
+    headers->list = array_make(Header, 0, 16, arena);
+  }
+  const u32 position = headers->list.len;
+  *array_push(&headers->list, arena) = (Header){.key = key, .value = value};
+
+  const Http_header_known known = http_header_known_for(key);
+  if (known != HTTP_HEADER_KNOWN_COUNT && headers->known[known] == 0) {
+    headers->known[known] = position + 1;
+  }
+
+  // Keep the index at most half full, rebuilding it when growing.
+  if (2 * headers->list.len > headers->index_cap) {
+    headers->index_cap = headers->index_cap == 0 ? 32 : headers->index_cap * 2;
+    headers->index =
+        arena_alloc(arena, sizeof(Http_header_slot), _Alignof(Http_header_slot),
+                    headers->index_cap);
+    for (u32 i = 0; i < headers->list.len; i++) {
+      http_headers_index(headers, http_header_hash(headers->list.data[i].key),
+                         i);
+    }
+  } else {
+    http_headers_index(headers, http_header_hash(key), position);
+  }
+}
+
+// First header named `key`, ignoring case.
+__attribute__((warn_unused_result)) static const Header *_Nullable
+http_find_header(Http_headers headers, Str key) {
+  if (headers.index == NULL)
+    return NULL;
+
+  const u32 hash = http_header_hash(key);
+  for (u32 i = hash & (headers.index_cap - 1);;
+       i = (i + 1) & (headers.index_cap - 1)) {
+    const Http_header_slot slot = headers.index[i];
+    if (slot.position == 0)
+      return NULL;
+
+    const Header *const header = &headers.list.data[slot.position - 1];
+    if (slot.hash == hash && str_eq_ignore_case(header->key, key))
+      return header;
+  }
+}
+
+__attribute__((warn_unused_result)) static const Header *_Nullable
+http_find_known_header(Http_headers headers, Http_header_known known) {
+  pg_assert(known < HTTP_HEADER_KNOWN_COUNT);
+
+  return headers.known[known] == 0
+             ? NULL
+             : &headers.list.data[headers.known[known] - 1];
+}
+
+// Whether another header of the same name follows the first `known` one, with
+// a different value unless `any_value`. Only the first one is indexed.
+__attribute__((warn_unused_result)) static bool
+http_known_header_repeated(Http_headers headers, Http_header_known known,
+                           bool any_value) {
+  const u32 first = headers.known[known];
+  if (first == 0)
+    return false;
+
+  const Str value = headers.list.data[first - 1].value;
+  for (u32 i = first; i < headers.list.len; i++) {
+    const Header header = headers.list.data[i];
+    if (http_header_known_for(header.key) == known &&
+        (any_value || !str_eq(header.value, value)))
+      return true;
+  }
+  return false;
+}
+
+// HTTP/1.1 connections are persistent unless the client asks otherwise, and
+// HTTP/1.0 ones are not unless the client asks for it.
+__attribute__((warn_unused_result)) static bool
+http_request_keep_alive(Request req) {
+  bool keep_alive = req.version_minor >= 1;
+
+  const Header *const connection =
+      http_find_known_header(req.headers, HTTP_HEADER_CONNECTION);
+  if (connection == NULL)
+    return keep_alive;
+
+  // Comma separated list of options, e.g. `keep-alive, Upgrade`.
+  Str remaining = connection->value;
+  while (!str_is_empty(remaining)) {
+    const Str_split_result split = str_split(remaining, ',');
+    const Str option = str_trim_left(split.left, ' ');
+
+    if (str_eq_ignore_case(option, str_from_c("close")))
+      return false;
+    if (str_eq_ignore_case(option, str_from_c("keep-alive")))
+      keep_alive = true;
+
+    remaining = split.found ? split.right : (Str){0};
+  }
+
+  return keep_alive;
+}
+
+// --------------------------- Request parsing
+
+// The request line and the headers are tokenized by scanning for the first
+// byte which ends the current token, 16 (SSE4.2) or 32 (AVX2) bytes at a time,
+// which also validates the bytes skipped.
+
+typedef enum {
+  // Header names: anything but `tchar` (RFC 9110) ends them, normally `:`.
+  HTTP_SCAN_TOKEN,
+  // Request target: a space or a control character ends it.
+  HTTP_SCAN_TARGET,
+  // Header values: a control character other than HTAB ends them, normally
+  // `\r`. Bytes above 0x7f (`obs-text`) are allowed.
+  HTTP_SCAN_VALUE,
+} Http_scan_class;
+
+static const u8 http_token_chars[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, //
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, //
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0, //
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
+};
+
+__attribute__((warn_unused_result)) static bool
+http_scan_stops_at(Http_scan_class class, u8 c) {
+  switch (class) {
+  case HTTP_SCAN_TOKEN:
+    return !http_token_chars[c];
+  case HTTP_SCAN_TARGET:
+    return c <= ' ' || c == 0x7f;
+  case HTTP_SCAN_VALUE:
+    return (c < ' ' && c != '\t') || c == 0x7f;
+  default:
+    pg_assert(0 && "unreachable");
+  }
+}
+
+// A scan kernel returns the index of the first byte from `i` which may end
+// the token, or `len`. Vector kernels may stop early on a byte which does not
+// (the SSE4.2 token ranges are a superset): the caller checks.
+typedef usize (*Http_scan_kernel)(const u8 *_Nonnull data, usize len, usize i,
+                                  Http_scan_class class);
+
+__attribute__((warn_unused_result)) static usize
+http_scan_scalar(const u8 *_Nonnull data, usize len, usize i,
+                 Http_scan_class class) {
+  while (i < len && !http_scan_stops_at(class, data[i])) {
+    i += 1;
+  }
+  return i;
+}
+
+#if defined(__x86_64__)
+__attribute__((warn_unused_result, target("sse4.2"))) static usize
+http_scan_sse42(const u8 *_Nonnull data, usize len, usize i,
+                Http_scan_class class) {
+  // Inclusive ranges of the bytes ending the token, for `pcmpestri`.
+  // Sized to be loaded whole, without their NUL terminator.
+  static const char token_ranges[17] = "\x00 \"\"(),,//:@[]{\xff";
+  static const char target_ranges[16] = "\x00 \x7f\x7f";
+  static const char value_ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+
+  __m128i ranges = {0};
+  int ranges_len = 0;
+  switch (class) {
+  case HTTP_SCAN_TOKEN:
+    ranges = _mm_loadu_si128((const __m128i *)(const void *)token_ranges);
+    ranges_len = 16;
+    break;
+  case HTTP_SCAN_TARGET:
+    ranges = _mm_loadu_si128((const __m128i *)(const void *)target_ranges);
+    ranges_len = 4;
+    break;
+  case HTTP_SCAN_VALUE:
+    ranges = _mm_loadu_si128((const __m128i *)(const void *)value_ranges);
+    ranges_len = 6;
+    break;
+  }
+
+  for (; i + 16 <= len; i += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128((const __m128i *)(const void *)(data + i));
+    const int found = _mm_cmpestri(
+        ranges, ranges_len, chunk, 16,
+        _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+    if (found != 16)
+      return i + (usize)found;
+  }
+
+  // The tail, as the last 16 bytes, ignoring those already scanned.
+  if (i < len && len >= 16) {
+    const __m128i chunk =
+        _mm_loadu_si128((const __m128i *)(const void *)(data + len - 16));
+    const u32 mask = (u32)_mm_movemask_epi8(_mm_cmpestrm(
+        ranges, ranges_len, chunk, 16,
+        _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_UNIT_MASK));
+    const u32 remaining = mask >> (16 - (len - i));
+    return remaining != 0 ? i + (usize)__builtin_ctz(remaining) : len;
+  }
+  return http_scan_scalar(data, len, i, class);
+}
+
+// Mask of the bytes of `chunk` ending a token of `class`.
+__attribute__((warn_unused_result, target("avx2"),
+               always_inline)) static inline u32
+http_scan_avx2_mask(__m256i chunk, Http_scan_class class) {
+  switch (class) {
+  case HTTP_SCAN_TOKEN: {
+    // `tchar` lookup by nibble: bit `n` of `low[c & 0xf]` is set if the byte
+    // with this low nibble and the high nibble whose bit is `n` in `high` is a
+    // `tchar`.
+    const __m256i low_table = _mm256_setr_epi8(
+        0x3a, 0x3f, 0x3e, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3e, 0x3e, 0x3d, 0x15,
+        0x34, 0x15, 0x3d, 0x1c, 0x3a, 0x3f, 0x3e, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+        0x3e, 0x3e, 0x3d, 0x15, 0x34, 0x15, 0x3d, 0x1c);
+    const __m256i high_table = _mm256_setr_epi8(
+        0, 0, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0, 0, 0, 0, 0, 0, 0, 0, //
+        0, 0, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+
+    const __m256i low = _mm256_shuffle_epi8(
+        low_table, _mm256_and_si256(chunk, nibble_mask));
+    const __m256i high = _mm256_shuffle_epi8(
+        high_table, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble_mask));
+    return (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_and_si256(low, high), _mm256_setzero_si256()));
+  }
+  case HTTP_SCAN_TARGET: {
+    // Unsigned `c <= ' '`.
+    const __m256i at_most_space = _mm256_cmpeq_epi8(
+        _mm256_min_epu8(chunk, _mm256_set1_epi8(' ')), chunk);
+    const __m256i del = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(0x7f));
+    return (u32)_mm256_movemask_epi8(_mm256_or_si256(at_most_space, del));
+  }
+  case HTTP_SCAN_VALUE: {
+    const __m256i control = _mm256_andnot_si256(
+        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\t')),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, _mm256_set1_epi8(0x1f)),
+                          chunk));
+    const __m256i del = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(0x7f));
+    return (u32)_mm256_movemask_epi8(_mm256_or_si256(control, del));
+  }
+  default:
+    pg_assert(0 && "unreachable");
+  }
+}
+
+__attribute__((warn_unused_result, target("avx2"))) static usize
+http_scan_avx2(const u8 *_Nonnull data, usize len, usize i,
+               Http_scan_class class) {
+  for (; i + 32 <= len; i += 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256((const __m256i *)(const void *)(data + i));
+    const u32 mask = http_scan_avx2_mask(chunk, class);
+    if (mask != 0)
+      return i + (usize)__builtin_ctz(mask);
+  }
+
+  // The tail, as the last 32 bytes, ignoring those already scanned.
+  if (i < len && len >= 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256((const __m256i *)(const void *)(data + len - 32));
+    const u32 mask = http_scan_avx2_mask(chunk, class) >> (32 - (len - i));
+    return mask != 0 ? i + (usize)__builtin_ctz(mask) : len;
+  }
+  return http_scan_scalar(data, len, i, class);
+}
+#endif
+
+__attribute__((warn_unused_result)) static Http_scan_kernel
+http_scan_kernel_for(Simd_level level) {
+  switch (level) {
+#if defined(__x86_64__)
+  case SIMD_LEVEL_AVX2:
+    return http_scan_avx2;
+  case SIMD_LEVEL_SSE42:
+    return http_scan_sse42;
+#endif
+  default:
+    return http_scan_scalar;
+  }
+}
+
+// Picked at startup for this CPU, or by the tests.
+static Http_scan_kernel _Nullable http_scan_kernel = NULL;
+
+// Index of the first byte of `s` from `i` which ends a token of `class`, or
+// `s.len`.
+__attribute__((warn_unused_result)) static usize
+http_scan(Str s, usize i, Http_scan_class class) {
+  if (http_scan_kernel == NULL) {
+    http_scan_kernel = http_scan_kernel_for(simd_level());
+  }
+
+  while (i < s.len) {
+    i = http_scan_kernel(s.data, s.len, i, class);
+    if (i == s.len || http_scan_stops_at(class, s.data[i]))
+      return i;
+    i += 1;
+  }
+  return s.len;
+}
+
+// Little-endian word of the first (up to) 8 bytes.
+__attribute__((warn_unused_result)) static u64 http_load_word(Str s, usize i) {
+  u64 word = 0;
+  memcpy(&word, s.data + i, pg_min(s.len - i, sizeof(word)));
+  return word;
+}
+
+// Methods with their trailing space, so that both are matched at once.
+static const struct {
+  char name[8];
+  u8 len;
+  pg_pad(3);
+  Method method;
+} http_methods[] = {
+    {.name = "GET ", .len = 4, .method = HTTP_METHOD_GET},
+    {.name = "POST ", .len = 5, .method = HTTP_METHOD_POST},
+    {.name = "PUT ", .len = 4, .method = HTTP_METHOD_PUT},
+    {.name = "HEAD ", .len = 5, .method = HTTP_METHOD_HEAD},
+    {.name = "PATCH ", .len = 6, .method = HTTP_METHOD_PATCH},
+    {.name = "DELETE ", .len = 7, .method = HTTP_METHOD_DELETE},
+    {.name = "TRACE ", .len = 6, .method = HTTP_METHOD_TRACE},
+    {.name = "CONNECT ", .len = 8, .method = HTTP_METHOD_CONNECT},
+};
+
+// Classify the method from a single 8-byte load. Returns the length matched,
+// including the space, or 0.
+__attribute__((warn_unused_result)) static u8
+http_parse_method(Str s, Method *_Nonnull method) {
+  const u64 word = http_load_word(s, 0);
+
+  for (u64 i = 0; i < carray_count(http_methods); i++) {
+    const u8 len = http_methods[i].len;
+    const u64 mask = len == 8 ? ~0UL : (1UL << (len * 8)) - 1;
+    u64 expected = 0;
+    memcpy(&expected, http_methods[i].name, sizeof(expected));
+
+    if ((word & mask) == expected && len <= s.len) {
+      *method = http_methods[i].method;
+      return len;
     }
+  }
+  return 0;
+}
 
-    pg_assert(read_cursor_match(cursor, str_from_c(":")));
+__attribute__((warn_unused_result)) static bool
+http_char_is_whitespace(u8 c) {
+  return c == ' ' || c == '\t';
+}
 
-    Str value = read_cursor_match_until_excl(cursor, str_from_c("\r\n"));
-    if (str_is_empty(value)) {
+// Parse the header fields starting at `*pos` up to and including the empty
+// line ending them.
+__attribute__((warn_unused_result)) static Request
+parse_headers(Str s, usize *_Nonnull pos, Request req, Arena *arena) {
+  usize i = *pos;
+
+  for (;;) {
+    if (i + 2 > s.len)
       return (Request){.error = true};
+    if (s.data[i] == '\r' && s.data[i + 1] == '\n') {
+      *pos = i + 2;
+      return req;
     }
-    value = str_trim_left(value, ' ');
 
-    pg_assert(read_cursor_match(cursor, str_from_c("\r\n")));
+    const usize key_start = i;
+    i = http_scan(s, i, HTTP_SCAN_TOKEN);
+    if (i == key_start || i == s.len || s.data[i] != ':')
+      return (Request){.error = true};
+    const Str key = {.data = s.data + key_start, .len = i - key_start};
+    i += 1;
 
-    Header *header = arena_alloc(arena, sizeof(Header), _Alignof(Header), 1);
-    *header = (Header){.key = key, .value = value};
+    while (i < s.len && http_char_is_whitespace(s.data[i])) {
+      i += 1;
+    }
 
-    if (req.headers == NULL) {
-      it = req.headers = header;
+    const usize value_start = i;
+    i = http_scan(s, i, HTTP_SCAN_VALUE);
+    if (i + 2 > s.len || s.data[i] != '\r' || s.data[i + 1] != '\n')
+      return (Request){.error = true};
+    Str value = {.data = s.data + value_start, .len = i - value_start};
+    while (value.len > 0 &&
+           http_char_is_whitespace(value.data[value.len - 1])) {
+      value.len -= 1;
     }
+    i += 2;
 
-    it = it->next = header;
+    http_headers_add(&req.headers, key, value, arena);
   }
+}
 
-  return req;
+// Split the request target into the path, without its dot segments, and the
+// query, dropping the fragment. Views into `target`: nothing is copied unless
+// the path has dot segments. Raw bytes above ASCII must be UTF-8, for the
+// router and the handlers to match and print the path safely.
+__attribute__((warn_unused_result)) static bool
+http_request_set_target(Request *_Nonnull req, Str target,
+                        Arena *_Nonnull arena) {
+  if (!utf8_valid(target))
+    return false;
+
+  const Str url = str_split(target, '#').left;
+  const Str_split_result split = str_split(url, '?');
+  req->path = http_path_normalize(split.left, arena);
+  req->query = split.found ? split.right : (Str){0};
+  return true;
 }
 
 __attribute__((warn_unused_result)) static Request
@@ -82,99 +807,837 @@ parse_request(Read_result read_res, Arena *arena) {
     return (Request){.error = read_res.error};
   }
 
-  Read_cursor cursor = {.s = read_res.content};
+  const Str s = read_res.content;
   Request req = {0};
 
-  {
-    if (read_cursor_match(&cursor, str_from_c("GET"))) {
-      req.method = HTTP_METHOD_GET;
-    } else if (read_cursor_match(&cursor, str_from_c("POST"))) {
-      req.method = HTTP_METHOD_POST;
-    } else if (read_cursor_match(&cursor, str_from_c("PATCH"))) {
-      req.method = HTTP_METHOD_PATCH;
-    } else if (read_cursor_match(&cursor, str_from_c("PUT"))) {
-      req.method = HTTP_METHOD_PUT;
-    } else if (read_cursor_match(&cursor, str_from_c("DELETE"))) {
-      req.method = HTTP_METHOD_DELETE;
-    } else if (read_cursor_match(&cursor, str_from_c("HEAD"))) {
-      req.method = HTTP_METHOD_HEAD;
-    } else if (read_cursor_match(&cursor, str_from_c("CONNECT"))) {
-      req.method = HTTP_METHOD_CONNECT;
-    } else if (read_cursor_match(&cursor, str_from_c("TRACE"))) {
-      req.method = HTTP_METHOD_TRACE;
-    } else {
-      return (Request){.error = true};
-    }
+  usize i = http_parse_method(s, &req.method);
+  if (i == 0) {
+    return (Request){.error = true};
   }
 
-  if (!read_cursor_match(&cursor, str_from_c(" "))) {
+  const usize url_start = i;
+  i = http_scan(s, i, HTTP_SCAN_TARGET);
+  if (i == url_start || i == s.len || s.data[i] != ' ') {
     return (Request){.error = true};
   }
-
-  const Str url = read_cursor_match_until_excl_char(&cursor, ' ');
-  if (str_is_empty(url)) {
+  if (!http_request_set_target(
+          &req, (Str){.data = s.data + url_start, .len = i - url_start},
+          arena)) {
     return (Request){.error = true};
   }
-  // TODO: Parse url.
-  req.path = req.params = url; // FIXME
+  i += 1;
 
-  if (!read_cursor_match(&cursor, str_from_c(" HTTP/1.1\r\n"))) {
+  // `HTTP/1.x\r\n`.
+  if (i + 10 > s.len || s.data[i + 8] != '\r' || s.data[i + 9] != '\n') {
     return (Request){.error = true};
   }
+  const u64 version = http_load_word(s, i);
+  u64 version_1_0 = 0, version_1_1 = 0;
+  memcpy(&version_1_0, "HTTP/1.0", sizeof(u64));
+  memcpy(&version_1_1, "HTTP/1.1", sizeof(u64));
+  if (version == version_1_1) {
+    req.version_minor = 1;
+  } else if (version == version_1_0) {
+    req.version_minor = 0;
+  } else {
+    return (Request){.error = true};
+  }
+  i += 10;
 
-  req = parse_headers(&cursor, req, arena);
+  req = parse_headers(s, &i, req, arena);
   if (req.error) {
     return (Request){.error = true};
   }
 
+  req.keep_alive = http_request_keep_alive(req);
+
   return req;
 }
 
-__attribute__((warn_unused_result)) static Str status_to_str(u16 status) {
-  switch (status) {
-  case 200:
-    return str_from_c("200 OK");
-  case 400:
-    return str_from_c("400 Bad Request");
-  case 404:
-    return str_from_c("404 Not Found");
-  case 500:
-    return str_from_c("500 Server Error");
-  default:
-    pg_assert(0 && "todo");
+// --------------------------- Request bodies
+
+// `Transfer-Encoding: chunked` (RFC 9112, section 7.1), decoded as it arrives
+// with a state machine, one byte at a time except for the chunk data.
+typedef enum {
+  HTTP_CHUNKED_SIZE,
+  HTTP_CHUNKED_EXTENSION,
+  HTTP_CHUNKED_SIZE_LF,
+  HTTP_CHUNKED_DATA,
+  HTTP_CHUNKED_DATA_CR,
+  HTTP_CHUNKED_DATA_LF,
+  HTTP_CHUNKED_TRAILER,
+  HTTP_CHUNKED_TRAILER_LINE,
+  HTTP_CHUNKED_TRAILER_LINE_LF,
+  HTTP_CHUNKED_END_LF,
+  HTTP_CHUNKED_DONE,
+} Http_chunked_state;
+
+typedef enum {
+  HTTP_BODY_NEED_MORE,
+  HTTP_BODY_COMPLETE,
+  HTTP_BODY_INVALID,
+} Http_body_progress;
+
+// Framing of a request body being received, into a buffer holding the bytes
+// received past the headers.
+typedef struct {
+  u64 content_length;
+  // Chunked: size of the current chunk while parsing it, then what is left of
+  // it.
+  u64 chunk_remaining;
+  // Bytes handed to a streaming handler, and dropped from the buffer.
+  u64 streamed;
+  // Bytes of the buffer consumed, and decoded body bytes at its start.
+  usize raw_len;
+  usize len;
+  Http_chunked_state chunked_state;
+  u8 chunk_size_digits;
+  bool chunked;
+  pg_pad(2);
+} Http_body;
+
+// Parse a `Content-Length` value: digits only, which fit in 64 bits.
+__attribute__((warn_unused_result)) static bool
+http_parse_content_length(Str value, u64 *_Nonnull length) {
+  if (str_is_empty(value))
+    return false;
+
+  u64 n = 0;
+  for (usize i = 0; i < value.len; i++) {
+    const u8 c = value.data[i];
+    if (!char_is_digit(c))
+      return false;
+    if (__builtin_mul_overflow(n, 10, &n) ||
+        __builtin_add_overflow(n, (u64)(c - '0'), &n))
+      return false;
   }
+  *length = n;
+  return true;
 }
 
-__attribute__((warn_unused_result)) static Str response_to_str(Response res,
-                                                               Arena *arena) {
-  Str_builder out = sb_new(1 * KiB, arena);
-  {
-    out = sb_append(out, str_from_c("HTTP/1.1 "), arena);
-    out = sb_append(out, status_to_str(res.status), arena);
+// Find how the body of `req` is framed. A request with both a length and
+// chunks is rejected, since the two could be read differently by a proxy, as
+// is one with an invalid length, with differing lengths, or with several
+// transfer encodings (RFC 9112, section 6.3).
+__attribute__((warn_unused_result)) static bool
+http_body_init(Request req, Http_body *_Nonnull body) {
+  *body = (Http_body){0};
+
+  if (http_known_header_repeated(req.headers, HTTP_HEADER_TRANSFER_ENCODING,
+                                 true) ||
+      http_known_header_repeated(req.headers, HTTP_HEADER_CONTENT_LENGTH,
+                                 false))
+    return false;
+
+  const Header *const transfer_encoding =
+      http_find_known_header(req.headers, HTTP_HEADER_TRANSFER_ENCODING);
+  const Header *const content_length =
+      http_find_known_header(req.headers, HTTP_HEADER_CONTENT_LENGTH);
+  if (transfer_encoding != NULL) {
+    body->chunked = true;
+    return content_length == NULL &&
+           str_eq_ignore_case(transfer_encoding->value, str_from_c("chunked"));
+  }
+
+  return content_length == NULL ||
+         http_parse_content_length(content_length->value,
+                                   &body->content_length);
+}
+
+// Whether the body is already complete before receiving anything past the
+// headers.
+__attribute__((warn_unused_result)) static bool
+http_body_is_empty(Http_body body) {
+  return !body.chunked && body.content_length == 0;
+}
+
+typedef enum {
+  HTTP_EXPECT_NONE,
+  // The client waits for a `100 Continue` before sending the body.
+  HTTP_EXPECT_CONTINUE,
+  // To be answered with a 417.
+  HTTP_EXPECT_UNSUPPORTED,
+} Http_expect;
+
+// What the client expects before sending the body. HTTP/1.0 clients do not
+// know about it, so the header is ignored.
+__attribute__((warn_unused_result)) static Http_expect
+http_request_expect(Request req) {
+  const Header *const expect =
+      http_find_known_header(req.headers, HTTP_HEADER_EXPECT);
+  if (expect == NULL || req.version_minor == 0)
+    return HTTP_EXPECT_NONE;
+
+  return str_eq_ignore_case(expect->value, str_from_c("100-continue"))
+             ? HTTP_EXPECT_CONTINUE
+             : HTTP_EXPECT_UNSUPPORTED;
+}
+
+static const Str HTTP_CONTINUE_RESPONSE = {
+    .data = (u8 *)"HTTP/1.1 100 Continue\r\n\r\n",
+    .len = sizeof("HTTP/1.1 100 Continue\r\n\r\n") - 1,
+};
+
+// Decode the chunks in `data`, from where the previous call stopped, moving
+// their data down over the framing so that the decoded body is contiguous at
+// the start of `data`, without copying it elsewhere.
+__attribute__((warn_unused_result)) static Http_body_progress
+http_body_decode_chunked(Http_body *_Nonnull body, u8 *_Nonnull data,
+                         usize len) {
+  usize i = body->raw_len;
+  while (i < len && body->chunked_state != HTTP_CHUNKED_DONE) {
+    const u8 c = data[i];
+
+    switch (body->chunked_state) {
+    case HTTP_CHUNKED_SIZE: {
+      u8 digit = 0;
+      if (http_hex_digit(c, &digit)) {
+        // At most 60 bits.
+        if (body->chunk_size_digits == 15)
+          return HTTP_BODY_INVALID;
+        body->chunk_size_digits += 1;
+        body->chunk_remaining = body->chunk_remaining << 4 | digit;
+        i += 1;
+        break;
+      }
+      if (body->chunk_size_digits == 0)
+        return HTTP_BODY_INVALID;
+      if (c == ';' || http_char_is_whitespace(c))
+        body->chunked_state = HTTP_CHUNKED_EXTENSION;
+      else if (c == '\r')
+        body->chunked_state = HTTP_CHUNKED_SIZE_LF;
+      else
+        return HTTP_BODY_INVALID;
+      i += 1;
+    } break;
+    case HTTP_CHUNKED_EXTENSION:
+      // Ignored.
+      if (c == '\r')
+        body->chunked_state = HTTP_CHUNKED_SIZE_LF;
+      else if (c == '\n')
+        return HTTP_BODY_INVALID;
+      i += 1;
+      break;
+    case HTTP_CHUNKED_SIZE_LF:
+      if (c != '\n')
+        return HTTP_BODY_INVALID;
+      body->chunked_state = body->chunk_remaining == 0 ? HTTP_CHUNKED_TRAILER
+                                                       : HTTP_CHUNKED_DATA;
+      body->chunk_size_digits = 0;
+      i += 1;
+      break;
+    case HTTP_CHUNKED_DATA: {
+      const usize n = (usize)pg_min(body->chunk_remaining, (u64)(len - i));
+      if (body->len != i)
+        memmove(data + body->len, data + i, n);
+      body->len += n;
+      body->chunk_remaining -= n;
+      i += n;
+      if (body->chunk_remaining == 0)
+        body->chunked_state = HTTP_CHUNKED_DATA_CR;
+    } break;
+    case HTTP_CHUNKED_DATA_CR:
+      if (c != '\r')
+        return HTTP_BODY_INVALID;
+      body->chunked_state = HTTP_CHUNKED_DATA_LF;
+      i += 1;
+      break;
+    case HTTP_CHUNKED_DATA_LF:
+      if (c != '\n')
+        return HTTP_BODY_INVALID;
+      body->chunked_state = HTTP_CHUNKED_SIZE;
+      i += 1;
+      break;
+    case HTTP_CHUNKED_TRAILER:
+      // Trailer fields are ignored.
+      body->chunked_state =
+          c == '\r' ? HTTP_CHUNKED_END_LF : HTTP_CHUNKED_TRAILER_LINE;
+      i += 1;
+      break;
+    case HTTP_CHUNKED_TRAILER_LINE:
+      if (c == '\r')
+        body->chunked_state = HTTP_CHUNKED_TRAILER_LINE_LF;
+      i += 1;
+      break;
+    case HTTP_CHUNKED_TRAILER_LINE_LF:
+    case HTTP_CHUNKED_END_LF:
+      if (c != '\n')
+        return HTTP_BODY_INVALID;
+      body->chunked_state = body->chunked_state == HTTP_CHUNKED_END_LF
+                                ? HTTP_CHUNKED_DONE
+                                : HTTP_CHUNKED_TRAILER;
+      i += 1;
+      break;
+    case HTTP_CHUNKED_DONE:
+    default:
+      pg_assert(0 && "unreachable");
+    }
+  }
+
+  body->raw_len = i;
+  return body->chunked_state == HTTP_CHUNKED_DONE ? HTTP_BODY_COMPLETE
+                                                  : HTTP_BODY_NEED_MORE;
+}
+
+// Consume what `data`, the `len` bytes received past the headers, holds of
+// the body: its first `body->len` bytes are then the body so far, and once
+// complete, the next request starts at `body->raw_len`.
+__attribute__((warn_unused_result)) static Http_body_progress
+http_body_decode(Http_body *_Nonnull body, u8 *_Nonnull data, usize len) {
+  if (body->chunked)
+    return http_body_decode_chunked(body, data, len);
+
+  body->len = body->raw_len =
+      (usize)pg_min((u64)len, body->content_length - body->streamed);
+  return body->streamed + body->len == body->content_length
+             ? HTTP_BODY_COMPLETE
+             : HTTP_BODY_NEED_MORE;
+}
+
+// Drop the chunk framing decoded so far from a buffered body, moving the bytes
+// received past it down so that the buffer holds little more than the body.
+// Returns the new length of `data`.
+__attribute__((warn_unused_result)) static usize
+http_body_compact(Http_body *_Nonnull body, u8 *_Nonnull data, usize len) {
+  const usize framing = body->raw_len - body->len;
+  memmove(data + body->len, data + body->raw_len, len - body->raw_len);
+  // Zeroed as the builders expect past their end.
+  memset(data + len - framing, 0, framing);
+  body->raw_len = body->len;
+  return len - framing;
+}
+
+// The body so far has been handed to a streaming handler: the buffer can be
+// emptied. Only when more is needed, i.e. the buffer has been consumed.
+static void http_body_drop(Http_body *_Nonnull body) {
+  body->streamed += body->len;
+  body->raw_len = body->len = 0;
+}
+
+// Status lines of the standard status codes, indexed by code, so that writing
+// one is a single copy. Any other code gets a line without a reason phrase.
+#define HTTP_STATUS_LINE(code, reason)                                         \
+  [code] = {                                                                   \
+      .data = (u8 *)"HTTP/1.1 " #code " " reason "\r\n",                       \
+      .len = sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1,                  \
+  }
+
+static const Str http_status_lines[600] = {
+    HTTP_STATUS_LINE(100, "Continue"),
+    HTTP_STATUS_LINE(101, "Switching Protocols"),
+    HTTP_STATUS_LINE(102, "Processing"),
+    HTTP_STATUS_LINE(103, "Early Hints"),
+    HTTP_STATUS_LINE(200, "OK"),
+    HTTP_STATUS_LINE(201, "Created"),
+    HTTP_STATUS_LINE(202, "Accepted"),
+    HTTP_STATUS_LINE(203, "Non-Authoritative Information"),
+    HTTP_STATUS_LINE(204, "No Content"),
+    HTTP_STATUS_LINE(205, "Reset Content"),
+    HTTP_STATUS_LINE(206, "Partial Content"),
+    HTTP_STATUS_LINE(207, "Multi-Status"),
+    HTTP_STATUS_LINE(208, "Already Reported"),
+    HTTP_STATUS_LINE(226, "IM Used"),
+    HTTP_STATUS_LINE(300, "Multiple Choices"),
+    HTTP_STATUS_LINE(301, "Moved Permanently"),
+    HTTP_STATUS_LINE(302, "Found"),
+    HTTP_STATUS_LINE(303, "See Other"),
+    HTTP_STATUS_LINE(304, "Not Modified"),
+    HTTP_STATUS_LINE(305, "Use Proxy"),
+    HTTP_STATUS_LINE(307, "Temporary Redirect"),
+    HTTP_STATUS_LINE(308, "Permanent Redirect"),
+    HTTP_STATUS_LINE(400, "Bad Request"),
+    HTTP_STATUS_LINE(401, "Unauthorized"),
+    HTTP_STATUS_LINE(402, "Payment Required"),
+    HTTP_STATUS_LINE(403, "Forbidden"),
+    HTTP_STATUS_LINE(404, "Not Found"),
+    HTTP_STATUS_LINE(405, "Method Not Allowed"),
+    HTTP_STATUS_LINE(406, "Not Acceptable"),
+    HTTP_STATUS_LINE(407, "Proxy Authentication Required"),
+    HTTP_STATUS_LINE(408, "Request Timeout"),
+    HTTP_STATUS_LINE(409, "Conflict"),
+    HTTP_STATUS_LINE(410, "Gone"),
+    HTTP_STATUS_LINE(411, "Length Required"),
+    HTTP_STATUS_LINE(412, "Precondition Failed"),
+    HTTP_STATUS_LINE(413, "Content Too Large"),
+    HTTP_STATUS_LINE(414, "URI Too Long"),
+    HTTP_STATUS_LINE(415, "Unsupported Media Type"),
+    HTTP_STATUS_LINE(416, "Range Not Satisfiable"),
+    HTTP_STATUS_LINE(417, "Expectation Failed"),
+    HTTP_STATUS_LINE(418, "I'm a teapot"),
+    HTTP_STATUS_LINE(421, "Misdirected Request"),
+    HTTP_STATUS_LINE(422, "Unprocessable Content"),
+    HTTP_STATUS_LINE(423, "Locked"),
+    HTTP_STATUS_LINE(424, "Failed Dependency"),
+    HTTP_STATUS_LINE(425, "Too Early"),
+    HTTP_STATUS_LINE(426, "Upgrade Required"),
+    HTTP_STATUS_LINE(428, "Precondition Required"),
+    HTTP_STATUS_LINE(429, "Too Many Requests"),
+    HTTP_STATUS_LINE(431, "Request Header Fields Too Large"),
+    HTTP_STATUS_LINE(451, "Unavailable For Legal Reasons"),
+    HTTP_STATUS_LINE(500, "Internal Server Error"),
+    HTTP_STATUS_LINE(501, "Not Implemented"),
+    HTTP_STATUS_LINE(502, "Bad Gateway"),
+    HTTP_STATUS_LINE(503, "Service Unavailable"),
+    HTTP_STATUS_LINE(504, "Gateway Timeout"),
+    HTTP_STATUS_LINE(505, "HTTP Version Not Supported"),
+    HTTP_STATUS_LINE(506, "Variant Also Negotiates"),
+    HTTP_STATUS_LINE(507, "Insufficient Storage"),
+    HTTP_STATUS_LINE(508, "Loop Detected"),
+    HTTP_STATUS_LINE(510, "Not Extended"),
+    HTTP_STATUS_LINE(511, "Network Authentication Required"),
+};
+
+#undef HTTP_STATUS_LINE
+
+// Status line of `status`, e.g. `HTTP/1.1 200 OK\r\n`.
+__attribute__((warn_unused_result)) static Str
+http_status_line(u16 status, Arena *_Nonnull arena) {
+  pg_assert(status >= 100 && status < carray_count(http_status_lines));
+
+  const Str line = http_status_lines[status];
+  if (!str_is_empty(line))
+    return line;
+
+  Str_builder out = sb_new(str_from_c("HTTP/1.1 999 \r\n").len, arena);
+  out = sb_append(out, str_from_c("HTTP/1.1 "), arena);
+  out = sb_append_u64(out, status, arena);
+  out = sb_append(out, str_from_c(" \r\n"), arena);
+  return sb_build(out);
+}
+
+// Value of the `Date` header, e.g. `Sun, 06 Nov 1994 08:49:37 GMT`. It is
+// formatted at most once per second: each worker being a process of its own,
+// the cache is per worker.
+static struct {
+  i64 second;
+  char value[32];
+} http_date_cache = {.second = -1};
+
+static const usize HTTP_DATE_LEN = 29;
+
+// Value of the `Date` header at `second`, since the epoch, formatted unless
+// it is the one cached.
+__attribute__((warn_unused_result)) static Str http_date_at(i64 second) {
+  if (second != http_date_cache.second) {
+    const time_t t = (time_t)second;
+    struct tm tm = {0};
+    pg_assert(gmtime_r(&t, &tm) != NULL);
+    const usize len =
+        strftime(http_date_cache.value, sizeof(http_date_cache.value),
+                 "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    pg_assert(len == HTTP_DATE_LEN);
+    http_date_cache.second = second;
+  }
+
+  return (Str){.data = (u8 *)http_date_cache.value, .len = HTTP_DATE_LEN};
+}
+
+__attribute__((warn_unused_result)) static Str http_date_now(void) {
+  struct timespec ts = {0};
+  pg_assert(clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0);
+  return http_date_at(ts.tv_sec);
+}
+
+// Format header lines once, e.g. the constant headers of a route, to be
+// copied as is in each response with `Response.headers_block`.
+__attribute__((warn_unused_result)) static Str
+http_headers_serialize(Http_headers headers, Arena *_Nonnull arena) {
+  usize len = 0;
+  for (u32 i = 0; i < headers.list.len; i++) {
+    len += headers.list.data[i].key.len + headers.list.data[i].value.len + 4;
+  }
+
+  Str_builder out = sb_new(len, arena);
+  for (u32 i = 0; i < headers.list.len; i++) {
+    const Header header = headers.list.data[i];
+    out = sb_append(out, header.key, arena);
+    out = sb_append(out, str_from_c(": "), arena);
+    out = sb_append(out, header.value, arena);
     out = sb_append(out, str_from_c("\r\n"), arena);
   }
+  return sb_build(out);
+}
 
-  {
+// Responses without a body cannot have `Content-Length` (RFC 9110, section
+// 8.6), but for not modified ones which describe the body they do not have:
+// it is omitted for these too.
+__attribute__((warn_unused_result)) static bool
+http_status_has_content_length(u16 status) {
+  return status >= 200 && status != 204 && status != 304;
+}
+
+// Status line and headers of `res`, sized up front so that they are written
+// once into a buffer of their own: the body is sent from where it is. Without
+// `date`, the `Date` header is omitted.
+__attribute__((warn_unused_result)) static Str
+response_head_build(Response res, Str date, Arena *_Nonnull arena) {
+  const bool content_length = http_status_has_content_length(res.status);
+
+  const Str status_line = http_status_line(res.status, arena);
+
+  usize len = status_line.len + res.headers_block.len + 2;
+  if (!str_is_empty(date))
+    len += str_from_c("Date: \r\n").len + date.len;
+  if (content_length)
+    len += str_from_c("Content-Length:\r\n").len + 20;
+  for (u32 i = 0; i < res.headers.list.len; i++) {
+    len += res.headers.list.data[i].key.len +
+           res.headers.list.data[i].value.len + 4;
+  }
+
+  Str_builder out = sb_new(len, arena);
+  out = sb_append(out, status_line, arena);
+
+  if (!str_is_empty(date)) {
+    out = sb_append(out, str_from_c("Date: "), arena);
+    out = sb_append(out, date, arena);
+    out = sb_append(out, str_from_c("\r\n"), arena);
+  }
+
+  if (content_length) {
     out = sb_append(out, str_from_c("Content-Length:"), arena);
-    out = sb_append_u64(out, res.body.len, arena);
+    out = sb_append_u64(out, res.body.len + res.file_len, arena);
+    out = sb_append(out, str_from_c("\r\n"), arena);
+  }
+
+  out = sb_append(out, res.headers_block, arena);
+
+  for (u32 i = 0; i < res.headers.list.len; i++) {
+    const Header header = res.headers.list.data[i];
+    out = sb_append(out, header.key, arena);
+    out = sb_append(out, str_from_c(": "), arena);
+    out = sb_append(out, header.value, arena);
     out = sb_append(out, str_from_c("\r\n"), arena);
   }
 
   out = sb_append(out, str_from_c("\r\n"), arena);
-  out = sb_append(out, res.body, arena);
+  pg_assert(out.len <= len);
+
+  return sb_build(out);
+}
+
+__attribute__((warn_unused_result)) static Str
+response_head_to_str(Response res, Arena *_Nonnull arena) {
+  return response_head_build(res, http_date_now(), arena);
+}
 
+// The whole response in one buffer, for the ones prepared in advance, which
+// carry no `Date` since it would be stale when sent.
+__attribute__((warn_unused_result)) static Str response_to_str(Response res,
+                                                               Arena *arena) {
+  Str_builder out = sb_new(1 * KiB, arena);
+  out = sb_append(out, response_head_build(res, (Str){0}, arena), arena);
+  out = sb_append(out, res.body, arena);
   return sb_build(out);
 }
 
-__attribute__((warn_unused_result)) static Header *
-http_find_header(Header *headers, Str key) {
-  Header *it = headers;
-  while (it != NULL) {
-    // TODO: Case-insensitive check.
-    if (str_eq(it->key, key))
-      return it;
+static void test_http_parse(void) {
+  Arena arena = arena_new(64 * KiB, NULL);
+
+  const Str request = str_from_c(
+      "GET /search?q=simd&lang=en HTTP/1.1\r\n"
+      "Host: www.example.com\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+      "Firefox/128.0\r\n"
+      "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8"
+      "\r\n"
+      "Accept-Language: en-US,en;q=0.5\r\n"
+      "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+      "Cookie: session=0123456789abcdef; theme=dark\t \r\n"
+      "X-Weird: caf\xc3\xa9\r\n"
+      "Connection: keep-alive\r\n"
+      "\r\n");
+
+  const Simd_level max_level = simd_level();
+  for (u32 level = SIMD_LEVEL_SCALAR; level <= max_level; level++) {
+    http_scan_kernel = http_scan_kernel_for((Simd_level)level);
+
+    Request req = parse_request((Read_result){.content = request}, &arena);
+    pg_assert(!req.error);
+    pg_assert(req.method == HTTP_METHOD_GET);
+    pg_assert(str_eq_c(req.path, "/search"));
+    pg_assert(str_eq_c(req.query, "q=simd&lang=en"));
+    pg_assert(req.version_minor == 1 && req.keep_alive);
+
+    pg_assert(req.headers.list.len == 8);
+    const Header *const cookie =
+        http_find_header(req.headers, str_from_c("cOOKIE"));
+    pg_assert(cookie &&
+              str_eq_c(cookie->value, "session=0123456789abcdef; theme=dark"));
+    const Header *const weird =
+        http_find_header(req.headers, str_from_c("X-Weird"));
+    pg_assert(weird && str_eq_c(weird->value, "caf\xc3\xa9"));
+    const Header *const host =
+        http_find_known_header(req.headers, HTTP_HEADER_HOST);
+    pg_assert(host && str_eq_c(host->value, "www.example.com"));
+    pg_assert(http_find_known_header(req.headers, HTTP_HEADER_EXPECT) == NULL);
+    pg_assert(http_find_header(req.headers, str_from_c("Expect")) == NULL);
+
+    req = parse_request(
+        (Read_result){.content = str_from_c("CONNECT a:443 HTTP/1.0\r\n\r\n")},
+        &arena);
+    pg_assert(!req.error && req.method == HTTP_METHOD_CONNECT);
+    pg_assert(str_eq_c(req.path, "a:443") && req.version_minor == 0);
+
+    char *const invalid[] = {
+        "GETS / HTTP/1.1\r\n\r\n",
+        "GET  HTTP/1.1\r\n\r\n",
+        "GET / HTTP/2.0\r\n\r\n",
+        "GET /\x01 HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost: x\r\n",
+        "GET / HTTP/1.1\r\nHo st: x\r\n\r\n",
+        "GET / HTTP/1.1\r\n: x\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost: x\ny\r\n\r\n",
+        "GET / HTTP/1.1\r\nX-A-Very-Long-Header-Name(: x\r\n\r\n",
+        "GET",
+    };
+    for (u64 i = 0; i < carray_count(invalid); i++) {
+      req = parse_request((Read_result){.content = str_from_c(invalid[i])},
+                          &arena);
+      pg_assert(req.error);
+    }
+
+    // Every byte value, at every position of a vector.
+    u8 buf[80] = {0};
+    for (u32 c = 0; c < 256; c++) {
+      for (u32 pos = 0; pos < 64; pos++) {
+        memset(buf, 'a', sizeof(buf));
+        buf[pos] = (u8)c;
+        const Str s = {.data = buf, .len = sizeof(buf)};
+        for (u32 class = HTTP_SCAN_TOKEN; class <= HTTP_SCAN_VALUE; class++) {
+          const usize expected =
+              http_scan_stops_at((Http_scan_class)class, (u8)c) ? pos
+                                                                 : sizeof(buf);
+          pg_assert(http_scan(s, 0, (Http_scan_class)class) == expected);
+        }
+      }
+    }
+  }
+
+  http_scan_kernel = http_scan_kernel_for(max_level);
+
+  // URLs.
+  {
+    Request req = parse_request(
+        (Read_result){.content = str_from_c(
+                          "GET /a/./b/../../c/%2e/?x=1&q=a%20b+c&&e#frag "
+                          "HTTP/1.1\r\n\r\n")},
+        &arena);
+    pg_assert(!req.error);
+    pg_assert(str_eq_c(req.path, "/c/%2e/"));
+    pg_assert(str_eq_c(req.query, "x=1&q=a%20b+c&&e"));
+    pg_assert(!req.query_indexed);
+    pg_assert(str_eq_c(http_request_query_param(&req, str_from_c("q"), &arena),
+                       "a b c"));
+    pg_assert(req.query_indexed && req.query_params_count == 3);
+    pg_assert(str_eq_c(http_request_query_param(&req, str_from_c("x"), &arena),
+                       "1"));
+    pg_assert(str_is_empty(
+        http_request_query_param(&req, str_from_c("e"), &arena)));
+    pg_assert(str_is_empty(
+        http_request_query_param(&req, str_from_c("z"), &arena)));
+
+    // Not copied when already normal.
+    const Str path = str_from_c("/a/.b/c..");
+    pg_assert(http_path_normalize(path, &arena).data == path.data);
+
+    char *const paths[][2] = {
+        {"/..", "/"},     {"/.", "/"},         {"/a/..", "/"},
+        {"/a/.", "/a/"},  {"/a//../b", "/a/b"}, {"/a/b/../../..", "/"},
+        {"/./a/", "/a/"}, {"/a/../../b/.", "/b/"},
+    };
+    for (u64 i = 0; i < carray_count(paths); i++) {
+      pg_assert(str_eq_c(http_path_normalize(str_from_c(paths[i][0]), &arena),
+                         paths[i][1]));
+    }
+
+    pg_assert(str_eq_c(
+        http_percent_decode(str_from_c("%41%zz%4"), false, &arena), "A%zz%4"));
+
+    // Raw UTF-8 is kept, anything else is rejected.
+    req = parse_request((Read_result){.content = str_from_c(
+                                          "GET /caf\xc3\xa9 HTTP/1.1\r\n\r\n")},
+                        &arena);
+    pg_assert(!req.error);
+    pg_assert(str_eq_c(req.path, "/caf\xc3\xa9"));
+    req = parse_request(
+        (Read_result){.content = str_from_c("GET /caf\xc3 HTTP/1.1\r\n\r\n")},
+        &arena);
+    pg_assert(req.error);
+  }
+
+  // Chunked bodies, at once and byte by byte, followed by another request.
+  {
+    const Str encoded = str_from_c("4;ext=1\r\nWiki\r\n0005\r\npedia\r\n"
+                                   "E\r\n in\r\n\r\nchunks.\r\n0\r\n"
+                                   "Trailer: x\r\n\r\nGET / HTTP/1.1");
+    const usize encoded_len = encoded.len - str_from_c("GET / HTTP/1.1").len;
+
+    for (usize step = 1; step <= encoded.len; step += encoded.len - 1) {
+      u8 *const data = arena_alloc(&arena, 1, 1, encoded.len);
+      memcpy(data, encoded.data, encoded.len);
+      Http_body body = {.chunked = true};
+      Http_body_progress progress = HTTP_BODY_NEED_MORE;
+      for (usize len = step; progress == HTTP_BODY_NEED_MORE; len += step) {
+        progress = http_body_decode(&body, data, pg_min(len, encoded.len));
+      }
+      pg_assert(progress == HTTP_BODY_COMPLETE);
+      pg_assert(body.raw_len == encoded_len);
+      pg_assert(str_eq_c((Str){.data = data, .len = body.len},
+                         "Wikipedia in\r\n\r\nchunks."));
+    }
+
+    char *const invalid[] = {
+        "x\r\n", "\r\n", "4\nWiki", "4\r\nWikiX", "1234567890abcdef\r\n",
+        "0\r\n\r\r",
+    };
+    for (u64 i = 0; i < carray_count(invalid); i++) {
+      const Str s = str_from_c(invalid[i]);
+      u8 *const data = arena_alloc(&arena, 1, 1, s.len);
+      memcpy(data, s.data, s.len);
+      Http_body body = {.chunked = true};
+      pg_assert(http_body_decode(&body, data, s.len) == HTTP_BODY_INVALID);
+    }
+
+    Request req = parse_request(
+        (Read_result){.content = str_from_c(
+                          "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+                          "Content-Length: 3\r\n\r\n")},
+        &arena);
+    Http_body body = {0};
+    pg_assert(!req.error && !http_body_init(req, &body));
+
+    // Repeated framing headers, unless the same length.
+    char *const repeated[] = {
+        "Content-Length: 5\r\nContent-Length: 100\r\n",
+        "Transfer-Encoding: chunked\r\ntransfer-encoding: chunked\r\n",
+    };
+    for (u64 i = 0; i < carray_count(repeated); i++) {
+      Str_builder in = sb_new(128, &arena);
+      in = sb_append_c(in, "POST / HTTP/1.1\r\n", &arena);
+      in = sb_append_c(in, repeated[i], &arena);
+      in = sb_append_c(in, "\r\n", &arena);
+      req = parse_request((Read_result){.content = sb_build(in)}, &arena);
+      pg_assert(!req.error && !http_body_init(req, &body));
+    }
+    req = parse_request(
+        (Read_result){.content = str_from_c("POST / HTTP/1.1\r\n"
+                                            "Content-Length: 5\r\n"
+                                            "Content-Length: 5\r\n\r\n")},
+        &arena);
+    pg_assert(!req.error && http_body_init(req, &body) &&
+              body.content_length == 5);
+  }
+
+  // Invalid lengths and expectations.
+  {
+    u64 length = 0;
+    pg_assert(http_parse_content_length(str_from_c("18446744073709551615"),
+                                        &length) &&
+              length == UINT64_MAX);
+    pg_assert(!http_parse_content_length(str_from_c("18446744073709551616"),
+                                         &length));
+    pg_assert(!http_parse_content_length(str_from_c("99999999999999999999"),
+                                         &length));
+    pg_assert(!http_parse_content_length(str_from_c("-1"), &length));
+    pg_assert(!http_parse_content_length(str_from_c("1 2"), &length));
+    pg_assert(!http_parse_content_length((Str){0}, &length));
+
+    Request req = parse_request(
+        (Read_result){.content = str_from_c("PUT / HTTP/1.1\r\n"
+                                            "Expect: 100-Continue\r\n"
+                                            "Content-Length: 3\r\n\r\n")},
+        &arena);
+    pg_assert(!req.error && http_request_expect(req) == HTTP_EXPECT_CONTINUE);
+    Http_body body = {0};
+    pg_assert(http_body_init(req, &body) && !http_body_is_empty(body));
+
+    req = parse_request(
+        (Read_result){.content = str_from_c("PUT / HTTP/1.1\r\n"
+                                            "Expect: 200-ok\r\n\r\n")},
+        &arena);
+    pg_assert(!req.error &&
+              http_request_expect(req) == HTTP_EXPECT_UNSUPPORTED);
+    pg_assert(http_body_init(req, &body) && http_body_is_empty(body));
+  }
+
+  // Growing the index past its initial size, with a repeated header.
+  {
+    Http_headers headers = {0};
+    for (u32 i = 0; i < 100; i++) {
+      Str_builder key = sb_new(16, &arena);
+      key = sb_append_c(key, "X-", &arena);
+      key = sb_append_u64(key, i, &arena);
+      http_headers_add(&headers, sb_build(key), sb_build(key), &arena);
+    }
+    http_headers_add(&headers, str_from_c("x-7"), str_from_c("again"), &arena);
+    http_headers_add(&headers, str_from_c("CONTENT-length"), str_from_c("3"),
+                     &arena);
+    pg_assert(headers.list.len == 102);
+
+    for (u32 i = 0; i < 100; i++) {
+      Str_builder key = sb_new(16, &arena);
+      key = sb_append_c(key, "x-", &arena);
+      key = sb_append_u64(key, i, &arena);
+      const Header *const header = http_find_header(headers, sb_build(key));
+      pg_assert(header && header == &headers.list.data[i]);
+    }
+    pg_assert(http_find_header(headers, str_from_c("X-100")) == NULL);
+    const Header *const content_length =
+        http_find_known_header(headers, HTTP_HEADER_CONTENT_LENGTH);
+    pg_assert(content_length && str_eq_c(content_length->value, "3"));
+  }
+
+  // The end of the headers, found as the request arrives byte by byte.
+  {
+    usize searched = 0;
+    isize found = -1;
+    usize len = 0;
+    while (found == -1) {
+      len += 1;
+      pg_assert(len <= request.len);
+      found = str_find_resume((Str){.data = request.data, .len = len},
+                              str_from_c("\r\n\r\n"), &searched);
+      pg_assert(searched < len);
+    }
+    pg_assert((usize)found + 4 == request.len && len == request.len);
+  }
+
+  // Response heads.
+  {
+    Response res = {.status = 418, .body = str_from_c("tea")};
+    res.headers_block = str_from_c("Content-Type: text/plain\r\n");
+    http_headers_add(&res.headers, str_from_c("X-Id"), str_from_c("1"),
+                     &arena);
+    const Str head = response_head_to_str(res, &arena);
+    pg_assert(str_starts_with(head, str_from_c("HTTP/1.1 418 I'm a teapot\r\n"
+                                               "Date: ")));
+    pg_assert(str_ends_with(head, str_from_c("\r\nContent-Length:3\r\n"
+                                             "Content-Type: text/plain\r\n"
+                                             "X-Id: 1\r\n\r\n")));
+
+    // Formatted once per second: a value altered in the cache is reused
+    // within the same second, and replaced after it.
+    pg_assert(str_eq_c(http_date_at(784111777),
+                       "Sun, 06 Nov 1994 08:49:37 GMT"));
+    http_date_cache.value[0] = 'X';
+    pg_assert(str_eq_c(http_date_at(784111777),
+                       "Xun, 06 Nov 1994 08:49:37 GMT"));
+    pg_assert(str_eq_c(http_date_at(784111778),
+                       "Sun, 06 Nov 1994 08:49:38 GMT"));
+    http_date_cache.second = -1;
+
+    // No reason phrase for unknown codes, no `Date` in advance.
+    res = (Response){.status = 299};
+    pg_assert(str_eq_c(response_to_str(res, &arena),
+                       "HTTP/1.1 299 \r\nContent-Length:0\r\n\r\n"));
 
-    it = it->next;
+    // Nor `Content-Length` without a body.
+    res = (Response){.status = 204};
+    pg_assert(str_eq_c(response_to_str(res, &arena),
+                       "HTTP/1.1 204 No Content\r\n\r\n"));
+    res = (Response){.status = 101};
+    pg_assert(str_find(response_to_str(res, &arena),
+                       str_from_c("Content-Length")) == -1);
   }
-  return NULL;
 }
@@ -0,0 +1,1234 @@
+#pragma once
+
+#include "arena.h"
+#include "array.h"
+#include "http.h"
+#include "str.h"
+
+// HTTP/2 over cleartext TCP with prior knowledge (h2c, RFC 9113): the client
+// opens the connection with the preface below instead of a request line, then
+// both sides exchange frames. Requests are multiplexed as streams, each with
+// its own flow-control window, and their headers are compressed with HPACK
+// (RFC 7541).
+//
+// This file has the protocol: frames, HPACK and the state of the streams. The
+// server drives it from the bytes received, see `server_http2_process`.
+//
+// Responses are encoded without Huffman coding nor dynamic table, which is
+// allowed and keeps encoding a few copies: the status, `date` and
+// `content-length` refer to static table names.
+
+static const Str HTTP2_PREFACE = {
+    .data = (u8 *)"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n",
+    .len = sizeof("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n") - 1,
+};
+
+// Whether `s` is the start of the preface, or starts with all of it.
+__attribute__((warn_unused_result)) static bool
+http2_is_preface_prefix(Str s) {
+  const usize len = pg_min(s.len, HTTP2_PREFACE.len);
+  return len > 0 && memcmp(s.data, HTTP2_PREFACE.data, len) == 0;
+}
+
+#define HTTP2_FRAME_HEADER_LEN 9U
+// Largest frame payload in both directions until the peer allows larger ones:
+// SETTINGS_MAX_FRAME_SIZE is left at its default.
+#define HTTP2_FRAME_LEN_DEFAULT 16384U
+#define HTTP2_FRAME_LEN_MAX 16777215U
+// Streams open at once, advertised with SETTINGS_MAX_CONCURRENT_STREAMS.
+#define HTTP2_STREAMS_MAX 16U
+// Flow-control windows, initially and at most.
+static const i64 HTTP2_WINDOW_DEFAULT = 65535;
+static const i64 HTTP2_WINDOW_MAX = 0x7fffffff;
+// Each stream allocates from a region of its own, rewound to its checkpoint
+// when the stream is done: as much as a connection serving HTTP/1.1 requests
+// one at a time. The region is lazily backed, like the connection arena.
+static const usize HTTP2_STREAM_ARENA_SIZE = 16 * MiB;
+
+typedef enum {
+  HTTP2_FRAME_DATA = 0x0,
+  HTTP2_FRAME_HEADERS = 0x1,
+  HTTP2_FRAME_PRIORITY = 0x2,
+  HTTP2_FRAME_RST_STREAM = 0x3,
+  HTTP2_FRAME_SETTINGS = 0x4,
+  HTTP2_FRAME_PUSH_PROMISE = 0x5,
+  HTTP2_FRAME_PING = 0x6,
+  HTTP2_FRAME_GOAWAY = 0x7,
+  HTTP2_FRAME_WINDOW_UPDATE = 0x8,
+  HTTP2_FRAME_CONTINUATION = 0x9,
+} Http2_frame_type;
+
+#define HTTP2_FLAG_END_STREAM 0x1U
+#define HTTP2_FLAG_ACK 0x1U
+#define HTTP2_FLAG_END_HEADERS 0x4U
+#define HTTP2_FLAG_PADDED 0x8U
+#define HTTP2_FLAG_PRIORITY 0x20U
+
+typedef enum {
+  HTTP2_ERROR_NONE = 0x0,
+  HTTP2_ERROR_PROTOCOL_ERROR = 0x1,
+  HTTP2_ERROR_INTERNAL_ERROR = 0x2,
+  HTTP2_ERROR_FLOW_CONTROL_ERROR = 0x3,
+  HTTP2_ERROR_SETTINGS_TIMEOUT = 0x4,
+  HTTP2_ERROR_STREAM_CLOSED = 0x5,
+  HTTP2_ERROR_FRAME_SIZE_ERROR = 0x6,
+  HTTP2_ERROR_REFUSED_STREAM = 0x7,
+  HTTP2_ERROR_CANCEL = 0x8,
+  HTTP2_ERROR_COMPRESSION_ERROR = 0x9,
+  HTTP2_ERROR_CONNECT_ERROR = 0xa,
+  HTTP2_ERROR_ENHANCE_YOUR_CALM = 0xb,
+  HTTP2_ERROR_INADEQUATE_SECURITY = 0xc,
+  HTTP2_ERROR_HTTP_1_1_REQUIRED = 0xd,
+} Http2_error;
+
+typedef enum {
+  HTTP2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+  HTTP2_SETTINGS_ENABLE_PUSH = 0x2,
+  HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  HTTP2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  HTTP2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+  HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+} Http2_settings_id;
+
+typedef struct {
+  u32 len;
+  // Without the reserved bit.
+  u32 stream_id;
+  u8 type;
+  u8 flags;
+  pg_pad(2);
+} Http2_frame_header;
+
+__attribute__((warn_unused_result)) static u32
+http2_load_u32(const u8 *_Nonnull data) {
+  return (u32)data[0] << 24 | (u32)data[1] << 16 | (u32)data[2] << 8 |
+         (u32)data[3];
+}
+
+static void http2_store_u32(u8 *_Nonnull data, u32 value) {
+  data[0] = (u8)(value >> 24);
+  data[1] = (u8)(value >> 16);
+  data[2] = (u8)(value >> 8);
+  data[3] = (u8)value;
+}
+
+// Parse the header of the frame starting `data`, which holds at least
+// `HTTP2_FRAME_HEADER_LEN` bytes.
+__attribute__((warn_unused_result)) static Http2_frame_header
+http2_frame_header_parse(const u8 *_Nonnull data) {
+  return (Http2_frame_header){
+      .len = (u32)data[0] << 16 | (u32)data[1] << 8 | (u32)data[2],
+      .type = data[3],
+      .flags = data[4],
+      .stream_id = http2_load_u32(data + 5) & 0x7fffffff,
+  };
+}
+
+static void http2_frame_header_write(u8 *_Nonnull dst, u32 len,
+                                     Http2_frame_type type, u8 flags,
+                                     u32 stream_id) {
+  pg_assert(len <= HTTP2_FRAME_LEN_MAX);
+
+  dst[0] = (u8)(len >> 16);
+  dst[1] = (u8)(len >> 8);
+  dst[2] = (u8)len;
+  dst[3] = (u8)type;
+  dst[4] = flags;
+  http2_store_u32(dst + 5, stream_id & 0x7fffffff);
+}
+
+// Header of a frame whose payload is sent from where it is.
+__attribute__((warn_unused_result)) static Str
+http2_frame_header(u32 len, Http2_frame_type type, u8 flags, u32 stream_id,
+                   Arena *_Nonnull arena) {
+  u8 *const data = arena_alloc(arena, sizeof(u8), _Alignof(u8),
+                               HTTP2_FRAME_HEADER_LEN);
+  http2_frame_header_write(data, len, type, flags, stream_id);
+  return (Str){.data = data, .len = HTTP2_FRAME_HEADER_LEN};
+}
+
+// Append a whole frame, its payload copied after its header: for the small
+// control frames, and the header blocks.
+__attribute__((warn_unused_result)) static Str_builder
+http2_append_frame(Str_builder sb, Http2_frame_type type, u8 flags,
+                   u32 stream_id, Str payload, Arena *_Nonnull arena) {
+  sb = sb_grow(sb, HTTP2_FRAME_HEADER_LEN + payload.len, arena);
+  http2_frame_header_write(sb_end_c(sb), (u32)payload.len, type, flags,
+                           stream_id);
+  sb = sb_assume_appended_n(sb, HTTP2_FRAME_HEADER_LEN);
+  return sb_append(sb, payload, arena);
+}
+
+__attribute__((warn_unused_result)) static Str_builder
+http2_append_rst_stream(Str_builder sb, u32 stream_id, Http2_error error,
+                        Arena *_Nonnull arena) {
+  u8 payload[4] = {0};
+  http2_store_u32(payload, error);
+  return http2_append_frame(sb, HTTP2_FRAME_RST_STREAM, 0, stream_id,
+                            (Str){.data = payload, .len = sizeof(payload)},
+                            arena);
+}
+
+__attribute__((warn_unused_result)) static Str_builder
+http2_append_goaway(Str_builder sb, u32 last_stream_id, Http2_error error,
+                    Arena *_Nonnull arena) {
+  u8 payload[8] = {0};
+  http2_store_u32(payload, last_stream_id);
+  http2_store_u32(payload + 4, error);
+  return http2_append_frame(sb, HTTP2_FRAME_GOAWAY, 0, 0,
+                            (Str){.data = payload, .len = sizeof(payload)},
+                            arena);
+}
+
+__attribute__((warn_unused_result)) static Str_builder
+http2_append_window_update(Str_builder sb, u32 stream_id, u32 increment,
+                           Arena *_Nonnull arena) {
+  u8 payload[4] = {0};
+  http2_store_u32(payload, increment);
+  return http2_append_frame(sb, HTTP2_FRAME_WINDOW_UPDATE, 0, stream_id,
+                            (Str){.data = payload, .len = sizeof(payload)},
+                            arena);
+}
+
+// The SETTINGS frame starting the connection on the server side.
+__attribute__((warn_unused_result)) static Str_builder
+http2_append_server_settings(Str_builder sb, u64 max_header_list_len,
+                             Arena *_Nonnull arena) {
+  const struct {
+    Http2_settings_id id;
+    u32 value;
+  } settings[] = {
+      {HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, HTTP2_STREAMS_MAX},
+      {HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE,
+       (u32)pg_min(max_header_list_len, (u64)UINT32_MAX)},
+  };
+
+  u8 payload[6 * carray_count(settings)] = {0};
+  for (u64 i = 0; i < carray_count(settings); i++) {
+    payload[i * 6] = (u8)(settings[i].id >> 8);
+    payload[i * 6 + 1] = (u8)settings[i].id;
+    http2_store_u32(payload + i * 6 + 2, settings[i].value);
+  }
+  return http2_append_frame(sb, HTTP2_FRAME_SETTINGS, 0, 0,
+                            (Str){.data = payload, .len = sizeof(payload)},
+                            arena);
+}
+
+// Payload of a DATA or HEADERS frame without its padding, and for HEADERS
+// without its priority fields. Returns false when the padding is longer than
+// the payload.
+__attribute__((warn_unused_result)) static bool
+http2_frame_unpad(Http2_frame_header header, Str *_Nonnull payload) {
+  if (header.flags & HTTP2_FLAG_PADDED) {
+    if (payload->len < 1)
+      return false;
+    const u8 padding = payload->data[0];
+    *payload = str_advance(*payload, 1);
+    if (padding > payload->len)
+      return false;
+    payload->len -= padding;
+  }
+
+  if (header.type == HTTP2_FRAME_HEADERS &&
+      (header.flags & HTTP2_FLAG_PRIORITY)) {
+    // Stream dependency and weight, ignored.
+    if (payload->len < 5)
+      return false;
+    *payload = str_advance(*payload, 5);
+  }
+  return true;
+}
+
+// ------------------- HPACK
+
+// SETTINGS_HEADER_TABLE_SIZE, left at its default: the most the client can
+// make the decoder keep.
+#define HPACK_TABLE_SIZE 4096U
+// Counted for each entry on top of its name and value.
+#define HPACK_ENTRY_OVERHEAD 32U
+#define HPACK_ENTRIES_MAX (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+
+#define HPACK_ENTRY(k, v)                                                      \
+  {                                                                            \
+    .key = {.data = (u8 *)k, .len = sizeof(k) - 1},                            \
+    .value = {.data = (u8 *)v, .len = sizeof(v) - 1},                          \
+  }
+
+// Indexed from 1.
+static const Header hpack_static_table[] = {
+    HPACK_ENTRY(":authority", ""),
+    HPACK_ENTRY(":method", "GET"),
+    HPACK_ENTRY(":method", "POST"),
+    HPACK_ENTRY(":path", "/"),
+    HPACK_ENTRY(":path", "/index.html"),
+    HPACK_ENTRY(":scheme", "http"),
+    HPACK_ENTRY(":scheme", "https"),
+    HPACK_ENTRY(":status", "200"),
+    HPACK_ENTRY(":status", "204"),
+    HPACK_ENTRY(":status", "206"),
+    HPACK_ENTRY(":status", "304"),
+    HPACK_ENTRY(":status", "400"),
+    HPACK_ENTRY(":status", "404"),
+    HPACK_ENTRY(":status", "500"),
+    HPACK_ENTRY("accept-charset", ""),
+    HPACK_ENTRY("accept-encoding", "gzip, deflate"),
+    HPACK_ENTRY("accept-language", ""),
+    HPACK_ENTRY("accept-ranges", ""),
+    HPACK_ENTRY("accept", ""),
+    HPACK_ENTRY("access-control-allow-origin", ""),
+    HPACK_ENTRY("age", ""),
+    HPACK_ENTRY("allow", ""),
+    HPACK_ENTRY("authorization", ""),
+    HPACK_ENTRY("cache-control", ""),
+    HPACK_ENTRY("content-disposition", ""),
+    HPACK_ENTRY("content-encoding", ""),
+    HPACK_ENTRY("content-language", ""),
+    HPACK_ENTRY("content-length", ""),
+    HPACK_ENTRY("content-location", ""),
+    HPACK_ENTRY("content-range", ""),
+    HPACK_ENTRY("content-type", ""),
+    HPACK_ENTRY("cookie", ""),
+    HPACK_ENTRY("date", ""),
+    HPACK_ENTRY("etag", ""),
+    HPACK_ENTRY("expect", ""),
+    HPACK_ENTRY("expires", ""),
+    HPACK_ENTRY("from", ""),
+    HPACK_ENTRY("host", ""),
+    HPACK_ENTRY("if-match", ""),
+    HPACK_ENTRY("if-modified-since", ""),
+    HPACK_ENTRY("if-none-match", ""),
+    HPACK_ENTRY("if-range", ""),
+    HPACK_ENTRY("if-unmodified-since", ""),
+    HPACK_ENTRY("last-modified", ""),
+    HPACK_ENTRY("link", ""),
+    HPACK_ENTRY("location", ""),
+    HPACK_ENTRY("max-forwards", ""),
+    HPACK_ENTRY("proxy-authenticate", ""),
+    HPACK_ENTRY("proxy-authorization", ""),
+    HPACK_ENTRY("range", ""),
+    HPACK_ENTRY("referer", ""),
+    HPACK_ENTRY("refresh", ""),
+    HPACK_ENTRY("retry-after", ""),
+    HPACK_ENTRY("server", ""),
+    HPACK_ENTRY("set-cookie", ""),
+    HPACK_ENTRY("strict-transport-security", ""),
+    HPACK_ENTRY("transfer-encoding", ""),
+    HPACK_ENTRY("user-agent", ""),
+    HPACK_ENTRY("vary", ""),
+    HPACK_ENTRY("via", ""),
+    HPACK_ENTRY("www-authenticate", ""),
+};
+
+#undef HPACK_ENTRY
+
+#define HPACK_STATIC_STATUS_200 8U
+#define HPACK_STATIC_CONTENT_LENGTH 28U
+#define HPACK_STATIC_DATE 33U
+
+// Bit length of the code of each symbol, the last one being EOS. The code
+// is canonical, so that these are enough to rebuild it.
+static const u8 hpack_huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+#define HPACK_HUFFMAN_LEN_MAX 30U
+
+// Canonical decoding tables: the codes of a given length are consecutive
+// numbers, from `first_code`, for the symbols listed from `first_index` in
+// `symbols`.
+typedef struct {
+  u32 first_code[HPACK_HUFFMAN_LEN_MAX + 1];
+  u16 first_index[HPACK_HUFFMAN_LEN_MAX + 1];
+  u16 count[HPACK_HUFFMAN_LEN_MAX + 1];
+  u16 symbols[257];
+  bool built;
+  pg_pad(1);
+} Hpack_huffman;
+
+// Built once, on first use.
+__attribute__((warn_unused_result)) static const Hpack_huffman *_Nonnull
+hpack_huffman(void) {
+  static Hpack_huffman huffman = {0};
+  if (huffman.built)
+    return &huffman;
+
+  for (u32 symbol = 0; symbol < carray_count(hpack_huffman_lengths);
+       symbol++) {
+    huffman.count[hpack_huffman_lengths[symbol]] += 1;
+  }
+
+  u32 code = 0;
+  u16 index = 0;
+  for (u32 len = 1; len <= HPACK_HUFFMAN_LEN_MAX; len++) {
+    code = (code + huffman.count[len - 1]) << 1;
+    huffman.first_code[len] = code;
+    huffman.first_index[len] = index;
+    index += huffman.count[len];
+  }
+
+  // Symbols by length then value, as the codes are assigned.
+  u16 next[HPACK_HUFFMAN_LEN_MAX + 1] = {0};
+  for (u16 symbol = 0; symbol < carray_count(hpack_huffman_lengths);
+       symbol++) {
+    const u8 len = hpack_huffman_lengths[symbol];
+    huffman.symbols[huffman.first_index[len] + next[len]] = symbol;
+    next[len] += 1;
+  }
+
+  huffman.built = true;
+  return &huffman;
+}
+
+// Decode a Huffman-coded string. Fails on EOS, and on padding longer than 7
+// bits or which is not the most significant bits of EOS, i.e. all ones.
+__attribute__((warn_unused_result)) static bool
+hpack_huffman_decode(Str s, Str *_Nonnull out, Arena *_Nonnull arena) {
+  const Hpack_huffman *const huffman = hpack_huffman();
+
+  // The shortest codes are 5 bits long.
+  Str_builder sb = sb_new(s.len * 8 / 5, arena);
+  u32 code = 0;
+  u32 len = 0;
+  for (usize i = 0; i < s.len; i++) {
+    for (i32 bit = 7; bit >= 0; bit--) {
+      code = code << 1 | ((u32)s.data[i] >> bit & 1);
+      len += 1;
+
+      const u32 index = code - huffman->first_code[len];
+      if (index < huffman->count[len]) {
+        const u16 symbol = huffman->symbols[huffman->first_index[len] + index];
+        if (symbol == 256)
+          return false;
+        sb.data[sb.len++] = (u8)symbol;
+        code = len = 0;
+      } else if (len == HPACK_HUFFMAN_LEN_MAX) {
+        return false;
+      }
+    }
+  }
+  if (len > 7 || code != (1U << len) - 1)
+    return false;
+
+  *out = sb_build(sb);
+  return true;
+}
+
+// An entry of the dynamic table, its name and value stored one after the
+// other in `Hpack_decoder.storage`.
+typedef struct {
+  u32 offset;
+  u32 name_len;
+  u32 value_len;
+} Hpack_entry;
+
+// Decoding state of a connection: the dynamic table, a FIFO of the entries
+// the client asked to add, bounded in size. Entries are appended to `storage`
+// which is compacted when full: the live entries take at most half of it.
+typedef struct {
+  // Ring, the oldest entry at `first`.
+  Hpack_entry entries[HPACK_ENTRIES_MAX];
+  u8 storage[2 * HPACK_TABLE_SIZE];
+  u32 first;
+  u32 count;
+  u32 storage_len;
+  // Sum of the entry sizes, and the limit the client set.
+  u32 size;
+  u32 max_size;
+  pg_pad(4);
+} Hpack_decoder;
+
+static void hpack_decoder_init(Hpack_decoder *_Nonnull decoder) {
+  decoder->first = decoder->count = 0;
+  decoder->storage_len = decoder->size = 0;
+  decoder->max_size = HPACK_TABLE_SIZE;
+}
+
+static void hpack_decoder_evict(Hpack_decoder *_Nonnull decoder) {
+  pg_assert(decoder->count > 0);
+
+  const Hpack_entry oldest = decoder->entries[decoder->first];
+  decoder->size -=
+      oldest.name_len + oldest.value_len + HPACK_ENTRY_OVERHEAD;
+  decoder->first = (decoder->first + 1) % HPACK_ENTRIES_MAX;
+  decoder->count -= 1;
+  if (decoder->count == 0)
+    decoder->storage_len = 0;
+}
+
+static void hpack_decoder_set_max_size(Hpack_decoder *_Nonnull decoder,
+                                       u32 max_size) {
+  pg_assert(max_size <= HPACK_TABLE_SIZE);
+
+  decoder->max_size = max_size;
+  while (decoder->size > decoder->max_size) {
+    hpack_decoder_evict(decoder);
+  }
+}
+
+// Add an entry, evicting the oldest ones to make room. An entry larger than
+// the table empties it. `name` and `value` must not point into the table.
+static void hpack_decoder_add(Hpack_decoder *_Nonnull decoder, Str name,
+                              Str value) {
+  const u32 size = (u32)(name.len + value.len) + HPACK_ENTRY_OVERHEAD;
+  while (decoder->count > 0 && decoder->size + size > decoder->max_size) {
+    hpack_decoder_evict(decoder);
+  }
+  if (size > decoder->max_size)
+    return;
+
+  const u32 len = (u32)(name.len + value.len);
+  if (decoder->storage_len + len > sizeof(decoder->storage)) {
+    // Live entries are stored in order, so moving each down is safe.
+    u32 storage_len = 0;
+    for (u32 i = 0; i < decoder->count; i++) {
+      Hpack_entry *const entry =
+          &decoder->entries[(decoder->first + i) % HPACK_ENTRIES_MAX];
+      const u32 entry_len = entry->name_len + entry->value_len;
+      memmove(decoder->storage + storage_len, decoder->storage + entry->offset,
+              entry_len);
+      entry->offset = storage_len;
+      storage_len += entry_len;
+    }
+    decoder->storage_len = storage_len;
+  }
+  pg_assert(decoder->storage_len + len <= sizeof(decoder->storage));
+
+  u8 *const dst = decoder->storage + decoder->storage_len;
+  if (name.len > 0)
+    memcpy(dst, name.data, name.len);
+  if (value.len > 0)
+    memcpy(dst + name.len, value.data, value.len);
+
+  decoder->entries[(decoder->first + decoder->count) % HPACK_ENTRIES_MAX] =
+      (Hpack_entry){
+          .offset = decoder->storage_len,
+          .name_len = (u32)name.len,
+          .value_len = (u32)value.len,
+      };
+  decoder->count += 1;
+  decoder->storage_len += len;
+  decoder->size += size;
+}
+
+// Entry at `index` of the static table followed by the dynamic one, newest
+// first. Points into the table.
+__attribute__((warn_unused_result)) static bool
+hpack_decoder_lookup(const Hpack_decoder *_Nonnull decoder, u64 index,
+                     Header *_Nonnull header) {
+  if (index == 0)
+    return false;
+  if (index <= carray_count(hpack_static_table)) {
+    *header = hpack_static_table[index - 1];
+    return true;
+  }
+
+  const u64 dynamic_index = index - carray_count(hpack_static_table) - 1;
+  if (dynamic_index >= decoder->count)
+    return false;
+
+  const Hpack_entry entry =
+      decoder->entries[(decoder->first + decoder->count - 1 -
+                        (u32)dynamic_index) %
+                       HPACK_ENTRIES_MAX];
+  u8 *const data = (u8 *)decoder->storage + entry.offset;
+  *header = (Header){
+      .key = {.data = data, .len = entry.name_len},
+      .value = {.data = data + entry.name_len, .len = entry.value_len},
+  };
+  return true;
+}
+
+// Decode an integer with a `prefix_bits` prefix at `*pos`.
+__attribute__((warn_unused_result)) static bool
+hpack_decode_int(Str block, usize *_Nonnull pos, u8 prefix_bits,
+                 u64 *_Nonnull value) {
+  if (*pos >= block.len)
+    return false;
+
+  const u8 mask = (u8)((1U << prefix_bits) - 1);
+  u64 n = block.data[*pos] & mask;
+  *pos += 1;
+  if (n < mask) {
+    *value = n;
+    return true;
+  }
+
+  // Way more than any length or index of a valid block.
+  for (u32 shift = 0; shift <= 28; shift += 7) {
+    if (*pos >= block.len)
+      return false;
+    const u8 c = block.data[*pos];
+    *pos += 1;
+    n += (u64)(c & 0x7f) << shift;
+    if ((c & 0x80) == 0) {
+      *value = n;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Decode a string literal at `*pos`, copied to `arena`.
+__attribute__((warn_unused_result)) static bool
+hpack_decode_str(Str block, usize *_Nonnull pos, Str *_Nonnull out,
+                 Arena *_Nonnull arena) {
+  if (*pos >= block.len)
+    return false;
+
+  const bool huffman = block.data[*pos] & 0x80;
+  u64 len = 0;
+  if (!hpack_decode_int(block, pos, 7, &len) || len > block.len - *pos)
+    return false;
+
+  const Str raw = {.data = block.data + *pos, .len = (usize)len};
+  *pos += (usize)len;
+  if (huffman)
+    return hpack_huffman_decode(raw, out, arena);
+
+  *out = str_clone(raw, arena);
+  return true;
+}
+
+typedef enum {
+  HPACK_DECODE_OK,
+  // Past `max_list_len`: the fields that follow were decoded but not kept.
+  HPACK_DECODE_TOO_LARGE,
+  // Compression error, after which the table is out of sync with the
+  // client's.
+  HPACK_DECODE_INVALID,
+} Hpack_decode_result;
+
+// Decode a whole header block into `fields`, names and values copied to
+// `arena`, updating the dynamic table as the client asked. The size of the
+// list is counted like `SETTINGS_MAX_HEADER_LIST_SIZE`: the length of each
+// name and value plus 32 (RFC 7540 6.5.2). Past `max_list_len`, fields are no
+// longer kept, so that repeating an indexed one does not allocate without
+// bound, but the block is still decoded for the table to stay in sync.
+__attribute__((warn_unused_result)) static Hpack_decode_result
+hpack_decode(Hpack_decoder *_Nonnull decoder, Str block, u64 max_list_len,
+             Array(Header) *_Nonnull fields, Arena *_Nonnull arena) {
+  usize pos = 0;
+  bool fields_seen = false;
+  u64 list_len = 0;
+  while (pos < block.len) {
+    const u8 c = block.data[pos];
+
+    if (c & 0x80) { // Indexed field.
+      u64 index = 0;
+      Header header = {0};
+      if (!hpack_decode_int(block, &pos, 7, &index) ||
+          !hpack_decoder_lookup(decoder, index, &header))
+        return HPACK_DECODE_INVALID;
+      list_len += header.key.len + header.value.len + 32;
+      if (list_len <= max_list_len)
+        *array_push(fields, arena) = (Header){
+            .key = str_clone(header.key, arena),
+            .value = str_clone(header.value, arena),
+        };
+      fields_seen = true;
+      continue;
+    }
+
+    if ((c & 0xe0) == 0x20) { // Dynamic table size update, first only.
+      u64 max_size = 0;
+      if (fields_seen || !hpack_decode_int(block, &pos, 5, &max_size) ||
+          max_size > HPACK_TABLE_SIZE)
+        return HPACK_DECODE_INVALID;
+      hpack_decoder_set_max_size(decoder, (u32)max_size);
+      continue;
+    }
+
+    // Literal, with incremental indexing or not, or never indexed.
+    const bool indexing = (c & 0xc0) == 0x40;
+    u64 name_index = 0;
+    if (!hpack_decode_int(block, &pos, indexing ? 6 : 4, &name_index))
+      return HPACK_DECODE_INVALID;
+
+    // Dropped past the limit, see above.
+    const Arena before = *arena;
+    Header header = {0};
+    if (name_index == 0) {
+      if (!hpack_decode_str(block, &pos, &header.key, arena))
+        return HPACK_DECODE_INVALID;
+    } else {
+      Header indexed = {0};
+      if (!hpack_decoder_lookup(decoder, name_index, &indexed))
+        return HPACK_DECODE_INVALID;
+      header.key = str_clone(indexed.key, arena);
+    }
+    if (!hpack_decode_str(block, &pos, &header.value, arena))
+      return HPACK_DECODE_INVALID;
+
+    if (indexing)
+      hpack_decoder_add(decoder, header.key, header.value);
+    list_len += header.key.len + header.value.len + 32;
+    if (list_len <= max_list_len)
+      *array_push(fields, arena) = header;
+    else
+      *arena = before;
+    fields_seen = true;
+  }
+  return list_len <= max_list_len ? HPACK_DECODE_OK : HPACK_DECODE_TOO_LARGE;
+}
+
+__attribute__((warn_unused_result)) static Str_builder
+hpack_append_int(Str_builder sb, u64 value, u8 prefix_bits, u8 flags,
+                 Arena *_Nonnull arena) {
+  const u8 mask = (u8)((1U << prefix_bits) - 1);
+  if (value < mask)
+    return sb_append_char(sb, flags | (u8)value, arena);
+
+  sb = sb_append_char(sb, flags | mask, arena);
+  value -= mask;
+  while (value >= 0x80) {
+    sb = sb_append_char(sb, (u8)(value & 0x7f) | 0x80, arena);
+    value >>= 7;
+  }
+  return sb_append_char(sb, (u8)value, arena);
+}
+
+// String literal, without Huffman coding. Header names must be lowercase.
+__attribute__((warn_unused_result)) static Str_builder
+hpack_append_str(Str_builder sb, Str s, bool lowercase,
+                 Arena *_Nonnull arena) {
+  sb = hpack_append_int(sb, s.len, 7, 0, arena);
+  const usize start = sb.len;
+  sb = sb_append(sb, s, arena);
+  if (lowercase) {
+    for (usize i = start; i < sb.len; i++) {
+      sb.data[i] = char_to_lower(sb.data[i]);
+    }
+  }
+  return sb;
+}
+
+// Headers which only make sense for the HTTP/1.1 connection they are sent on,
+// not allowed in HTTP/2.
+__attribute__((warn_unused_result)) static bool
+http2_header_is_connection_specific(Str name) {
+  static const char *const names[] = {
+      "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+      "upgrade",
+  };
+  for (u64 i = 0; i < carray_count(names); i++) {
+    if (str_eq_ignore_case(name, str_from_c((char *)names[i])))
+      return true;
+  }
+  return false;
+}
+
+__attribute__((warn_unused_result)) static Str_builder
+hpack_append_literal(Str_builder sb, Header header, Arena *_Nonnull arena) {
+  if (http2_header_is_connection_specific(header.key))
+    return sb;
+
+  // Literal without indexing, new name.
+  sb = sb_append_char(sb, 0, arena);
+  sb = hpack_append_str(sb, header.key, true, arena);
+  return hpack_append_str(sb, header.value, false, arena);
+}
+
+// Header block of `res`. Without `date`, the `date` field is omitted.
+__attribute__((warn_unused_result)) static Str
+hpack_encode_response(Response res, Str date, Arena *_Nonnull arena) {
+  Str_builder sb = sb_new(256 + res.headers_block.len, arena);
+
+  // `:status`, indexed when in the static table, else its name is.
+  const u16 indexed_statuses[] = {200, 204, 206, 304, 400, 404, 500};
+  bool indexed = false;
+  for (u32 i = 0; i < carray_count(indexed_statuses); i++) {
+    if (res.status == indexed_statuses[i]) {
+      sb = hpack_append_int(sb, HPACK_STATIC_STATUS_200 + i, 7, 0x80, arena);
+      indexed = true;
+    }
+  }
+  if (!indexed) {
+    Str_builder status = sb_new(3, arena);
+    status = sb_append_u64(status, res.status, arena);
+    sb = hpack_append_int(sb, HPACK_STATIC_STATUS_200, 4, 0, arena);
+    sb = hpack_append_str(sb, sb_build(status), false, arena);
+  }
+
+  if (!str_is_empty(date)) {
+    sb = hpack_append_int(sb, HPACK_STATIC_DATE, 4, 0, arena);
+    sb = hpack_append_str(sb, date, false, arena);
+  }
+
+  if (http_status_has_content_length(res.status)) {
+    Str_builder len = sb_new(20, arena);
+    len = sb_append_u64(len, res.body.len + res.file_len, arena);
+    sb = hpack_append_int(sb, HPACK_STATIC_CONTENT_LENGTH, 4, 0, arena);
+    sb = hpack_append_str(sb, sb_build(len), false, arena);
+  }
+
+  // `Key: value\r\n` lines.
+  for (Str lines = res.headers_block; !str_is_empty(lines);) {
+    const Str_split_result line = str_split(lines, '\n');
+    lines = line.right;
+    const Str_split_result field = str_split(line.left, ':');
+    if (!field.found)
+      continue;
+    Str value = str_trim_left(field.right, ' ');
+    if (str_ends_with(value, str_from_c("\r")))
+      value.len -= 1;
+    sb = hpack_append_literal(
+        sb, (Header){.key = field.left, .value = value}, arena);
+  }
+
+  for (u32 i = 0; i < res.headers.list.len; i++) {
+    sb = hpack_append_literal(sb, res.headers.list.data[i], arena);
+  }
+
+  return sb_build(sb);
+}
+
+// ------------------- Streams
+
+typedef enum {
+  // Free slot.
+  HTTP2_STREAM_IDLE,
+  // Receiving the request.
+  HTTP2_STREAM_OPEN,
+  // The request is complete: sending the response.
+  HTTP2_STREAM_HALF_CLOSED_REMOTE,
+  // Everything is queued, or the stream was reset. The slot is freed once
+  // the frames queued are sent.
+  HTTP2_STREAM_CLOSED,
+} Http2_stream_state;
+
+typedef struct {
+  Arena arena_checkpoint;
+  Arena arena;
+  Request req;
+  // Buffered request body.
+  Str_builder body;
+  // Set for the routes streaming the request body.
+  Http_body_handler _Nullable on_body;
+  u64 body_max_len;
+  u64 body_received;
+  // Announced in `content-length`, if any, which the body must match.
+  u64 content_length;
+  // Response data not sent yet: what is left of the body, then of the file.
+  // The stream holds a reference on the file until it is freed.
+  Str out_body;
+  File_cache_entry *_Nullable file;
+  u64 file_offset;
+  u64 file_len;
+  // What the client allows the server to send, and what is left of what the
+  // server allowed the client to send.
+  i64 send_window;
+  i64 recv_window;
+  u32 id;
+  Http2_stream_state state;
+  bool has_content_length;
+  pg_pad(7);
+} Http2_stream;
+
+// State of an HTTP/2 connection, which lives as long as it, unlike what the
+// connection allocates for a batch of frames.
+typedef struct {
+  Hpack_decoder hpack;
+  Http2_stream streams[HTTP2_STREAMS_MAX];
+  // Connection flow-control windows: what the client allows the server to
+  // send, and what is left of what the server allowed the client to send.
+  i64 send_window;
+  i64 recv_window;
+  // The client's settings.
+  u32 peer_max_frame_len;
+  u32 peer_initial_window;
+  // Highest stream the client opened.
+  u32 last_stream_id;
+  // Where the next round of DATA frames starts, for fairness.
+  u32 next_stream;
+  bool goaway_sent;
+  bool goaway_received;
+  pg_pad(6);
+} Http2_session;
+
+// Lay out the session at the start of `region`, followed by the stream
+// arenas.
+__attribute__((warn_unused_result)) static Http2_session *_Nonnull
+http2_session_new(Arena region) {
+  Http2_session *const session = arena_alloc(
+      &region, sizeof(Http2_session), _Alignof(Http2_session), 1);
+  hpack_decoder_init(&session->hpack);
+  session->send_window = session->recv_window = HTTP2_WINDOW_DEFAULT;
+  session->peer_max_frame_len = HTTP2_FRAME_LEN_DEFAULT;
+  session->peer_initial_window = (u32)HTTP2_WINDOW_DEFAULT;
+
+  // Not zeroed: only backed by memory as the streams use it.
+  pg_assert((usize)(region.end - region.start) >=
+            HTTP2_STREAMS_MAX * HTTP2_STREAM_ARENA_SIZE);
+  for (u32 i = 0; i < HTTP2_STREAMS_MAX; i++) {
+    Http2_stream *const stream = &session->streams[i];
+    stream->arena_checkpoint = arena_from_mem(
+        region.start + i * HTTP2_STREAM_ARENA_SIZE, HTTP2_STREAM_ARENA_SIZE);
+    stream->arena = stream->arena_checkpoint;
+  }
+  return session;
+}
+
+// Bytes needed for a session and its streams.
+__attribute__((warn_unused_result)) static usize
+http2_session_region_size(void) {
+  return sizeof(Http2_session) + _Alignof(Http2_session) +
+         HTTP2_STREAMS_MAX * HTTP2_STREAM_ARENA_SIZE;
+}
+
+__attribute__((warn_unused_result)) static Http2_stream *_Nullable
+http2_session_find_stream(Http2_session *_Nonnull session, u32 id) {
+  for (u32 i = 0; i < HTTP2_STREAMS_MAX; i++) {
+    Http2_stream *const stream = &session->streams[i];
+    if (stream->state != HTTP2_STREAM_IDLE && stream->id == id)
+      return stream;
+  }
+  return NULL;
+}
+
+// Take a free slot for a new stream, NULL if they are all in use.
+__attribute__((warn_unused_result)) static Http2_stream *_Nullable
+http2_session_open_stream(Http2_session *_Nonnull session, u32 id) {
+  for (u32 i = 0; i < HTTP2_STREAMS_MAX; i++) {
+    Http2_stream *const stream = &session->streams[i];
+    if (stream->state != HTTP2_STREAM_IDLE)
+      continue;
+
+    *stream = (Http2_stream){
+        .arena_checkpoint = stream->arena_checkpoint,
+        .arena = stream->arena_checkpoint,
+        .send_window = session->peer_initial_window,
+        .recv_window = HTTP2_WINDOW_DEFAULT,
+        .id = id,
+        .state = HTTP2_STREAM_OPEN,
+    };
+    return stream;
+  }
+  return NULL;
+}
+
+// Streams not done yet, i.e. not closed.
+__attribute__((warn_unused_result)) static u32
+http2_session_active_streams(const Http2_session *_Nonnull session) {
+  u32 count = 0;
+  for (u32 i = 0; i < HTTP2_STREAMS_MAX; i++) {
+    const Http2_stream_state state = session->streams[i].state;
+    count += state == HTTP2_STREAM_OPEN ||
+             state == HTTP2_STREAM_HALF_CLOSED_REMOTE;
+  }
+  return count;
+}
+
+// Done with the stream, dropping what is left to send. The slot is freed once
+// the frames already queued are sent.
+static void http2_stream_close(Http2_stream *_Nonnull stream) {
+  stream->state = HTTP2_STREAM_CLOSED;
+  stream->out_body = (Str){0};
+  stream->file_len = 0;
+}
+
+// Add a WINDOW_UPDATE increment to a send window.
+__attribute__((warn_unused_result)) static Http2_error
+http2_window_add(i64 *_Nonnull window, u32 increment) {
+  if (increment == 0)
+    return HTTP2_ERROR_PROTOCOL_ERROR;
+  *window += increment;
+  return *window > HTTP2_WINDOW_MAX ? HTTP2_ERROR_FLOW_CONTROL_ERROR
+                                    : HTTP2_ERROR_NONE;
+}
+
+// Apply the settings the client sent.
+__attribute__((warn_unused_result)) static Http2_error
+http2_session_apply_settings(Http2_session *_Nonnull session, Str payload) {
+  if (payload.len % 6 != 0)
+    return HTTP2_ERROR_FRAME_SIZE_ERROR;
+
+  for (usize i = 0; i < payload.len; i += 6) {
+    const u16 id = (u16)(payload.data[i] << 8 | payload.data[i + 1]);
+    const u32 value = http2_load_u32(payload.data + i + 2);
+
+    switch (id) {
+    case HTTP2_SETTINGS_ENABLE_PUSH:
+      if (value > 1)
+        return HTTP2_ERROR_PROTOCOL_ERROR;
+      break;
+    case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE: {
+      if (value > HTTP2_WINDOW_MAX)
+        return HTTP2_ERROR_FLOW_CONTROL_ERROR;
+      // Applies to the streams already open.
+      const i64 delta = (i64)value - (i64)session->peer_initial_window;
+      for (u32 s = 0; s < HTTP2_STREAMS_MAX; s++) {
+        Http2_stream *const stream = &session->streams[s];
+        if (stream->state == HTTP2_STREAM_IDLE)
+          continue;
+        stream->send_window += delta;
+        if (stream->send_window > HTTP2_WINDOW_MAX)
+          return HTTP2_ERROR_FLOW_CONTROL_ERROR;
+      }
+      session->peer_initial_window = value;
+    } break;
+    case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+      if (value < HTTP2_FRAME_LEN_DEFAULT || value > HTTP2_FRAME_LEN_MAX)
+        return HTTP2_ERROR_PROTOCOL_ERROR;
+      session->peer_max_frame_len = value;
+      break;
+    default:
+      // The encoder has no dynamic table and streams are never pushed, so
+      // the others do not matter. Unknown ones are ignored.
+      break;
+    }
+  }
+  return HTTP2_ERROR_NONE;
+}
+
+// `:method`, which unlike the request line has no trailing space.
+__attribute__((warn_unused_result)) static bool
+http2_parse_method(Str s, Method *_Nonnull method) {
+  for (u64 i = 0; i < carray_count(http_methods); i++) {
+    if (s.len + 1 == http_methods[i].len &&
+        memcmp(s.data, http_methods[i].name, s.len) == 0) {
+      *method = http_methods[i].method;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Turn the fields of a request header block into `req`. Returns false if the
+// request is malformed.
+__attribute__((warn_unused_result)) static bool
+http2_request_from_fields(Array(Header) fields, Request *_Nonnull req,
+                          Arena *_Nonnull arena) {
+  Str method = {0}, scheme = {0}, path = {0}, authority = {0};
+  bool regular_seen = false;
+
+  for (u32 i = 0; i < fields.len; i++) {
+    const Header field = fields.data[i];
+    if (str_is_empty(field.key))
+      return false;
+    for (usize c = 0; c < field.key.len; c++) {
+      if ('A' <= field.key.data[c] && field.key.data[c] <= 'Z')
+        return false;
+    }
+
+    if (str_first(field.key) == ':') {
+      Str *const pseudo = str_eq_c(field.key, ":method")    ? &method
+                          : str_eq_c(field.key, ":scheme")  ? &scheme
+                          : str_eq_c(field.key, ":path")    ? &path
+                          : str_eq_c(field.key, ":authority") ? &authority
+                                                              : NULL;
+      // Unknown, repeated, or after the regular fields.
+      if (pseudo == NULL || pseudo->data != NULL || regular_seen)
+        return false;
+      *pseudo = field.value.data ? field.value : str_from_c("");
+      continue;
+    }
+
+    regular_seen = true;
+    if (http2_header_is_connection_specific(field.key) ||
+        (str_eq_c(field.key, "te") && !str_eq_c(field.value, "trailers")))
+      return false;
+    http_headers_add(&req->headers, field.key, field.value, arena);
+  }
+
+  if (str_is_empty(method) || str_is_empty(scheme) || str_is_empty(path) ||
+      !http2_parse_method(method, &req->method))
+    return false;
+
+  if (!str_is_empty(authority) &&
+      http_find_known_header(req->headers, HTTP_HEADER_HOST) == NULL) {
+    http_headers_add(&req->headers, str_from_c("host"), authority, arena);
+  }
+  if (!http_request_set_target(req, path, arena))
+    return false;
+  // Same semantics as HTTP/1.1, the connection being managed by the framing.
+  req->version_minor = 1;
+  req->keep_alive = true;
+  return true;
+}
+
+static void test_http2(void) {
+  Arena arena = arena_new(1 * MiB, NULL);
+
+  // Huffman, RFC 7541 C.4.1.
+  {
+    const u8 coded[] = {0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a,
+                        0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff};
+    Str decoded = {0};
+    pg_assert(hpack_huffman_decode(
+        (Str){.data = (u8 *)coded, .len = sizeof(coded)}, &decoded, &arena));
+    pg_assert(str_eq_c(decoded, "www.example.com"));
+
+    // Padding which is not a prefix of EOS, or too long.
+    const u8 bad_padding[] = {0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a,
+                              0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xfe};
+    pg_assert(!hpack_huffman_decode(
+        (Str){.data = (u8 *)bad_padding, .len = sizeof(bad_padding)}, &decoded,
+        &arena));
+    const u8 long_padding[] = {0xff};
+    pg_assert(!hpack_huffman_decode(
+        (Str){.data = (u8 *)long_padding, .len = 1}, &decoded, &arena));
+  }
+
+  // Requests sharing the dynamic table, RFC 7541 C.4.
+  {
+    Hpack_decoder decoder = {0};
+    hpack_decoder_init(&decoder);
+
+    const u8 first[] = {0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5,
+                        0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff};
+    const u8 second[] = {0x82, 0x86, 0x84, 0xbe, 0x58, 0x86,
+                         0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf};
+    const u8 third[] = {0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8,
+                        0x49, 0xe9, 0x5b, 0xa9, 0x7d, 0x7f, 0x89, 0x25,
+                        0xa8, 0x49, 0xe9, 0x5b, 0xb8, 0xe8, 0xb4, 0xbf};
+
+    Array(Header) fields = {0};
+    pg_assert(hpack_decode(&decoder,
+                           (Str){.data = (u8 *)first, .len = sizeof(first)},
+                           UINT64_MAX, &fields, &arena) == HPACK_DECODE_OK);
+    pg_assert(fields.len == 4 && decoder.size == 57);
+
+    fields = (Array(Header)){0};
+    pg_assert(hpack_decode(&decoder,
+                           (Str){.data = (u8 *)second, .len = sizeof(second)},
+                           UINT64_MAX, &fields, &arena) == HPACK_DECODE_OK);
+    pg_assert(fields.len == 5 && decoder.size == 110);
+    pg_assert(str_eq_c(fields.data[3].value, "www.example.com"));
+    pg_assert(str_eq_c(fields.data[4].key, "cache-control") &&
+              str_eq_c(fields.data[4].value, "no-cache"));
+
+    fields = (Array(Header)){0};
+    pg_assert(hpack_decode(&decoder,
+                           (Str){.data = (u8 *)third, .len = sizeof(third)},
+                           UINT64_MAX, &fields, &arena) == HPACK_DECODE_OK);
+    pg_assert(fields.len == 5 && decoder.size == 164);
+    pg_assert(str_eq_c(fields.data[3].value, "www.example.com"));
+    pg_assert(str_eq_c(fields.data[4].key, "custom-key") &&
+              str_eq_c(fields.data[4].value, "custom-value"));
+
+    Request req = {0};
+    pg_assert(http2_request_from_fields(fields, &req, &arena));
+    pg_assert(req.method == HTTP_METHOD_GET &&
+              str_eq_c(req.path, "/index.html"));
+    const Header *const host =
+        http_find_known_header(req.headers, HTTP_HEADER_HOST);
+    pg_assert(host && str_eq_c(host->value, "www.example.com"));
+
+    // Out of range index.
+    const u8 bad_index[] = {0x80 | 70};
+    fields = (Array(Header)){0};
+    pg_assert(hpack_decode(&decoder,
+                           (Str){.data = (u8 *)bad_index, .len = 1},
+                           UINT64_MAX, &fields,
+                           &arena) == HPACK_DECODE_INVALID);
+  }
+
+  // An indexed field repeated past the limit is not kept, the table still
+  // updated.
+  {
+    Hpack_decoder decoder = {0};
+    hpack_decoder_init(&decoder);
+    hpack_decoder_add(&decoder, str_from_c("x-big"),
+                      str_from_c("0123456789abcdef0123456789abcdef"));
+
+    // A new entry after many copies of the first one, now at 63.
+    u8 repeated[4096 + 4] = {0};
+    memset(repeated, 0x80 | 62, 4096);
+    memcpy(repeated + 4096, (u8[]){0x40 | 62, 0x02, 'o', 'k'}, 4);
+
+    Array(Header) fields = {0};
+    const Arena arena_before = arena;
+    pg_assert(hpack_decode(&decoder,
+                           (Str){.data = repeated, .len = sizeof(repeated)},
+                           16 * KiB, &fields,
+                           &arena) == HPACK_DECODE_TOO_LARGE);
+    // (5 + 32 + 32) * 237 is the most below 16 KiB.
+    pg_assert(fields.len == 237);
+    pg_assert((usize)(arena.start - arena_before.start) < 32 * KiB);
+
+    Header newest = {0};
+    pg_assert(hpack_decoder_lookup(&decoder, 62, &newest));
+    pg_assert(str_eq_c(newest.key, "x-big") && str_eq_c(newest.value, "ok"));
+  }
+
+  // Eviction and compaction of the dynamic table.
+  {
+    Hpack_decoder decoder = {0};
+    hpack_decoder_init(&decoder);
+    for (u32 i = 0; i < 1000; i++) {
+      Str_builder value = sb_new(16, &arena);
+      value = sb_append_u64(value, i, &arena);
+      hpack_decoder_add(&decoder, str_from_c("x-counter"), sb_build(value));
+      pg_assert(decoder.size <= HPACK_TABLE_SIZE);
+    }
+    Header newest = {0};
+    pg_assert(hpack_decoder_lookup(&decoder, 62, &newest));
+    pg_assert(str_eq_c(newest.key, "x-counter") &&
+              str_eq_c(newest.value, "999"));
+
+    hpack_decoder_set_max_size(&decoder, 0);
+    pg_assert(decoder.count == 0 && !hpack_decoder_lookup(&decoder, 62,
+                                                          &newest));
+  }
+
+  // Malformed requests.
+  {
+    Array(Header) fields = {0};
+    *array_push(&fields, &arena) =
+        (Header){str_from_c(":method"), str_from_c("GET")};
+    *array_push(&fields, &arena) =
+        (Header){str_from_c(":scheme"), str_from_c("http")};
+    *array_push(&fields, &arena) =
+        (Header){str_from_c("accept"), str_from_c("*/*")};
+    *array_push(&fields, &arena) =
+        (Header){str_from_c(":path"), str_from_c("/")};
+    Request req = {0};
+    pg_assert(!http2_request_from_fields(fields, &req, &arena));
+
+    fields.len = 2;
+    *array_push(&fields, &arena) =
+        (Header){str_from_c(":path"), str_from_c("/")};
+    *array_push(&fields, &arena) =
+        (Header){str_from_c("Accept"), str_from_c("*/*")};
+    req = (Request){0};
+    pg_assert(!http2_request_from_fields(fields, &req, &arena));
+  }
+
+  // Responses.
+  {
+    Response res = {.status = 200, .body = str_from_c("hello")};
+    res.headers_block = str_from_c("Content-Type: text/plain\r\n");
+    http_headers_add(&res.headers, str_from_c("Connection"),
+                     str_from_c("close"), &arena);
+    const Str block = hpack_encode_response(res, (Str){0}, &arena);
+
+    Hpack_decoder decoder = {0};
+    hpack_decoder_init(&decoder);
+    Array(Header) fields = {0};
+    pg_assert(hpack_decode(&decoder, block, UINT64_MAX, &fields, &arena) ==
+              HPACK_DECODE_OK);
+    pg_assert(fields.len == 3);
+    pg_assert(str_eq_c(fields.data[0].key, ":status") &&
+              str_eq_c(fields.data[0].value, "200"));
+    pg_assert(str_eq_c(fields.data[1].key, "content-length") &&
+              str_eq_c(fields.data[1].value, "5"));
+    pg_assert(str_eq_c(fields.data[2].key, "content-type") &&
+              str_eq_c(fields.data[2].value, "text/plain"));
+  }
+}
@@ -1,7 +1,10 @@
 #pragma once
 #include "arena.h"
 #include "cursor.h"
+#include "decimal.h"
+#include "simd.h"
 #include "str.h"
+#include "utf8.h"
 
 typedef enum {
   JSON_KIND_UNDEFINED,
@@ -28,80 +31,159 @@ struct Json {
   Json *_Nullable next;
 };
 
-static bool json_parse_number_one_or_more(Read_cursor *_Nonnull cursor,
-                                          u64 *_Nonnull res,
-                                          u64 *_Nonnull len) {
-  bool at_least_one_digit = false;
+// Whether the little-endian word is 8 ASCII digits.
+__attribute__((warn_unused_result)) static bool json_is_eight_digits(u64 word) {
+  return !(((word + 0x4646464646464646ULL) | (word - 0x3030303030303030ULL)) &
+           0x8080808080808080ULL);
+}
+
+// Value of the 8 ASCII digits of the little-endian word, most significant
+// first: pairs, then quadruples, then the whole, each in one multiplication.
+__attribute__((warn_unused_result)) static u32
+json_parse_eight_digits(u64 word) {
+  const u64 mask = 0x000000ff000000ffULL;
+  const u64 mul1 = 100 + (1000000ULL << 32);
+  const u64 mul2 = 1 + (10000ULL << 32);
+  word -= 0x3030303030303030ULL;
+  word = word * 10 + (word >> 8);
+  return (u32)(((word & mask) * mul1 + ((word >> 16) & mask) * mul2) >> 32);
+}
 
-  while (!read_cursor_is_at_end(*cursor)) {
-    const u8 c = read_cursor_peek(*cursor);
-    if (!char_is_digit(c))
+// Accumulate the digits of `s` from `i` into `w`, eight at a time while
+// possible, wrapping around, and return the index of the first non-digit.
+__attribute__((warn_unused_result)) static usize
+json_parse_digits(Str s, usize i, u64 *_Nonnull w) {
+  while (i + 8 <= s.len) {
+    u64 word = 0;
+    memcpy(&word, s.data + i, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    if (!json_is_eight_digits(word))
       break;
 
-    at_least_one_digit = true;
-    *res = *res * 10 + (c - '0');
+    *w = *w * 100000000 + json_parse_eight_digits(word);
+    i += 8;
+  }
+
+  while (i < s.len && char_is_digit(s.data[i])) {
+    *w = *w * 10 + (u64)(s.data[i] - '0');
+    i += 1;
+  }
+  return i;
+}
 
-    read_cursor_next(cursor);
+// The leading 19 significant digits of the integer and fraction parts, and
+// the decimal exponent of the last one, for numbers with more.
+__attribute__((warn_unused_result)) static u64
+json_number_leading_digits(Str integer, Str fraction, i64 *_Nonnull exponent) {
+  const u64 nineteen_digits_min = 1000000000000000000ULL;
+  u64 w = 0;
 
-    *len += 1;
+  usize i = 0;
+  for (; i < integer.len && w < nineteen_digits_min; i++) {
+    w = w * 10 + (u64)(integer.data[i] - '0');
+  }
+  if (w >= nineteen_digits_min) {
+    *exponent += (i64)(integer.len - i);
+    return w;
   }
 
-  return at_least_one_digit;
+  // Leading zeros of the fraction leave `w` at zero, as they should.
+  for (i = 0; i < fraction.len && w < nineteen_digits_min; i++) {
+    w = w * 10 + (u64)(fraction.data[i] - '0');
+  }
+  *exponent -= (i64)i;
+  return w;
 }
 
+// Correctly rounded, like `strtod(3)` in the C locale, but faster.
 static Json *_Nullable json_parse_number(Read_cursor *_Nonnull cursor,
                                          Arena *_Nonnull arena) {
-  pg_assert(read_cursor_peek(*cursor) == '-' ||
-            char_is_digit_no_zero(read_cursor_peek(*cursor)));
-
-  double num = 0;
-
-  const double sign = read_cursor_match_char(cursor, '-') ? -1 : 1;
-  if (!char_is_digit_no_zero(read_cursor_peek(*cursor)))
+  const Str s = cursor->s;
+  const usize start = cursor->pos;
+  usize i = start;
+
+  const bool negative = i < s.len && s.data[i] == '-';
+  i += negative;
+
+  // Integer parts are usually short: eight digits at a time would mostly
+  // mispredict. No leading zeros.
+  u64 w = 0;
+  const usize integer_start = i;
+  while (i < s.len && char_is_digit(s.data[i])) {
+    w = w * 10 + (u64)(s.data[i] - '0');
+    i += 1;
+  }
+  const Str integer = {.data = s.data + integer_start,
+                       .len = i - integer_start};
+  if (integer.len == 0 || (integer.data[0] == '0' && integer.len > 1))
     return NULL;
 
-  bool frac_present = false;
-
-  while (!read_cursor_is_at_end(*cursor)) {
-    const u8 c = read_cursor_peek(*cursor);
-    if (char_is_digit(c)) {
-      num = num * 10 + (c - '0');
-      read_cursor_next(cursor);
-    } else if (read_cursor_match_char(cursor, '.')) {
-      u64 frac = 0;
-      u64 len = 0;
-      if (!json_parse_number_one_or_more(cursor, &frac, &len))
-        return NULL;
-
-      num = num + (double)frac / (double)(pg_pow_u64(10, len));
+  Str fraction = {0};
+  if (i < s.len && s.data[i] == '.') {
+    i += 1;
+    const usize fraction_start = i;
+    i = json_parse_digits(s, i, &w);
+    fraction =
+        (Str){.data = s.data + fraction_start, .len = i - fraction_start};
+    if (fraction.len == 0)
+      return NULL;
+  }
 
-      frac_present = true;
-    } else if (read_cursor_match_char(cursor, 'e') ||
-               read_cursor_match_char(cursor, 'E')) {
-      if (!frac_present)
-        return NULL;
+  i64 exponent = 0;
+  if (i < s.len && (s.data[i] == 'e' || s.data[i] == 'E')) {
+    i += 1;
+    const bool exponent_negative = i < s.len && s.data[i] == '-';
+    if (i < s.len && (s.data[i] == '-' || s.data[i] == '+')) {
+      i += 1;
+    }
 
-      const bool plus = read_cursor_match_char(cursor, '+');
-      const bool minus = read_cursor_match_char(cursor, '-');
-      if (plus && minus)
-        return NULL;
+    const usize exponent_start = i;
+    for (; i < s.len && char_is_digit(s.data[i]); i++) {
+      // Saturated, way out of the range of doubles already.
+      if (exponent < 0x10000000) {
+        exponent = exponent * 10 + (s.data[i] - '0');
+      }
+    }
+    if (i == exponent_start)
+      return NULL;
 
-      u64 exp = 0;
-      if (!json_parse_number_one_or_more(cursor, &exp, &(u64){0}))
-        return NULL;
+    exponent = exponent_negative ? -exponent : exponent;
+  }
 
-      if (minus) {
-        num /= (double)(pg_pow_u64(10, exp));
-      } else {
-        num *= (double)(pg_pow_u64(10, exp));
+  // `w` wrapped around past 19 digits, not counting the leading zeros.
+  bool truncated = false;
+  u64 digits_count = integer.len + fraction.len;
+  if (digits_count > 19) {
+    for (usize j = 0; j < integer.len && integer.data[j] == '0'; j++) {
+      digits_count -= 1;
+    }
+    if (integer.len == 1 && integer.data[0] == '0') {
+      for (usize j = 0; j < fraction.len && fraction.data[j] == '0'; j++) {
+        digits_count -= 1;
       }
-    } else {
-      break;
     }
+    truncated = digits_count > 19;
+  }
+
+  double value = 0;
+  if (truncated) {
+    w = json_number_leading_digits(integer, fraction, &exponent);
+  } else {
+    exponent -= (i64)fraction.len;
   }
+  if (!decimal_to_double(w, exponent, negative, truncated, &value)) {
+    // Rare: more than 19 digits, and very close to halfway between two
+    // doubles.
+    char *const c_str = arena_alloc(arena, 1, 1, i - start + 1);
+    memcpy(c_str, s.data + start, i - start);
+    value = strtod(c_str, NULL);
+  }
+  cursor->pos = i;
 
   Json *j = arena_alloc(arena, sizeof(Json), _Alignof(Json), 1);
-  *j = (Json){.kind = JSON_KIND_NUMBER, .v.number = (double)num * sign};
+  *j = (Json){.kind = JSON_KIND_NUMBER, .v.number = value};
   return j;
 }
 
@@ -135,254 +217,645 @@ static Json *_Nullable json_parse_null(Read_cursor *_Nonnull cursor,
   return j;
 }
 
-typedef enum {
-  JSON_CONSUME_U4,
-  JSON_CONSUME_RUNE,
-  JSON_CONSUME_AT_END,
-  JSON_CONSUME_ERROR,
-} Json_consume;
-
-static Json_consume json_consume_unicode_literal(Read_cursor *_Nonnull cursor,
-                                                 u32 *_Nonnull res) {
+// After the backslash: the character escaped, or the code unit of `\uXXXX`.
+__attribute__((warn_unused_result)) static bool
+json_consume_escape(Read_cursor *_Nonnull cursor, u32 *_Nonnull u4) {
+  switch (read_cursor_next(cursor)) {
+  case '"':
+    *u4 = '"';
+    return true;
+  case '\\':
+    *u4 = '\\';
+    return true;
+  case '/':
+    *u4 = '/';
+    return true;
+  case 'b':
+    *u4 = '\b';
+    return true;
+  case 'f':
+    *u4 = '\f';
+    return true;
+  case 'n':
+    *u4 = '\n';
+    return true;
+  case 'r':
+    *u4 = '\r';
+    return true;
+  case 't':
+    *u4 = '\t';
+    return true;
+  case 'u':
+    break;
+  default:
+    return false;
+  }
+
   for (u64 i = 0; i < 4; i++) {
     const u8 c = read_cursor_next(cursor);
 
     if (!char_is_hex_digit(c))
-      return JSON_CONSUME_ERROR;
+      return false;
 
-    *res = *res * 16 + hex_digit_to_u8(c);
+    *u4 = *u4 * 16 + hex_digit_to_u8(c);
   }
-  return JSON_CONSUME_U4;
+  return true;
 }
 
-static Json_consume
-json_consume_string_character(Read_cursor *_Nonnull cursor, u32 *_Nonnull u4,
-                              Unicode_character *_Nonnull rune) {
-  if (read_cursor_match_char(cursor, '"'))
-    return JSON_CONSUME_AT_END;
+// Whether a string scan stops at this byte: the end of the string, an escape,
+// or a control character (which must be escaped).
+__attribute__((warn_unused_result)) static bool json_string_stops_at(u8 c) {
+  return c == '"' || c == '\\' || c < 0x20;
+}
 
-  u8 to_escape_set[] = {0x22, 0x5c, 0x2f, 0x62, 0x66, 0x6e, 0x72, 0x74};
-  if (read_cursor_match_char(cursor, 0x5c)) { // `\`
-    u8 matched = 0;
-    if (read_cursor_match_char_oneof(
-            cursor,
-            (Str){.data = to_escape_set, .len = carray_count(to_escape_set)},
-            &matched)) {
-      *u4 = (u32)matched;
-      return JSON_CONSUME_U4;
-    }
+// Like `Http_scan_kernel`, for `json_string_stops_at`, exactly.
+typedef usize (*Json_string_scan_kernel)(const u8 *_Nonnull data, usize len,
+                                         usize i);
 
-    if (read_cursor_match_char(cursor, 'u'))
-      return json_consume_unicode_literal(cursor, u4);
+__attribute__((warn_unused_result)) static usize
+json_string_scan_scalar(const u8 *_Nonnull data, usize len, usize i) {
+  while (i < len && !json_string_stops_at(data[i])) {
+    i += 1;
+  }
+  return i;
+}
 
-    return false;
+#if defined(__x86_64__)
+// Unsigned `c < ' '` is `min(c, 0x1f) == c`.
+__attribute__((warn_unused_result, target("sse4.2"),
+               always_inline)) static inline u32
+json_string_sse42_mask(__m128i chunk) {
+  const __m128i quote = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"'));
+  const __m128i backslash = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\'));
+  const __m128i below_space =
+      _mm_cmpeq_epi8(_mm_min_epu8(chunk, _mm_set1_epi8(0x1f)), chunk);
+  return (u32)_mm_movemask_epi8(
+      _mm_or_si128(_mm_or_si128(quote, backslash), below_space));
+}
+
+__attribute__((warn_unused_result, target("sse4.2"))) static usize
+json_string_scan_sse42(const u8 *_Nonnull data, usize len, usize i) {
+  for (; i + 16 <= len; i += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128((const __m128i *)(const void *)(data + i));
+    const u32 mask = json_string_sse42_mask(chunk);
+    if (mask != 0)
+      return i + (usize)__builtin_ctz(mask);
   }
 
-  // Unescaped character, sanity check.
-  {
-    const u8 c = read_cursor_peek(*cursor);
-    pg_assert((0x20 <= c && c <= 0x21) || (0x23 <= c && c <= 0x5b) ||
-              (0x5d <= c));
+  // The tail, as the last 16 bytes, ignoring those already scanned.
+  if (i < len && len >= 16) {
+    const __m128i chunk =
+        _mm_loadu_si128((const __m128i *)(const void *)(data + len - 16));
+    const u32 mask = json_string_sse42_mask(chunk) >> (16 - (len - i));
+    return mask != 0 ? i + (usize)__builtin_ctz(mask) : len;
   }
-  *rune = read_cursor_utf8_rune(cursor);
-  if (rune->len == 0)
-    return JSON_CONSUME_ERROR;
+  return json_string_scan_scalar(data, len, i);
+}
 
-  return JSON_CONSUME_RUNE;
+__attribute__((warn_unused_result, target("avx2"),
+               always_inline)) static inline u32
+json_string_avx2_mask(__m256i chunk) {
+  const __m256i quote = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('"'));
+  const __m256i backslash = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\\'));
+  const __m256i below_space =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, _mm256_set1_epi8(0x1f)), chunk);
+  return (u32)_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_or_si256(quote, backslash), below_space));
 }
 
+__attribute__((warn_unused_result, target("avx2"))) static usize
+json_string_scan_avx2(const u8 *_Nonnull data, usize len, usize i) {
+  for (; i + 32 <= len; i += 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256((const __m256i *)(const void *)(data + i));
+    const u32 mask = json_string_avx2_mask(chunk);
+    if (mask != 0)
+      return i + (usize)__builtin_ctz(mask);
+  }
+
+  // The tail, as the last 32 bytes, ignoring those already scanned.
+  if (i < len && len >= 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256((const __m256i *)(const void *)(data + len - 32));
+    const u32 mask = json_string_avx2_mask(chunk) >> (32 - (len - i));
+    return mask != 0 ? i + (usize)__builtin_ctz(mask) : len;
+  }
+  // Strings are often shorter: 16 bytes at a time still.
+  return json_string_scan_sse42(data, len, i);
+}
+#endif
+
+__attribute__((warn_unused_result)) static Json_string_scan_kernel
+json_string_scan_kernel_for(Simd_level level) {
+  switch (level) {
+#if defined(__x86_64__)
+  case SIMD_LEVEL_AVX2:
+    return json_string_scan_avx2;
+  case SIMD_LEVEL_SSE42:
+    return json_string_scan_sse42;
+#endif
+  default:
+    return json_string_scan_scalar;
+  }
+}
+
+// Picked at startup for this CPU, or by the tests.
+static Json_string_scan_kernel _Nullable json_string_scan_kernel = NULL;
+
+// Append the (possibly surrogate pair) escape after the backslash at the
+// cursor.
+__attribute__((warn_unused_result)) static bool
+json_append_escape(Read_cursor *_Nonnull cursor, Str_builder *_Nonnull out,
+                   Arena *_Nonnull arena) {
+  u32 u4 = 0;
+  if (!json_consume_escape(cursor, &u4))
+    return false;
+
+  if (char32_is_utf16_first_surrogate_pair(u4)) {
+    // Parse a possible following surrogate element, but do not bail if it's
+    // not present.
+    Read_cursor copy = *cursor;
+    u32 second = 0;
+    if (read_cursor_match_char(&copy, '\\') &&
+        json_consume_escape(&copy, &second) &&
+        char32_is_utf16_second_surrogate_pair(second)) {
+      const Unicode_character uc = utf16_surrogate_pair_to_utf8(u4, second);
+      if (uc.len == 0)
+        return false;
+
+      *out = sb_append_unicode_character(*out, uc, arena);
+      *cursor = copy;
+      return true;
+    }
+
+    *out = sb_append_unicode_character(
+        *out, u4_to_utf8(UNICODE_REPLACEMENT_CHARACTER_U4), arena);
+    return true;
+  }
+
+  const Unicode_character uc = u4_to_utf8(u4);
+  if (uc.len == 0)
+    return false;
+
+  *out = sb_append_unicode_character(*out, uc, arena);
+  return true;
+}
+
+// Append `run`, made of runes but not valid UTF-8, with U+FFFD in place of the
+// invalid ones. False if it is not even made of runes.
+__attribute__((warn_unused_result)) static bool
+json_append_utf8_replacing(Str_builder *_Nonnull out, Str run,
+                           Arena *_Nonnull arena) {
+  Read_cursor cursor = {.s = run};
+  while (!read_cursor_is_at_end(cursor)) {
+    const Unicode_character rune = read_cursor_utf8_rune(&cursor);
+    if (rune.len == 0)
+      return false;
+
+    *out = sb_append_unicode_character(*out, utf8_replace_if_invalid(rune),
+                                       arena);
+  }
+  return true;
+}
+
+// Without escapes (nor invalid UTF-8 to replace), the string is a view of the
+// input. Otherwise, the runs of bytes between escapes are copied whole. Runs
+// are validated as UTF-8 in bulk: escapes are ASCII, and so cannot be inside a
+// rune.
 static Json *_Nullable json_parse_string(Read_cursor *_Nonnull cursor,
                                          Arena *_Nonnull arena) {
-  if (!read_cursor_match_char(cursor, '"'))
+  if (!read_cursor_match_char(cursor, '"') || read_cursor_is_at_end(*cursor))
     return NULL;
 
-  Str_builder out = sb_new(cursor->s.len - cursor->pos - 2 /* quotes */, arena);
+  if (json_string_scan_kernel == NULL) {
+    json_string_scan_kernel = json_string_scan_kernel_for(simd_level());
+  }
+
+  const Str s = cursor->s;
+  usize run_start = cursor->pos;
+  Str_builder out = {0};
 
-  while (!read_cursor_is_at_end(*cursor)) {
-    u32 u4 = 0;
-    Unicode_character rune = {0};
-    const Json_consume consume_res =
-        json_consume_string_character(cursor, &u4, &rune);
-    if (consume_res == JSON_CONSUME_ERROR)
+  while (true) {
+    cursor->pos = json_string_scan_kernel(s.data, s.len, cursor->pos);
+    if (read_cursor_is_at_end(*cursor))
       return NULL;
 
-    if (consume_res == JSON_CONSUME_RUNE) {
-      pg_assert(1 <= rune.len && rune.len <= 4);
-      out = sb_append_unicode_character(out, utf8_replace_if_overlong(rune),
-                                        arena);
-      continue;
-    }
+    const u8 c = s.data[cursor->pos];
+    // Control characters must be escaped.
+    if (c < 0x20)
+      return NULL;
 
-    if (consume_res == JSON_CONSUME_U4) {
-      if (char32_is_utf16_first_surrogate_pair(u4)) {
-        // Parse a possible following surrogate element, but do not bail if it's
-        // not present.
-        Read_cursor copy = *cursor;
-        u32 second = 0;
-        const Json_consume consume_res_more = json_consume_string_character(
-            &copy, &second, &(Unicode_character){0});
-        if (consume_res_more == JSON_CONSUME_U4 &&
-            char32_is_utf16_second_surrogate_pair(second)) {
-          const Unicode_character uc = utf16_surrogate_pair_to_utf8(u4, second);
-          if (uc.len == 0)
-            return NULL;
-
-          out = sb_append_unicode_character(out, uc, arena);
-          *cursor = copy;
-          continue;
-        } else {
-          out = sb_append_unicode_character(
-              out, u4_to_utf8(UNICODE_REPLACEMENT_CHARACTER_U4), arena);
-          continue;
-        }
-      }
+    const Str run = {.data = s.data + run_start,
+                     .len = cursor->pos - run_start};
+    const bool valid = utf8_valid(run);
+    cursor->pos += 1;
 
-      const Unicode_character uc = u4_to_utf8(u4);
-      if (uc.len == 0)
-        return NULL;
+    if (c == '"' && valid && out.data == NULL) {
+      Json *const j = arena_alloc(arena, sizeof(Json), _Alignof(Json), 1);
+      *j = (Json){.kind = JSON_KIND_STRING, .v.string = run};
+      return j;
+    }
 
-      out = sb_append_unicode_character(out, uc, arena);
-      continue;
+    if (out.data == NULL) {
+      // At most the rest of the input, but for what is replaced with longer.
+      out = sb_new(s.len - run_start, arena);
+    }
+    if (valid) {
+      out = sb_append(out, run, arena);
+    } else if (!json_append_utf8_replacing(&out, run, arena)) {
+      return NULL;
     }
 
-    pg_assert(consume_res == JSON_CONSUME_AT_END);
+    if (c == '"') {
+      Json *const j = arena_alloc(arena, sizeof(Json), _Alignof(Json), 1);
+      *j = (Json){.kind = JSON_KIND_STRING, .v.string = sb_build(out)};
+      return j;
+    }
 
-    Json *const j = arena_alloc(arena, sizeof(Json), _Alignof(Json), 1);
-    *j = (Json){.kind = JSON_KIND_STRING, .v.string = sb_build(out)};
-    return j;
-  }
+    pg_assert(c == '\\');
+    if (!json_append_escape(cursor, &out, arena))
+      return NULL;
 
-  return NULL;
+    run_start = cursor->pos;
+  }
 }
 
-static Json *_Nullable json_parse(Read_cursor *_Nonnull cursor,
-                                  Arena *_Nonnull arena);
+// Parsing is done in two stages. Stage 1 classifies the input 64 bytes at a
+// time into bitmasks, and extracts from them the positions of the structural
+// characters (`{}[]:,`) and of the first byte of each scalar and string,
+// outside of strings. Stage 2 builds the DOM from these positions, without
+// looking at the whitespace in between. Both are interleaved by batches of
+// positions, so that stage 2 works on cache-hot data in bounded memory.
 
-static Json *_Nullable json_parse_array(Read_cursor *_Nonnull cursor,
-                                        Arena *_Nonnull arena) {
-  pg_assert(read_cursor_next(cursor) == '[');
+#define JSON_INDEX_BATCH_LEN 1024U
+#define JSON_DEPTH_MAX 1024U
 
-  Json *j = arena_alloc(arena, sizeof(Json), _Alignof(Json), 1);
-  *j = (Json){.kind = JSON_KIND_ARRAY};
-  Json *it = NULL;
+// Classes of a byte, as bits.
+typedef enum {
+  JSON_CHAR_QUOTE = 1,
+  JSON_CHAR_BACKSLASH = 2,
+  JSON_CHAR_SPACE = 4,
+  JSON_CHAR_OP = 8,
+} Json_char_class;
+
+static const u8 json_char_classes[256] = {
+    ['"'] = JSON_CHAR_QUOTE, ['\\'] = JSON_CHAR_BACKSLASH,
+    [' '] = JSON_CHAR_SPACE, ['\t'] = JSON_CHAR_SPACE,
+    ['\n'] = JSON_CHAR_SPACE, ['\r'] = JSON_CHAR_SPACE,
+    ['{'] = JSON_CHAR_OP,    ['}'] = JSON_CHAR_OP,
+    ['['] = JSON_CHAR_OP,    [']'] = JSON_CHAR_OP,
+    [':'] = JSON_CHAR_OP,    [','] = JSON_CHAR_OP,
+};
 
-  while (!read_cursor_is_at_end(*cursor)) {
-    const u8 c = read_cursor_peek(*cursor);
-    if (c == ']') {
-      read_cursor_next(cursor);
-      return j;
-    } else if (char_is_space(c)) {
-      read_cursor_next(cursor);
-    } else {
-      Json *child = json_parse(cursor, arena);
-      if (child == NULL)
-        return NULL;
+// Bit `i` of each mask is for byte `i` of a 64-byte block.
+typedef struct {
+  u64 quote;
+  u64 backslash;
+  u64 space;
+  // Vector kernels may also set it for a few control characters, which are
+  // invalid outside of strings anyway: stage 2 checks the actual byte.
+  u64 op;
+} Json_block;
+
+typedef Json_block (*Json_classify_kernel)(const u8 *_Nonnull block);
+
+__attribute__((warn_unused_result)) static Json_block
+json_classify_scalar(const u8 *_Nonnull block) {
+  Json_block res = {0};
+  for (u64 i = 0; i < 64; i++) {
+    const u64 classes = json_char_classes[block[i]];
+    res.quote |= (classes & 1) << i;
+    res.backslash |= (classes >> 1 & 1) << i;
+    res.space |= (classes >> 2 & 1) << i;
+    res.op |= (classes >> 3 & 1) << i;
+  }
+  return res;
+}
 
-      const bool comma = read_cursor_match_char(cursor, ',');
-      read_cursor_skip_many_spaces(cursor);
+#if defined(__x86_64__)
+__attribute__((warn_unused_result, target("avx2"))) static Json_block
+json_classify_avx2(const u8 *_Nonnull block) {
+  // By low nibble, the only whitespace byte with this nibble, or a byte which
+  // never matches (looked up bytes with the high bit set yield 0).
+  const __m256i space_table = _mm256_setr_epi8(
+      ' ', -1, -1, -1, -1, -1, -1, -1, -1, '\t', '\n', -1, -1, '\r', -1, -1,
+      ' ', -1, -1, -1, -1, -1, -1, -1, -1, '\t', '\n', -1, -1, '\r', -1, -1);
+  // Likewise for the operators, once `| 0x20` turned `[]` into `{}`. This
+  // also matches 0x0c and 0x1a.
+  const __m256i op_table = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, ':', '{', ',', '}', -1, -1, //
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, ':', '{', ',', '}', -1, -1);
+
+  Json_block res = {0};
+  for (u32 half = 0; half < 2; half++) {
+    const __m256i chunk =
+        _mm256_loadu_si256((const __m256i *)(const void *)(block + 32 * half));
+    const u32 shift = 32 * half;
+
+    const __m256i quote = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('"'));
+    const __m256i backslash = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\\'));
+    const __m256i space =
+        _mm256_cmpeq_epi8(_mm256_shuffle_epi8(space_table, chunk), chunk);
+    const __m256i op =
+        _mm256_cmpeq_epi8(_mm256_shuffle_epi8(op_table, chunk),
+                          _mm256_or_si256(chunk, _mm256_set1_epi8(0x20)));
+
+    res.quote |= (u64)(u32)_mm256_movemask_epi8(quote) << shift;
+    res.backslash |= (u64)(u32)_mm256_movemask_epi8(backslash) << shift;
+    res.space |= (u64)(u32)_mm256_movemask_epi8(space) << shift;
+    res.op |= (u64)(u32)_mm256_movemask_epi8(op) << shift;
+  }
+  return res;
+}
+#endif
+
+__attribute__((warn_unused_result)) static Json_classify_kernel
+json_classify_kernel_for(Simd_level level) {
+  switch (level) {
+#if defined(__x86_64__)
+  case SIMD_LEVEL_AVX2:
+    return json_classify_avx2;
+#endif
+  default:
+    return json_classify_scalar;
+  }
+}
 
-      if (comma && read_cursor_peek(*cursor) == ']') {
-        return NULL;
-      }
+// Picked at startup for this CPU, or by the tests.
+static Json_classify_kernel _Nullable json_classify_kernel = NULL;
+
+// Bit `i` set if byte `i` is an odd number of bytes into a run of
+// backslashes, i.e. escaped. `prev_escaped` is 1 if the first byte of the
+// block is, and is updated for the next block.
+__attribute__((warn_unused_result)) static u64
+json_escaped(u64 backslash, u64 *_Nonnull prev_escaped) {
+  backslash &= ~*prev_escaped;
+  const u64 follows_escape = backslash << 1 | *prev_escaped;
+
+  // Adding the start of each run to the run carries past its end: the bit
+  // after a run lands on an odd position if and only if the run started on
+  // an odd position and has an odd length, or on an even one and has an even
+  // length. Runs starting on odd positions are added, those on even ones are
+  // handled by inverting.
+  const u64 even_bits = 0x5555555555555555ULL;
+  const u64 odd_starts = backslash & ~even_bits & ~follows_escape;
+  u64 sequences_starting_on_even_bits = 0;
+  *prev_escaped = __builtin_add_overflow(odd_starts, backslash,
+                                         &sequences_starting_on_even_bits);
+  const u64 invert_mask = sequences_starting_on_even_bits << 1;
+  return (even_bits ^ invert_mask) & follows_escape;
+}
 
-      j->v.children = j->v.children == NULL ? child : j->v.children;
-      if (it == NULL) {
-        it = child;
-      } else {
-        it = it->next = child;
-      }
-    }
-  }
+// Bit `i` is the xor of bits `0..=i`.
+__attribute__((warn_unused_result)) static u64 json_prefix_xor(u64 x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
 
-  return NULL;
+typedef struct {
+  Str s;
+  // Bytes classified so far: a multiple of 64, but at the end.
+  usize indexed_len;
+  // State carried from one block to the next. All ones if the previous block
+  // ended inside a string.
+  u64 in_string;
+  // 1 if the first byte of the block is escaped.
+  u64 escaped;
+  // 1 if the previous block ended with a byte of a scalar.
+  u64 scalar;
+  u32 positions_len;
+  u32 next;
+  // Relative to `s`, of the current batch.
+  u32 positions[JSON_INDEX_BATCH_LEN];
+} Json_index;
+
+// Mask of the structural characters of the block, and of the first bytes of
+// the scalars and strings.
+__attribute__((warn_unused_result)) static u64
+json_index_structurals(Json_index *_Nonnull index, Json_block block) {
+  const u64 escaped = json_escaped(block.backslash, &index->escaped);
+  const u64 quote = block.quote & ~escaped;
+
+  // Set from the opening quote of a string until its closing quote excluded.
+  const u64 in_string = json_prefix_xor(quote) ^ index->in_string;
+  index->in_string = (u64)((i64)in_string >> 63);
+  // Inside strings, but the opening quote.
+  const u64 string_tail = in_string ^ quote;
+
+  const u64 scalar = ~(block.op | block.space);
+  const u64 nonquote_scalar = scalar & ~quote;
+  const u64 follows_nonquote_scalar = nonquote_scalar << 1 | index->scalar;
+  index->scalar = nonquote_scalar >> 63;
+
+  const u64 scalar_start = scalar & ~follows_nonquote_scalar;
+  return (block.op | scalar_start) & ~string_tail;
 }
 
-static Json *_Nullable json_parse_object(Read_cursor *_Nonnull cursor,
-                                         Arena *_Nonnull arena) {
-  pg_assert(read_cursor_next(cursor) == '{');
+// Stage 1 over the next blocks, until the batch is full or the input ends.
+static void json_index_fill(Json_index *_Nonnull index) {
+  index->positions_len = 0;
+  index->next = 0;
+
+  while (index->indexed_len < index->s.len &&
+         index->positions_len + 64 <= JSON_INDEX_BATCH_LEN) {
+    const usize base = index->indexed_len;
+    const usize remaining = index->s.len - base;
+
+    // Padded with whitespace, which is never structural.
+    u8 padded[64];
+    const u8 *block = index->s.data + base;
+    if (remaining < 64) {
+      memset(padded, ' ', sizeof(padded));
+      memcpy(padded, block, remaining);
+      block = padded;
+    }
 
-  Json *const j = arena_alloc(arena, sizeof(Json), _Alignof(Json), 1);
-  *j = (Json){.kind = JSON_KIND_OBJECT};
-  Json *it = NULL;
+    u64 structurals =
+        json_index_structurals(index, json_classify_kernel(block));
+    while (structurals != 0) {
+      index->positions[index->positions_len++] =
+          (u32)(base + (usize)__builtin_ctzll(structurals));
+      structurals &= structurals - 1;
+    }
+    index->indexed_len += pg_min(remaining, 64);
+  }
+}
 
-  while (!read_cursor_is_at_end(*cursor)) {
-    const u8 c = read_cursor_peek(*cursor);
-    if (c == '}') {
-      read_cursor_next(cursor);
-      return j;
-    } else if (char_is_space(c)) {
-      read_cursor_next(cursor);
-    } else {
-      Json *const key = json_parse_string(cursor, arena);
-      if (key == NULL)
-        return NULL;
+// Position of the next structural character, or false at the end of the
+// input.
+__attribute__((warn_unused_result)) static bool
+json_index_next(Json_index *_Nonnull index, usize *_Nonnull pos) {
+  if (index->next == index->positions_len) {
+    json_index_fill(index);
+    if (index->positions_len == 0)
+      return false;
+  }
 
-      read_cursor_skip_many_spaces(cursor);
+  *pos = index->positions[index->next++];
+  return true;
+}
 
-      if (!read_cursor_match_char(cursor, ':'))
-        return NULL;
+// Put back the position just returned by `json_index_next`.
+static void json_index_unread(Json_index *_Nonnull index) {
+  pg_assert(index->next > 0);
+  index->next -= 1;
+}
 
-      Json *const value = json_parse(cursor, arena);
-      if (value == NULL)
-        return NULL;
+// The string starting at `pos` ends before the next structural character.
+__attribute__((warn_unused_result)) static Json *_Nullable
+json_parse_string_at(Json_index *_Nonnull index, usize pos,
+                     Arena *_Nonnull arena) {
+  usize end = index->s.len;
+  if (json_index_next(index, &end)) {
+    json_index_unread(index);
+  }
 
-      read_cursor_skip_many_spaces(cursor);
-      const bool comma = read_cursor_match_char(cursor, ',');
-      read_cursor_skip_many_spaces(cursor);
+  Read_cursor cursor = {
+      .s = {.data = index->s.data, .len = end},
+      .pos = pos,
+  };
+  return json_parse_string(&cursor, arena);
+}
 
-      if (comma && read_cursor_peek(*cursor) == '}')
-        return NULL;
+__attribute__((warn_unused_result)) static Json *_Nullable
+json_parse_scalar_at(Str s, usize pos, Arena *_Nonnull arena) {
+  Read_cursor cursor = {.s = s, .pos = pos};
+  const u8 c = s.data[pos];
+
+  Json *j = NULL;
+  if (char_is_digit(c) || c == '-') {
+    j = json_parse_number(&cursor, arena);
+  } else if (c == 't' || c == 'f') {
+    j = json_parse_bool(&cursor, arena);
+  } else if (c == 'n') {
+    j = json_parse_null(&cursor, arena);
+  }
 
-      j->v.children = j->v.children == NULL ? key : j->v.children;
+  // The scalar spans all the bytes until the next whitespace or structural
+  // character.
+  if (cursor.pos < s.len && !(json_char_classes[s.data[cursor.pos]] &
+                              (JSON_CHAR_SPACE | JSON_CHAR_OP)))
+    return NULL;
 
-      if (it == NULL) {
-        it = key;
-      } else {
-        it = it->next = key;
-      }
-      it = it->next = value;
-    }
+  return j;
+}
+
+typedef struct {
+  Json *_Nonnull container;
+  Json *_Nullable last_child;
+} Json_frame;
+
+static void json_frame_append(Json_frame *_Nonnull frame,
+                              Json *_Nonnull child) {
+  if (frame->last_child == NULL) {
+    frame->container->v.children = child;
+  } else {
+    frame->last_child->next = child;
   }
+  frame->last_child = child;
+}
 
-  return NULL;
+__attribute__((warn_unused_result)) static u8
+json_frame_closing(const Json_frame *_Nonnull frame) {
+  return frame->container->kind == JSON_KIND_ARRAY ? ']' : '}';
 }
 
+// Parse the value at the cursor, and skip the whitespace after it. Nesting is
+// limited to `JSON_DEPTH_MAX` levels. Strings without escapes point into the
+// input, which must outlive the result.
 static Json *_Nullable json_parse(Read_cursor *_Nonnull cursor,
                                   Arena *_Nonnull arena) {
-  while (!read_cursor_is_at_end(*cursor)) {
-    const u8 c = read_cursor_peek(*cursor);
+  const Str s = read_cursor_remaining(*cursor);
+  if (s.len > UINT32_MAX)
+    return NULL;
 
-    if (char_is_digit_no_zero(c) || c == '-') {
-      Json *const j = json_parse_number(cursor, arena);
-      read_cursor_skip_many_spaces(cursor);
-      return j;
-    } else if (c == 't' || c == 'f') {
-      Json *const j = json_parse_bool(cursor, arena);
-      read_cursor_skip_many_spaces(cursor);
-      return j;
-    } else if (c == 'n') {
-      Json *const j = json_parse_null(cursor, arena);
-      read_cursor_skip_many_spaces(cursor);
-      return j;
+  if (json_classify_kernel == NULL) {
+    json_classify_kernel = json_classify_kernel_for(simd_level());
+  }
+
+  Json_index index = {.s = s};
+  Json_frame stack[JSON_DEPTH_MAX];
+  u32 depth = 0;
+  Json *root = NULL;
+  usize pos = 0;
+
+  for (;;) {
+    if (!json_index_next(&index, &pos))
+      return NULL;
+
+    Json_frame *const parent = depth > 0 ? &stack[depth - 1] : NULL;
+    if (parent && parent->container->kind == JSON_KIND_OBJECT) {
+      if (s.data[pos] != '"')
+        return NULL;
+
+      Json *const key = json_parse_string_at(&index, pos, arena);
+      if (key == NULL)
+        return NULL;
+      json_frame_append(parent, key);
+
+      if (!json_index_next(&index, &pos) || s.data[pos] != ':')
+        return NULL;
+      if (!json_index_next(&index, &pos))
+        return NULL;
+    }
+
+    const u8 c = s.data[pos];
+    Json *value = NULL;
+    if (c == '[' || c == '{') {
+      if (depth == JSON_DEPTH_MAX)
+        return NULL;
+
+      value = arena_alloc(arena, sizeof(Json), _Alignof(Json), 1);
+      *value = (Json){.kind = c == '[' ? JSON_KIND_ARRAY : JSON_KIND_OBJECT};
     } else if (c == '"') {
-      Json *const j = json_parse_string(cursor, arena);
-      read_cursor_skip_many_spaces(cursor);
-      return j;
-    } else if (c == '[') {
-      Json *const j = json_parse_array(cursor, arena);
-      read_cursor_skip_many_spaces(cursor);
-      return j;
-    } else if (c == '{') {
-      Json *const j = json_parse_object(cursor, arena);
-      read_cursor_skip_many_spaces(cursor);
-      return j;
-    } else if (char_is_space(c)) {
-      read_cursor_skip_many_spaces(cursor);
+      value = json_parse_string_at(&index, pos, arena);
     } else {
+      value = json_parse_scalar_at(s, pos, arena);
+    }
+    if (value == NULL)
       return NULL;
+
+    if (parent) {
+      json_frame_append(parent, value);
+    } else {
+      root = value;
+    }
+
+    if (value->kind == JSON_KIND_ARRAY || value->kind == JSON_KIND_OBJECT) {
+      stack[depth++] = (Json_frame){.container = value};
+
+      if (!json_index_next(&index, &pos))
+        return NULL;
+      if (s.data[pos] != json_frame_closing(&stack[depth - 1])) {
+        json_index_unread(&index);
+        continue;
+      }
+      depth -= 1;
+    }
+
+    // Close the containers ending here, up to the next element if any.
+    while (depth > 0) {
+      if (!json_index_next(&index, &pos))
+        return NULL;
+      if (s.data[pos] == ',')
+        break;
+      if (s.data[pos] != json_frame_closing(&stack[depth - 1]))
+        return NULL;
+      depth -= 1;
+    }
+
+    if (depth == 0) {
+      // What follows the whitespace after the value, if anything.
+      cursor->pos += json_index_next(&index, &pos) ? pos : s.len;
+      return root;
     }
   }
-  return NULL;
 }
 
 __attribute__((warn_unused_result)) static Str_builder
@@ -399,8 +872,7 @@ json_format_do(const Json *_Nullable j, Str_builder sb, usize indent,
   case JSON_KIND_BOOL:
     return sb_append(sb, str_from_c(j->v.boolean ? "true" : "false"), arena);
   case JSON_KIND_NUMBER:
-    // TODO: Format double
-    return sb_append_u64(sb, (u64)j->v.number, arena);
+    return sb_append_double(sb, j->v.number, arena);
   case JSON_KIND_STRING:
     sb = sb_append_char(sb, '"', arena);
     sb = sb_append(sb, j->v.string, arena);
@@ -580,6 +1052,39 @@ static void test_json_parse(void) {
 
     pg_assert(read_cursor_is_at_end(cursor));
   }
+  {
+    // Correctly rounded, including past 19 digits.
+    const struct {
+      char *in;
+      double expected;
+    } tests[] = {
+        {"0", 0},
+        {"-0", -0.0},
+        {"0.5", 0.5},
+        {"1e5", 1e5},
+        {"0.1", 0.1},
+        {"2.2250738585072014e-308", 2.2250738585072014e-308},
+        {"4.9e-324", 4.9406564584124654e-324},
+        {"1.7976931348623157E+308", 1.7976931348623157e308},
+        {"9007199254740993", 9007199254740992.0},
+        {"9007199254740993.0000000000000001", 9007199254740994.0},
+        {"0.0000000000000000000012345678901234567890123",
+         1.2345678901234568e-21},
+    };
+    for (u64 i = 0; i < carray_count(tests); i++) {
+      const Str in = str_from_c(tests[i].in);
+      u8 mem[256] = {0};
+      Arena arena = arena_from_mem(mem, sizeof(mem));
+      Read_cursor cursor = {.s = in};
+
+      const Json *const j = json_parse(&cursor, &arena);
+      pg_assert(j != NULL);
+      pg_assert(j->kind == JSON_KIND_NUMBER);
+      pg_assert(memcmp(&j->v.number, &tests[i].expected, sizeof(double)) == 0);
+
+      pg_assert(read_cursor_is_at_end(cursor));
+    }
+  }
   {
     const Str in = str_from_c("true");
     u8 mem[256] = {0};
@@ -903,6 +1408,23 @@ static void test_json_parse(void) {
 
     pg_assert(read_cursor_is_at_end(cursor));
   }
+  {
+    const Str in = str_from_c("[0, -1.50, 0.1e-6, 1e21, 12345678901234567890]");
+    u8 mem[4096] = {0};
+    Arena arena = arena_from_mem(mem, sizeof(mem));
+    Read_cursor cursor = {.s = in};
+
+    const Json *const j = json_parse(&cursor, &arena);
+    const Str out = json_format(j, &arena);
+
+    pg_assert(str_eq_c(out, "[\n"
+                            "  0,\n"
+                            "  -1.5,\n"
+                            "  1e-7,\n"
+                            "  1e+21,\n"
+                            "  12345678901234567000\n"
+                            "]"));
+  }
   {
     const Str in = str_from_c(
         "{ \"foo\": 12, \"bar\" : [true, false], \"baz\": \"hello\" }");
@@ -924,4 +1446,141 @@ static void test_json_parse(void) {
 
     pg_assert(read_cursor_is_at_end(cursor));
   }
+  {
+    const Str in = str_from_c("\"");
+    u8 mem[256] = {0};
+    Arena arena = arena_from_mem(mem, sizeof(mem));
+    Read_cursor cursor = {.s = in};
+
+    const Json *const j = json_parse(&cursor, &arena);
+    pg_assert(j == NULL);
+  }
+  {
+    const Str in = str_from_c("\"\"");
+    u8 mem[256] = {0};
+    Arena arena = arena_from_mem(mem, sizeof(mem));
+    Read_cursor cursor = {.s = in};
+
+    const Json *const j = json_parse(&cursor, &arena);
+    pg_assert(j != NULL);
+    pg_assert(j->kind == JSON_KIND_STRING);
+    pg_assert(j->v.string.len == 0);
+
+    pg_assert(read_cursor_is_at_end(cursor));
+  }
+  {
+    const Str in = str_from_c("[\"a\nb\"]");
+    u8 mem[256] = {0};
+    Arena arena = arena_from_mem(mem, sizeof(mem));
+    Read_cursor cursor = {.s = in};
+
+    const Json *const j = json_parse(&cursor, &arena);
+    pg_assert(j == NULL);
+  }
+  {
+    const Str in = str_from_c("[1x]");
+    u8 mem[256] = {0};
+    Arena arena = arena_from_mem(mem, sizeof(mem));
+    Read_cursor cursor = {.s = in};
+
+    const Json *const j = json_parse(&cursor, &arena);
+    pg_assert(j == NULL);
+  }
+  { // Nesting limit.
+    u8 mem[128 * KiB] = {0};
+    Arena arena = arena_from_mem(mem, sizeof(mem));
+
+    for (u32 depth = JSON_DEPTH_MAX; depth <= JSON_DEPTH_MAX + 1; depth++) {
+      Arena parse_arena = arena;
+      Str_builder sb = sb_new(4 * KiB, &parse_arena);
+      sb = sb_append_many(sb, '[', depth, &parse_arena);
+      sb = sb_append_many(sb, ']', depth, &parse_arena);
+      Read_cursor cursor = {.s = sb_build(sb)};
+
+      const Json *const j = json_parse(&cursor, &parse_arena);
+      pg_assert((j != NULL) == (depth == JSON_DEPTH_MAX));
+    }
+  }
+  { // Several batches of positions, shifted against the 64-byte blocks by a
+    // varying amount of whitespace, with every kernel.
+    u8 mem[128 * KiB] = {0};
+    Arena arena = arena_from_mem(mem, sizeof(mem));
+
+    const u64 count = 200;
+    Str_builder sb = sb_new(16 * KiB, &arena);
+    sb = sb_append_char(sb, '[', &arena);
+    for (u64 i = 0; i < count; i++) {
+      sb = sb_append_many(sb, ' ', i % 7, &arena);
+      sb = sb_append(sb,
+                     str_from_c("{\"a\\\\\": \"\\\"x,]}\", "
+                                "\"b\": [true, null, -12]}"),
+                     &arena);
+      if (i + 1 < count) {
+        sb = sb_append_char(sb, ',', &arena);
+      }
+    }
+    sb = sb_append_char(sb, ']', &arena);
+    const Str in = sb_build(sb);
+
+    const Simd_level max_level = simd_level();
+    for (u32 level = SIMD_LEVEL_SCALAR; level <= max_level; level++) {
+      json_classify_kernel = json_classify_kernel_for((Simd_level)level);
+      json_string_scan_kernel = json_string_scan_kernel_for((Simd_level)level);
+
+      Arena parse_arena = arena;
+      Read_cursor cursor = {.s = in};
+      const Json *const j = json_parse(&cursor, &parse_arena);
+      pg_assert(j != NULL);
+      pg_assert(j->kind == JSON_KIND_ARRAY);
+      pg_assert(read_cursor_is_at_end(cursor));
+
+      u64 elements_count = 0;
+      for (const Json *it = j->v.children; it != NULL; it = it->next) {
+        const Json *const key = it->v.children;
+        pg_assert(str_eq_c(key->v.string, "a\\"));
+        pg_assert(str_eq_c(key->next->v.string, "\"x,]}"));
+
+        const Json *const array = key->next->next->next;
+        pg_assert(array->kind == JSON_KIND_ARRAY);
+        pg_assert((i64)array->v.children->next->next->v.number == -12);
+        elements_count += 1;
+      }
+      pg_assert(elements_count == count);
+    }
+    json_classify_kernel = json_classify_kernel_for(max_level);
+    json_string_scan_kernel = json_string_scan_kernel_for(max_level);
+  }
+  {
+    // Long runs, with every kernel: a view of the input without escapes, and
+    // copied around them otherwise.
+    const Str in = str_from_c(
+        "[\"0123456789abcdefghijklmnopqrstuvwxyz\xc3\xa9"
+        "ABCDEFGHIJKLMNOPQ\", "
+        "\"0123456789abcdefghijklmnopqrstuvwxyz\\n0123456789\\u00e9ABCDEF"
+        "GHIJKLMNOPQRSTUVWXYZ\\\"\"]");
+    u8 mem[1024] = {0};
+    Arena arena = arena_from_mem(mem, sizeof(mem));
+
+    const Simd_level max_level = simd_level();
+    for (u32 level = SIMD_LEVEL_SCALAR; level <= max_level; level++) {
+      json_string_scan_kernel = json_string_scan_kernel_for((Simd_level)level);
+
+      Arena parse_arena = arena;
+      Read_cursor cursor = {.s = in};
+      const Json *const j = json_parse(&cursor, &parse_arena);
+      pg_assert(j != NULL);
+
+      const Str first = j->v.children->v.string;
+      pg_assert(first.data == in.data + 2);
+      pg_assert(str_eq_c(first, "0123456789abcdefghijklmnopqrstuvwxyz\xc3\xa9"
+                                "ABCDEFGHIJKLMNOPQ"));
+
+      const Str second = j->v.children->next->v.string;
+      pg_assert(str_eq_c(second, "0123456789abcdefghijklmnopqrstuvwxyz\n"
+                                 "0123456789\xc3\xa9"
+                                 "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                 "\""));
+    }
+    json_string_scan_kernel = json_string_scan_kernel_for(max_level);
+  }
 }
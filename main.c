@@ -2,10 +2,13 @@
 #include "cursor.h"
 #include "http.h"
 #include "json.h"
+#include "router.h"
+#include "server.h"
 #include "str.h"
+#include "uring.h"
 
-#include <netinet/in.h>
 #include <signal.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -20,110 +23,288 @@ static Response handler(Request req, Arena *arena) {
   return (Response){.status = 200, .body = result};
 }
 
+// Count the bytes of an upload as they arrive, without keeping them.
+static void upload_on_body(Request *_Nonnull req, Str chunk,
+                           Arena *_Nonnull arena) {
+  if (req->body_context == NULL)
+    req->body_context = arena_alloc(arena, sizeof(u64), _Alignof(u64), 1);
+
+  *(u64 *)req->body_context += chunk.len;
+}
+
+static Response upload_handler(Request req, Arena *arena) {
+  const u64 received = req.body_context ? *(u64 *)req.body_context : 0;
+  Str_builder body = sb_new(32, arena);
+  body = sb_append_u64(body, received, arena);
+  return (Response){.status = 200, .body = sb_build(body)};
+}
+
+// Read from the signal handler, hence only set before arming the timer.
+static int worker_client_socket = -1;
+static Str worker_timeout_response = {0};
+
+// The whole process is dedicated to the connection: tell the client and exit
+// without unwinding. Only async-signal-safe calls here.
 static void worker_signal_handler(int signo) {
-  if (signo == SIGALRM)
-    abort();
+  if (signo != SIGALRM)
+    return;
+
+  pg_unused(send(worker_client_socket, worker_timeout_response.data,
+                 worker_timeout_response.len, MSG_NOSIGNAL | MSG_DONTWAIT));
+  _exit(0);
 }
 
-static void worker(int client_socket) {
-  // Abort on SIGALRM
+// Answer with an error, the process exiting right after.
+static void worker_fail(int client_socket, u16 status, Arena *_Nonnull arena) {
+  Response res = {.status = status};
+  http_headers_add(&res.headers, str_from_c("Connection"), str_from_c("close"),
+                   arena);
+  worker_timeout_response = (Str){0};
+  // Nothing to do on failure: the connection is closed anyway.
+  const int err = ut_write_all(client_socket, response_head_to_str(res, arena));
+  pg_unused(err);
+}
+
+// Send `head` and `body` from where they are, with one write unless it is
+// short. With `more`, the kernel holds the last packet back for what follows.
+__attribute__((warn_unused_result)) static bool
+worker_send_all(int client_socket, Str head, Str body, bool more) {
+  struct iovec iovecs[2] = {
+      {.iov_base = head.data, .iov_len = head.len},
+      {.iov_base = body.data, .iov_len = body.len},
+  };
+  u32 first = 0;
+  for (;;) {
+    while (first < carray_count(iovecs) && iovecs[first].iov_len == 0) {
+      first += 1;
+    }
+    if (first == carray_count(iovecs))
+      return true;
+
+    const struct msghdr msg = {
+        .msg_iov = iovecs + first,
+        .msg_iovlen = carray_count(iovecs) - first,
+    };
+    const isize sent =
+        sendmsg(client_socket, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (sent == -1 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return false;
+
+    for (usize n = (usize)sent; n > 0;) {
+      const usize advance = pg_min(n, iovecs[first].iov_len);
+      iovecs[first].iov_base = (u8 *)iovecs[first].iov_base + advance;
+      iovecs[first].iov_len -= advance;
+      n -= advance;
+      if (iovecs[first].iov_len == 0)
+        first += 1;
+    }
+  }
+}
+
+static void worker(int client_socket, const Router *_Nonnull router,
+                   Server_limits limits) {
+  // Room for the largest buffered body, only backed by memory as needed.
+  Arena arena = arena_new(ROUTER_REQUEST_ARENA_MIN_SIZE, NULL);
+
+  {
+    Response timeout_response = {.status = 408};
+    http_headers_add(&timeout_response.headers, str_from_c("Connection"),
+                     str_from_c("close"), &arena);
+    worker_timeout_response = response_to_str(timeout_response, &arena);
+    worker_client_socket = client_socket;
+  }
+
   const struct sigaction action = {.sa_handler = worker_signal_handler};
   pg_assert(sigaction(SIGALRM, &action, NULL) != -1);
 
-  // Send SIGALRM on timer expiration to implement worker timeout.
-  const struct itimerval timer = {.it_value = {.tv_sec = 10}};
+  // Deadline for the whole request, including sending the response.
+  const struct itimerval timer = {
+      .it_value = {.tv_sec = (i64)(SERVER_HEADERS_TIMEOUT_MS / 1000)}};
   pg_assert(setitimer(ITIMER_REAL, &timer, NULL) == 0);
 
-  Arena arena = arena_new(64 * KiB, NULL);
-
   Str_builder in_buffer = sb_new(1 * KiB, &arena);
   const Read_result read_res =
-      ut_read_from_fd_until(client_socket, in_buffer, str_from_c("\r\n\r\n"));
+      ut_read_from_fd_until(client_socket, in_buffer, str_from_c("\r\n\r\n"),
+                            limits.max_headers_len, &arena);
+  if (read_res.error == EMSGSIZE) {
+    worker_fail(client_socket, 431, &arena);
+    return;
+  }
+  // The preface of HTTP/2 looks like a request line and headers. Its streams
+  // are served by an event loop, with deadlines of its own.
+  if (!read_res.error && http2_is_preface_prefix(read_res.content)) {
+    pg_assert(setitimer(ITIMER_REAL, &(struct itimerval){0}, NULL) == 0);
+    Server_stats stats = {0};
+    server_serve_connection(
+        client_socket,
+        (Server_config){.router = router,
+                        .limits = limits,
+                        .stats = &stats,
+                        .unix_listen_fd = -1},
+        read_res.content);
+    return;
+  }
   Request req = parse_request(read_res, &arena);
   if (req.error) {
     return;
   }
 
-  // Read body.
+  // Read the body, starting with what was received with the headers.
   {
-    const Header *content_length_header =
-        http_find_header(req.headers, str_from_c("Content-Length"));
-    if (content_length_header) {
-      const usize announced_length = str_to_u64(content_length_header->value);
-      const isize body_sep_pos =
-          str_find(read_res.content, str_from_c("\r\n\r\n"));
-
-      Str_builder body =
-          sb_new(announced_length == 0 ? 16 * KiB : announced_length, &arena);
-      if (body_sep_pos != -1) {
-        pg_assert(body_sep_pos >= 4);
-        Str body_already_read =
-            str_advance(read_res.content, (usize)body_sep_pos + 4);
-
-        pg_assert(body_already_read.len <= announced_length);
-
-        body = sb_append(body, body_already_read, &arena);
-      }
+    Http_body body = {0};
+    if (!http_body_init(req, &body)) {
+      worker_fail(client_socket, 400, &arena);
+      return;
+    }
+    const Router_body route = router_body(router, req);
+    const Http_body_handler on_body = route.on_body;
+    // Buffered bodies are limited by default, streamed ones are not.
+    const u64 body_max_len = route.max_len > 0    ? route.max_len
+                             : on_body == NULL ? SERVER_BODY_MAX_LEN
+                                               : UINT64_MAX;
+    if (body.content_length > body_max_len) {
+      worker_fail(client_socket, 413, &arena);
+      return;
+    }
 
-      const Read_result body_read_res = sb_read_to_fill(body, client_socket);
-      pg_assert(!body_read_res.error);
+    const isize headers_len =
+        str_find(read_res.content, str_from_c("\r\n\r\n")) + 4;
+    pg_assert(headers_len >= 4);
+    const Str received = str_advance(read_res.content, (usize)headers_len);
 
-      req.body = body_read_res.content;
+    const Http_expect expect = http_request_expect(req);
+    if (expect == HTTP_EXPECT_UNSUPPORTED) {
+      worker_fail(client_socket, 417, &arena);
+      return;
+    }
+    // Useless once the body started arriving.
+    if (expect == HTTP_EXPECT_CONTINUE && !http_body_is_empty(body) &&
+        str_is_empty(received)) {
+      if (!worker_send_all(client_socket, HTTP_CONTINUE_RESPONSE, (Str){0},
+                           false))
+        return;
     }
-  }
 
-  const Response res = handler(req, &arena);
-  const Str res_str = response_to_str(res, &arena);
-  int _err = ut_write_all(client_socket, res_str);
-  pg_unused(_err); // Nothing to do.
+    const usize cap = on_body != NULL || body.chunked
+                          ? 16 * KiB
+                          : (usize)body.content_length + 1;
+    Str_builder in = sb_append(sb_new(cap, &arena), received, &arena);
 
-  return;
-}
+    for (;;) {
+      const Http_body_progress progress =
+          http_body_decode(&body, in.data, in.len);
+      if (progress == HTTP_BODY_INVALID) {
+        worker_fail(client_socket, 400, &arena);
+        return;
+      }
+      if (body.streamed + body.len > body_max_len) {
+        worker_fail(client_socket, 413, &arena);
+        return;
+      }
 
-int main(int argc, char *argv[]) {
-  pg_unused(argv);
+      if (on_body != NULL) {
+        if (body.len > 0)
+          on_body(&req, (Str){.data = in.data, .len = body.len}, &arena);
+        if (progress == HTTP_BODY_NEED_MORE) {
+          http_body_drop(&body);
+          memset(in.data, 0, in.len);
+          in.len = 0;
+        }
+      } else if (body.chunked && progress == HTTP_BODY_NEED_MORE) {
+        // Otherwise tiny chunks would fill the buffer with their framing.
+        in.len = http_body_compact(&body, in.data, in.len);
+      }
+      if (progress == HTTP_BODY_COMPLETE)
+        break;
 
-  if (argc != 1) {
-    test_json_parse();
-    return 0;
-  }
+      // Doubling the capacity.
+      if (sb_space(in) == 0)
+        in = sb_grow(in, in.cap - 1, &arena);
+      const isize read_n = read(client_socket, sb_end_c(in), sb_space(in));
+      if (read_n <= 0)
+        return;
+      in = sb_assume_appended_n(in, (usize)read_n);
+    }
 
-  const struct sigaction sa = {.sa_flags = SA_NOCLDWAIT};
-  pg_assert(sigaction(SIGCHLD, &sa, NULL) != -1);
+    if (on_body == NULL)
+      req.body = (Str){.data = in.data, .len = body.len};
+  }
 
-  const int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-  pg_assert(server_socket >= 0);
+  Response res = router_handle(router, req, &arena);
+  // One request per process.
+  http_headers_add(&res.headers, str_from_c("Connection"), str_from_c("close"),
+                   &arena);
+  const Str head = response_head_to_str(res, &arena);
+  if (req.method == HTTP_METHOD_HEAD ||
+      !http_status_has_content_length(res.status)) {
+    res.body = (Str){0};
+    res.file_len = 0;
+  }
+  // Too late to reply with a 408 once the response is partially sent.
+  worker_timeout_response = (Str){0};
+  if (!worker_send_all(client_socket, head, res.body, res.file_len > 0))
+    return; // Nothing to do.
 
-  pg_assert(setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &(int){1},
-                       sizeof(int)) != -1);
-#ifdef SO_REUSEPORT
-  pg_assert(setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &(int){1},
-                       sizeof(int)) != -1);
-#endif
+  off_t offset = (off_t)res.file_offset;
+  for (u64 remaining = res.file_len; remaining > 0;) {
+    const isize sent =
+        sendfile(client_socket, res.file->fd, &offset, remaining);
+    if (sent <= 0)
+      return;
+    remaining -= (u64)sent;
+  }
+}
 
-  const uint16_t port = 4096;
-  const uint16_t net_port = (uint16_t)__builtin_bswap16(port);
+// One process per connection, at most `limits.max_connections` at a time:
+// past that, connections are shed without forking. Connections are accepted
+// from the TCP listener and the Unix one, if any.
+static void server_run_fork(int server_socket, int unix_socket,
+                            const Router *_Nonnull router,
+                            Server_limits limits) {
+  Server_stats stats = {0};
 
-  const struct sockaddr_in addr = {
-      .sin_family = AF_INET,
-      .sin_port = net_port,
-  };
-  pg_assert(bind(server_socket, (const void *)&addr, sizeof(addr)) == 0);
+  Arena arena = arena_new(4 * KiB, NULL);
+  const Str overload_response = server_overload_response(&arena);
 
-  // Will anyways probably be capped to 128 by the kernel depending on the
-  // version (see man page).
-  const int backlog = 4096;
-  pg_assert(listen(server_socket, backlog) == 0);
-  // ssize_t write_n = write(1, "Hello", 5);
+  for (;;) {
+    // Reap the children which exited.
+    while (stats.connections_open > 0 && waitpid(-1, NULL, WNOHANG) > 0) {
+      stats.connections_open -= 1;
+    }
 
-  fprintf(stderr, "Listening to: 0.0.0.0:4096\n");
+    int listen_fd = server_socket;
+    if (unix_socket != -1) {
+      struct pollfd listeners[] = {
+          {.fd = server_socket, .events = POLLIN},
+          {.fd = unix_socket, .events = POLLIN},
+      };
+      if (poll(listeners, carray_count(listeners), -1) == -1) {
+        pg_assert(errno == EINTR);
+        server_stats_print_if_requested("fork", &stats);
+        continue;
+      }
+      if (!(listeners[0].revents & POLLIN))
+        listen_fd = unix_socket;
+    }
 
-  for (;;) {
-    const int client_socket = accept(server_socket, NULL, 0);
+    const int client_socket = accept(listen_fd, NULL, 0);
+    if (client_socket == -1 && errno == EINTR) {
+      server_stats_print_if_requested("fork", &stats);
+      continue;
+    }
     if (client_socket <= 0) {
       fprintf(stderr, "Failed to accept(2)\n");
       continue;
     }
+    stats.connections_accepted += 1;
+
+    if (stats.connections_open >= limits.max_connections) {
+      stats.connections_shed += 1;
+      server_shed_socket(client_socket, limits, overload_response);
+      continue;
+    }
 
     const int pid = fork();
     if (pid == -1) {
@@ -133,10 +314,161 @@ int main(int argc, char *argv[]) {
     }
 
     if (pid == 0) { // Child.
-      worker(client_socket);
+      worker(client_socket, router, limits);
       exit(0);
     } else { // Parent.
+      stats.connections_open += 1;
       close(client_socket);
     }
   }
 }
+
+// Value of a `--max-*` option. A limit of 0 would reject everything, and so
+// would a typo, parsed as 0.
+__attribute__((warn_unused_result)) static u64
+cli_parse_limit(char *_Nonnull option, char *_Nonnull value) {
+  const u64 limit = str_to_u64(str_from_c(value));
+  if (limit == 0) {
+    fprintf(stderr, "Invalid value for %s: %s\n", option, value);
+    exit(1);
+  }
+  return limit;
+}
+
+int main(int argc, char *argv[]) {
+  // Fork a process per connection instead of running the event loop.
+  bool fork_mode = false;
+  // Event loop worker processes, one per online CPU by default.
+  const long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  u32 workers_count =
+      online_cpus > 0 ? pg_min((u32)online_cpus, SERVER_LISTENERS_MAX) : 1;
+  // I/O backend of the event loop.
+  bool io_uring_mode = false;
+  Server_limits limits = SERVER_LIMITS_DEFAULT;
+  // Unix socket to also listen on, for clients on the same host.
+  const char *unix_path = NULL;
+  // Unix socket over which a new server takes the listeners over.
+  const char *control_path = NULL;
+  // Directory served under `/static/`.
+  char *static_dir = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    const Str arg = str_from_c(argv[i]);
+
+    if (str_eq_c(arg, "test")) {
+      test_timer_wheel();
+      test_http_parse();
+      test_http2();
+      test_router();
+      test_static_files();
+      test_decimal();
+      test_utf8();
+      test_json_parse();
+      return 0;
+    } else if (str_eq_c(arg, "--fork")) {
+      fork_mode = true;
+    } else if (str_eq_c(arg, "--io-uring")) {
+      io_uring_mode = true;
+    } else if (str_eq_c(arg, "--max-connections") && i + 1 < argc) {
+      limits.max_connections = cli_parse_limit(argv[i], argv[i + 1]);
+      i += 1;
+    } else if (str_eq_c(arg, "--max-inflight-requests") && i + 1 < argc) {
+      limits.max_inflight_requests = cli_parse_limit(argv[i], argv[i + 1]);
+      i += 1;
+    } else if (str_eq_c(arg, "--max-queued-bytes") && i + 1 < argc) {
+      limits.max_queued_bytes = cli_parse_limit(argv[i], argv[i + 1]);
+      i += 1;
+    } else if (str_eq_c(arg, "--max-headers-len") && i + 1 < argc) {
+      limits.max_headers_len = cli_parse_limit(argv[i], argv[i + 1]);
+      i += 1;
+    } else if (str_eq_c(arg, "--shed-with-reset")) {
+      limits.shed_with_reset = true;
+    } else if (str_eq_c(arg, "--workers") && i + 1 < argc) {
+      workers_count = (u32)str_to_u64(str_from_c(argv[++i]));
+      if (workers_count == 0 || workers_count > SERVER_LISTENERS_MAX) {
+        fprintf(stderr, "Invalid workers count: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (str_eq_c(arg, "--unix") && i + 1 < argc) {
+      unix_path = argv[++i];
+    } else if (str_eq_c(arg, "--control") && i + 1 < argc) {
+      control_path = argv[++i];
+    } else if (str_eq_c(arg, "--static") && i + 1 < argc) {
+      static_dir = argv[++i];
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  const u16 port = 4096;
+
+  if (fork_mode && control_path) {
+    fprintf(stderr, "--control is not supported with --fork\n");
+    return 1;
+  }
+
+  server_limits_fit_open_files(&limits);
+
+  // `kill -USR1` prints the stats.
+  server_stats_install_signal_handler();
+
+  // Lives as long as the process, and is inherited by the workers.
+  Arena arena = arena_new(1 * MiB, NULL);
+  Router router = router_new(&arena);
+  // Any path, as before routing.
+  router_add(&router, HTTP_METHOD_POST, "/*path", handler, &arena);
+  router_add_streaming(&router, HTTP_METHOD_PUT, "/upload", upload_on_body,
+                       upload_handler, &arena);
+  {
+    Http_headers headers = {0};
+    http_headers_add(&headers, str_from_c("Content-Type"),
+                     str_from_c("application/json"), &arena);
+    router_add_headers(&router, HTTP_METHOD_POST, "/*path", headers, &arena);
+
+    headers = (Http_headers){0};
+    http_headers_add(&headers, str_from_c("Content-Type"),
+                     str_from_c("text/plain"), &arena);
+    router_add_headers(&router, HTTP_METHOD_PUT, "/upload", headers, &arena);
+  }
+  router_set_body_max_len(&router, HTTP_METHOD_PUT, "/upload", 1024 * MiB,
+                          &arena);
+  if (static_dir) {
+    router_add_static(&router, "/static/*path", static_dir, &arena);
+  }
+  router_compile(&router, &arena);
+
+  Server_stats stats = {0};
+  Server_config config = {
+      .router = &router,
+      .limits = limits,
+      .stats = &stats,
+      .unix_listen_fd = -1,
+  };
+
+  const Server_loop loop = io_uring_mode ? server_run_uring : server_run_epoll;
+  const char *const loop_name = io_uring_mode ? "io_uring" : "epoll";
+
+  if (unix_path) {
+    fprintf(stderr, "Listening to: %s\n", unix_path);
+  }
+
+  if (fork_mode) {
+    fprintf(stderr, "Listening to: 0.0.0.0:%u (fork)\n", port);
+    server_run_fork(server_listen_tcp(port),
+                    unix_path ? server_listen_unix(unix_path) : -1, &router,
+                    limits);
+  } else if (workers_count == 1 && !control_path) {
+    fprintf(stderr, "Listening to: 0.0.0.0:%u (%s)\n", port, loop_name);
+    config.unix_listen_fd = unix_path ? server_listen_unix(unix_path) : -1;
+    loop(server_listen_tcp(port), config);
+  } else {
+    // The parent must not listen itself: with SO_REUSEPORT it would get its
+    // share of the connections without ever accepting them.
+    fprintf(stderr, "Listening to: 0.0.0.0:%u (%s, %u workers)\n", port,
+            loop_name, workers_count);
+    // Returns once drained.
+    server_run_workers(port, workers_count, loop, config, unix_path,
+                       control_path);
+  }
+}
@@ -0,0 +1,635 @@
+#pragma once
+
+#include "arena.h"
+#include "array.h"
+#include "http.h"
+#include "static_files.h"
+#include "str.h"
+
+// Request router: routes are registered at startup, e.g.
+// `GET /users/:id/posts` or `GET /static/*path`, and compiled into a trie
+// whose nodes are path segments. The static edges of all the nodes live in one
+// open addressing hash table keyed by (parent node, segment), so that matching
+// costs one hash lookup per path segment regardless of the number of routes.
+//
+// At each node a static segment is preferred over a `:param` capture, which is
+// preferred over a `*catch_all` one. When the static segment leads to a dead
+// end, matching goes back once to the `:param` sibling of the deepest such
+// segment, so that `/users/me/posts` matches `/users/:id/posts` even with
+// `/users/me` registered, unless a catch-all was seen past it. Otherwise it
+// falls back to the deepest catch-all seen so far. Matching walks the path at
+// most twice, staying linear in its length.
+//
+// HEAD requests fall back to the GET handler, the server dropping the body.
+
+#define ROUTER_METHODS_COUNT (HTTP_METHOD_CONNECT + 1)
+
+// Bodies of the routes which do not stream them are buffered whole in the
+// arena of their request, which must keep room for the handler. The servers
+// give requests arenas of at least `ROUTER_REQUEST_ARENA_MIN_SIZE`.
+#define ROUTER_REQUEST_ARENA_MIN_SIZE (4 * MiB)
+#define ROUTER_BUFFERED_BODY_MAX_LEN (ROUTER_REQUEST_ARENA_MIN_SIZE / 4)
+
+typedef struct {
+  Http_handler _Nullable handlers[ROUTER_METHODS_COUNT];
+  // For the routes streaming their request body.
+  Http_body_handler _Nullable body_handlers[ROUTER_METHODS_COUNT];
+  // Constant headers of the routes, formatted once at registration.
+  Str headers_blocks[ROUTER_METHODS_COUNT];
+  // Longest request body accepted by the routes, 0 for the server default.
+  u64 body_max_lens[ROUTER_METHODS_COUNT];
+  // Name of the capture leading to this node, for `:param` and `*catch_all`
+  // nodes.
+  Str capture_name;
+  // For static file routes: directory the captured path is relative to.
+  Str static_root;
+  // Node indices, 0 when absent (the root is never a child).
+  u32 param_child;
+  u32 catch_all_child;
+} Router_node;
+
+typedef struct {
+  Str segment;
+  u32 parent;
+  u32 child;
+} Router_edge;
+
+Array_struct(Router_node);
+Array_struct(Router_edge);
+
+typedef struct {
+  Array(Router_node) nodes;
+  Array(Router_edge) edges;
+  // Edge index + 1 per slot, 0 when empty. Power of two length.
+  Array(u32) edges_table;
+  // Routes which stream their body or limit its length. Without any,
+  // requests are not matched before their body is received.
+  u32 body_routes_count;
+  pg_pad(4);
+} Router;
+
+// How the route of a request takes its body.
+typedef struct {
+  // For the routes streaming their body.
+  Http_body_handler _Nullable on_body;
+  // Longest body accepted, 0 for the server default.
+  u64 max_len;
+} Router_body;
+
+typedef struct {
+  u32 node;
+  u32 params_count;
+  Http_path_param params[HTTP_PATH_PARAMS_MAX];
+} Router_match;
+
+__attribute__((warn_unused_result)) static Router
+router_new(Arena *_Nonnull arena) {
+  Router router = {0};
+  *array_push(&router.nodes, arena) = (Router_node){0}; // Root.
+  return router;
+}
+
+// FNV-1a, seeded with the parent so that the same segment under different
+// nodes lands in different slots.
+__attribute__((warn_unused_result)) static u32 router_edge_hash(u32 parent,
+                                                                Str segment) {
+  u32 hash = 2166136261U ^ parent;
+  for (usize i = 0; i < segment.len; i++) {
+    hash ^= segment.data[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+__attribute__((warn_unused_result)) static u32
+router_find_static_child(const Router *_Nonnull router, u32 parent,
+                         Str segment) {
+  const u32 mask = router->edges_table.len - 1;
+  for (u32 i = router_edge_hash(parent, segment) & mask;; i = (i + 1) & mask) {
+    const u32 slot = router->edges_table.data[i];
+    if (slot == 0)
+      return 0;
+
+    const Router_edge edge = router->edges.data[slot - 1];
+    if (edge.parent == parent && str_eq(edge.segment, segment))
+      return edge.child;
+  }
+}
+
+__attribute__((warn_unused_result)) static u32
+router_node_new(Router *_Nonnull router, Str capture_name,
+                Arena *_Nonnull arena) {
+  *array_push(&router->nodes, arena) =
+      (Router_node){.capture_name = capture_name};
+  return array_last_index(router->nodes);
+}
+
+__attribute__((warn_unused_result)) static u32
+router_static_child_add(Router *_Nonnull router, u32 parent, Str segment,
+                        Arena *_Nonnull arena) {
+  // Startup only: a linear scan is fine.
+  for (u32 i = 0; i < router->edges.len; i++) {
+    const Router_edge edge = router->edges.data[i];
+    if (edge.parent == parent && str_eq(edge.segment, segment))
+      return edge.child;
+  }
+
+  const u32 child = router_node_new(router, (Str){0}, arena);
+  *array_push(&router->edges, arena) =
+      (Router_edge){.segment = segment, .parent = parent, .child = child};
+  return child;
+}
+
+// Find or create the node of the pattern. The pattern must start with `/`.
+// Segments starting with `:` capture one segment, and a last segment starting
+// with `*` captures the rest of the path, possibly empty.
+__attribute__((warn_unused_result)) static u32
+router_node_for_pattern(Router *_Nonnull router, char *_Nonnull pattern,
+                        Arena *_Nonnull arena) {
+  pg_assert(array_is_empty(router->edges_table) && "router already compiled");
+
+  Str remaining = str_from_c(pattern);
+  pg_assert(str_first(remaining) == '/');
+  remaining = str_advance(remaining, 1);
+
+  u32 node = 0;
+  while (!str_is_empty(remaining)) {
+    const Str_split_result split = str_split(remaining, '/');
+    const Str segment = split.left;
+    remaining = split.found ? split.right : (Str){0};
+
+    if (str_first(segment) == ':') {
+      const Str name = str_advance(segment, 1);
+      if (router->nodes.data[node].param_child == 0) {
+        const u32 child = router_node_new(router, name, arena);
+        router->nodes.data[node].param_child = child;
+      }
+      node = router->nodes.data[node].param_child;
+      pg_assert(str_eq(router->nodes.data[node].capture_name, name) &&
+                "conflicting parameter names");
+    } else if (str_first(segment) == '*') {
+      pg_assert(!split.found && "catch-all must be the last segment");
+
+      const Str name = str_advance(segment, 1);
+      if (router->nodes.data[node].catch_all_child == 0) {
+        const u32 child = router_node_new(router, name, arena);
+        router->nodes.data[node].catch_all_child = child;
+      }
+      node = router->nodes.data[node].catch_all_child;
+      pg_assert(str_eq(router->nodes.data[node].capture_name, name) &&
+                "conflicting parameter names");
+    } else {
+      node = router_static_child_add(router, node, segment, arena);
+    }
+
+    // `/a/` is `a` followed by an empty segment, unlike `/a`.
+    if (split.found && str_is_empty(remaining)) {
+      node = router_static_child_add(router, node, (Str){0}, arena);
+    }
+  }
+
+  return node;
+}
+
+// Register a route, see `router_node_for_pattern` for the pattern syntax.
+static void router_add(Router *_Nonnull router, Method method,
+                       char *_Nonnull pattern, Http_handler _Nonnull handler,
+                       Arena *_Nonnull arena) {
+  Router_node *const node =
+      &router->nodes.data[router_node_for_pattern(router, pattern, arena)];
+  pg_assert(node->handlers[method] == NULL && "duplicate route");
+  pg_assert((str_is_empty(node->static_root) ||
+             (method != HTTP_METHOD_GET && method != HTTP_METHOD_HEAD)) &&
+            "duplicate route");
+  node->handlers[method] = handler;
+}
+
+// Register a route whose request bodies are handed to `on_body` as they
+// arrive, `handler` being called once they are complete.
+static void router_add_streaming(Router *_Nonnull router, Method method,
+                                 char *_Nonnull pattern,
+                                 Http_body_handler _Nonnull on_body,
+                                 Http_handler _Nonnull handler,
+                                 Arena *_Nonnull arena) {
+  router_add(router, method, pattern, handler, arena);
+
+  Router_node *const node =
+      &router->nodes.data[router_node_for_pattern(router, pattern, arena)];
+  node->body_handlers[method] = on_body;
+  router->body_routes_count += 1;
+}
+
+// Accept request bodies up to `max_len` bytes on a route registered
+// beforehand. Longer ones are answered with a 413, before being received when
+// their length is announced. Above `ROUTER_BUFFERED_BODY_MAX_LEN`, the route
+// must stream its bodies.
+static void router_set_body_max_len(Router *_Nonnull router, Method method,
+                                    char *_Nonnull pattern, u64 max_len,
+                                    Arena *_Nonnull arena) {
+  pg_assert(max_len > 0);
+
+  Router_node *const node =
+      &router->nodes.data[router_node_for_pattern(router, pattern, arena)];
+  pg_assert(node->handlers[method] != NULL && "unknown route");
+  pg_assert((node->body_handlers[method] != NULL ||
+             max_len <= ROUTER_BUFFERED_BODY_MAX_LEN) &&
+            "buffered body too large for its arena, stream it instead");
+  node->body_max_lens[method] = max_len;
+  router->body_routes_count += 1;
+}
+
+// Send `headers` with every response of a route registered beforehand, e.g.
+// its `Content-Type`. They are formatted once here, so that writing them is a
+// single copy per response.
+static void router_add_headers(Router *_Nonnull router, Method method,
+                               char *_Nonnull pattern, Http_headers headers,
+                               Arena *_Nonnull arena) {
+  Router_node *const node =
+      &router->nodes.data[router_node_for_pattern(router, pattern, arena)];
+  pg_assert(node->handlers[method] != NULL && "unknown route");
+  node->headers_blocks[method] = http_headers_serialize(headers, arena);
+}
+
+// Serve the files under the directory `root` for GET and HEAD requests, e.g.
+// `router_add_static(router, "/assets/*path", "/var/www", arena)`. The
+// pattern must end with a catch-all, which is the path of the file.
+static void router_add_static(Router *_Nonnull router, char *_Nonnull pattern,
+                              char *_Nonnull root, Arena *_Nonnull arena) {
+  const Str_split_result split = str_rsplit(str_from_c(pattern), '/');
+  pg_assert(split.found && str_first(split.right) == '*' &&
+            "static route without a catch-all");
+
+  Router_node *const node =
+      &router->nodes.data[router_node_for_pattern(router, pattern, arena)];
+  pg_assert(str_is_empty(node->static_root) &&
+            node->handlers[HTTP_METHOD_GET] == NULL &&
+            node->handlers[HTTP_METHOD_HEAD] == NULL && "duplicate route");
+  node->static_root = str_from_c(root);
+}
+
+// Build the edges hash table. To be called once all the routes are added.
+static void router_compile(Router *_Nonnull router, Arena *_Nonnull arena) {
+  pg_assert(array_is_empty(router->edges_table) && "router already compiled");
+
+  // Load factor of at most 1/2 to keep the probe sequences short.
+  const u32 cap = (u32)ut_next_power_of_two(pg_max(router->edges.len * 2, 8U));
+  router->edges_table = array_make(u32, cap, cap, arena);
+
+  const u32 mask = cap - 1;
+  for (u32 e = 0; e < router->edges.len; e++) {
+    const Router_edge edge = router->edges.data[e];
+    u32 i = router_edge_hash(edge.parent, edge.segment) & mask;
+    while (router->edges_table.data[i] != 0) {
+      i = (i + 1) & mask;
+    }
+    router->edges_table.data[i] = e + 1;
+  }
+}
+
+__attribute__((warn_unused_result)) static bool
+router_node_allows(const Router_node *_Nonnull node, Method method) {
+  if (node->handlers[method] != NULL)
+    return true;
+
+  const bool get_or_head =
+      method == HTTP_METHOD_GET || method == HTTP_METHOD_HEAD;
+  return get_or_head && (node->handlers[HTTP_METHOD_GET] != NULL ||
+                         !str_is_empty(node->static_root));
+}
+
+// Find the node for `path`, filling the captures. Returns false when no route
+// matches the path, whatever the method.
+__attribute__((warn_unused_result)) static bool
+router_match(const Router *_Nonnull router, Str path,
+             Router_match *_Nonnull match) {
+  pg_assert(!array_is_empty(router->edges_table) && "router not compiled");
+
+  *match = (Router_match){0};
+  if (str_first(path) != '/')
+    return false;
+
+  // Deepest catch-all seen, to fall back to when a more specific branch is a
+  // dead end.
+  Router_match fallback = {0};
+  bool has_fallback = false;
+  // Deepest `:param` passed over for a static segment, with the rest of the
+  // path after it, to go back to once.
+  Router_match retry = {0};
+  Str retry_remaining = {0};
+  bool retry_has_segment = false;
+  bool has_retry = false;
+  bool retried = false;
+
+  // `/a/` is `a` followed by an empty segment, unlike `/a`, and `/` has no
+  // segments.
+  Str remaining = str_advance(path, 1);
+  bool has_segment = !str_is_empty(remaining);
+  u32 node = 0;
+walk:
+  for (;;) {
+    const Router_node *const current = &router->nodes.data[node];
+    if (current->catch_all_child != 0 &&
+        match->params_count < HTTP_PATH_PARAMS_MAX) {
+      fallback = *match;
+      fallback.node = current->catch_all_child;
+      fallback.params[fallback.params_count++] = (Http_path_param){
+          .name = router->nodes.data[current->catch_all_child].capture_name,
+          .value = remaining,
+      };
+      has_fallback = true;
+      // More specific than the `:param` passed over above.
+      has_retry = false;
+    }
+
+    if (!has_segment)
+      break;
+
+    const Str_split_result split = str_split(remaining, '/');
+    const Str segment = split.left;
+    remaining = split.found ? split.right : (Str){0};
+    has_segment = split.found;
+
+    u32 child = router_find_static_child(router, node, segment);
+    const bool param_allowed = current->param_child != 0 &&
+                               !str_is_empty(segment) &&
+                               match->params_count < HTTP_PATH_PARAMS_MAX;
+    const Http_path_param param = {
+        .name = router->nodes.data[current->param_child].capture_name,
+        .value = segment,
+    };
+    if (child != 0 && param_allowed && !retried) {
+      retry = *match;
+      retry.node = current->param_child;
+      retry.params[retry.params_count++] = param;
+      retry_remaining = remaining;
+      retry_has_segment = has_segment;
+      has_retry = true;
+    } else if (child == 0 && param_allowed) {
+      child = current->param_child;
+      match->params[match->params_count++] = param;
+    }
+    if (child == 0)
+      goto dead_end;
+
+    node = child;
+  }
+
+  {
+    const Router_node *const found = &router->nodes.data[node];
+    for (u32 m = 0; m < ROUTER_METHODS_COUNT; m++) {
+      if (router_node_allows(found, (Method)m)) {
+        match->node = node;
+        return true;
+      }
+    }
+  }
+
+dead_end:
+  if (has_retry) {
+    node = retry.node;
+    remaining = retry_remaining;
+    has_segment = retry_has_segment;
+    *match = retry;
+    has_retry = false;
+    retried = true;
+    goto walk;
+  }
+  if (!has_fallback)
+    return false;
+
+  *match = fallback;
+  return true;
+}
+
+// Dispatch the request to the handler of the matching route: 404 when no
+// route matches the path, 405 when none matches the method.
+__attribute__((warn_unused_result)) static Response
+router_handle(const Router *_Nonnull router, Request req,
+              Arena *_Nonnull arena) {
+  Router_match match = {0};
+  if (!router_match(router, req.path, &match))
+    return (Response){.status = 404};
+
+  const Router_node *const node = &router->nodes.data[match.node];
+  if (!router_node_allows(node, req.method)) {
+    Str_builder allow = sb_new(64, arena);
+    for (u32 m = 0; m < ROUTER_METHODS_COUNT; m++) {
+      if (!router_node_allows(node, (Method)m))
+        continue;
+      if (allow.len > 0)
+        allow = sb_append(allow, str_from_c(", "), arena);
+      allow = sb_append(allow, http_method_to_str((Method)m), arena);
+    }
+
+    Response res = {.status = 405};
+    http_headers_add(&res.headers, str_from_c("Allow"), sb_build(allow), arena);
+    return res;
+  }
+
+  if (node->handlers[req.method] == NULL && !str_is_empty(node->static_root)) {
+    pg_assert(match.params_count > 0);
+    const Str path = match.params[match.params_count - 1].value;
+    return static_files_serve(node->static_root, path, req, arena);
+  }
+
+  if (match.params_count > 0) {
+    req.path_params =
+        arena_alloc(arena, sizeof(Http_path_param), _Alignof(Http_path_param),
+                    match.params_count);
+    memcpy(req.path_params, match.params,
+           match.params_count * sizeof(Http_path_param));
+    req.path_params_count = match.params_count;
+  }
+
+  const Method method =
+      node->handlers[req.method] ? req.method : HTTP_METHOD_GET;
+
+  // A handler running out of memory fails its request only, with what it
+  // allocated freed, rather than aborting the worker and its connections.
+  const Arena before = *arena;
+  jmp_buf out_of_memory;
+  if (setjmp(out_of_memory) != 0) {
+    *arena = before;
+    return (Response){.status = 500};
+  }
+  arena->out_of_memory = &out_of_memory;
+  Response res = node->handlers[method](req, arena);
+  arena->out_of_memory = before.out_of_memory;
+
+  if (str_is_empty(res.headers_block))
+    res.headers_block = node->headers_blocks[method];
+  return res;
+}
+
+// How the route of `req` takes its body. To be called once the headers are
+// received.
+__attribute__((warn_unused_result)) static Router_body
+router_body(const Router *_Nonnull router, Request req) {
+  if (router->body_routes_count == 0)
+    return (Router_body){0};
+
+  Router_match match = {0};
+  if (!router_match(router, req.path, &match))
+    return (Router_body){0};
+
+  const Router_node *const node = &router->nodes.data[match.node];
+  return (Router_body){
+      .on_body = node->body_handlers[req.method],
+      .max_len = node->body_max_lens[req.method],
+  };
+}
+
+static Response test_router_handler_a(Request req, Arena *_Nonnull arena) {
+  pg_unused(req);
+  pg_unused(arena);
+  return (Response){.status = 200, .body = str_from_c("a")};
+}
+
+static Response test_router_handler_b(Request req, Arena *_Nonnull arena) {
+  pg_unused(arena);
+  const Str id = http_request_path_param(req, str_from_c("id"));
+  return (Response){.status = 200, .body = id};
+}
+
+static Response test_router_handler_c(Request req, Arena *_Nonnull arena) {
+  pg_unused(arena);
+  const Str rest = http_request_path_param(req, str_from_c("rest"));
+  return (Response){.status = 200, .body = rest};
+}
+
+static Response test_router_handler_greedy(Request req,
+                                           Arena *_Nonnull arena) {
+  pg_unused(req);
+  u8 *const body = arena_alloc(arena, sizeof(u8), _Alignof(u8), 1 * MiB);
+  return (Response){.status = 200, .body = {.data = body, .len = 1 * MiB}};
+}
+
+static void test_router(void) {
+  Arena arena = arena_new(1 * MiB, NULL);
+
+  Router router = router_new(&arena);
+  router_add(&router, HTTP_METHOD_GET, "/", test_router_handler_a, &arena);
+  router_add(&router, HTTP_METHOD_GET, "/users/me", test_router_handler_a,
+             &arena);
+  router_add(&router, HTTP_METHOD_GET, "/users/:id", test_router_handler_b,
+             &arena);
+  router_add(&router, HTTP_METHOD_DELETE, "/users/:id", test_router_handler_b,
+             &arena);
+  router_add(&router, HTTP_METHOD_GET, "/users/:id/posts/",
+             test_router_handler_b, &arena);
+  router_add(&router, HTTP_METHOD_GET, "/static/*rest", test_router_handler_c,
+             &arena);
+  router_add(&router, HTTP_METHOD_GET, "/static/favicon.ico",
+             test_router_handler_a, &arena);
+  router_add(&router, HTTP_METHOD_GET, "/greedy", test_router_handler_greedy,
+             &arena);
+  {
+    Http_headers headers = {0};
+    http_headers_add(&headers, str_from_c("Content-Type"),
+                     str_from_c("text/plain"), &arena);
+    router_add_headers(&router, HTTP_METHOD_GET, "/users/me", headers,
+                       &arena);
+  }
+  router_compile(&router, &arena);
+
+  Response res = {0};
+
+  res = router_handle(
+      &router, (Request){.method = HTTP_METHOD_GET, .path = str_from_c("/")},
+      &arena);
+  pg_assert(res.status == 200 && str_eq_c(res.body, "a"));
+
+  res = router_handle(
+      &router,
+      (Request){.method = HTTP_METHOD_GET, .path = str_from_c("/users/me")},
+      &arena);
+  pg_assert(res.status == 200 && str_eq_c(res.body, "a"));
+  pg_assert(str_eq_c(res.headers_block, "Content-Type: text/plain\r\n"));
+
+  res = router_handle(
+      &router,
+      (Request){.method = HTTP_METHOD_GET, .path = str_from_c("/users/42")},
+      &arena);
+  pg_assert(res.status == 200 && str_eq_c(res.body, "42"));
+
+  res = router_handle(&router,
+                      (Request){.method = HTTP_METHOD_GET,
+                                .path = str_from_c("/users/42/posts/")},
+                      &arena);
+  pg_assert(res.status == 200 && str_eq_c(res.body, "42"));
+
+  // Back to the `:param` once the static segment is a dead end.
+  res = router_handle(&router,
+                      (Request){.method = HTTP_METHOD_GET,
+                                .path = str_from_c("/users/me/posts/")},
+                      &arena);
+  pg_assert(res.status == 200 && str_eq_c(res.body, "me"));
+
+  // Trailing slash mismatch, empty capture.
+  res = router_handle(&router,
+                      (Request){.method = HTTP_METHOD_GET,
+                                .path = str_from_c("/users/42/posts")},
+                      &arena);
+  pg_assert(res.status == 404);
+  res = router_handle(
+      &router,
+      (Request){.method = HTTP_METHOD_GET, .path = str_from_c("/users/")},
+      &arena);
+  pg_assert(res.status == 404);
+
+  res = router_handle(
+      &router,
+      (Request){.method = HTTP_METHOD_POST, .path = str_from_c("/users/42")},
+      &arena);
+  pg_assert(res.status == 405);
+  const Header *const allow =
+      http_find_header(res.headers, str_from_c("Allow"));
+  pg_assert(allow != NULL && str_eq_c(allow->value, "GET, HEAD, DELETE"));
+
+  res = router_handle(&router,
+                      (Request){.method = HTTP_METHOD_GET,
+                                .path = str_from_c("/static/favicon.ico")},
+                      &arena);
+  pg_assert(res.status == 200 && str_eq_c(res.body, "a"));
+
+  res = router_handle(&router,
+                      (Request){.method = HTTP_METHOD_GET,
+                                .path = str_from_c("/static/css/main.css")},
+                      &arena);
+  pg_assert(res.status == 200 && str_eq_c(res.body, "css/main.css"));
+
+  // Falls back to the catch-all from a dead end.
+  res = router_handle(&router,
+                      (Request){.method = HTTP_METHOD_GET,
+                                .path = str_from_c("/static/favicon.ico/x")},
+                      &arena);
+  pg_assert(res.status == 200 && str_eq_c(res.body, "favicon.ico/x"));
+
+  res = router_handle(
+      &router,
+      (Request){.method = HTTP_METHOD_GET, .path = str_from_c("/static")},
+      &arena);
+  pg_assert(res.status == 200 && str_is_empty(res.body));
+  res = router_handle(
+      &router,
+      (Request){.method = HTTP_METHOD_GET, .path = str_from_c("/static/")},
+      &arena);
+  pg_assert(res.status == 200 && str_is_empty(res.body));
+
+  res = router_handle(
+      &router,
+      (Request){.method = HTTP_METHOD_GET, .path = str_from_c("/nope")},
+      &arena);
+  pg_assert(res.status == 404);
+  // Out of memory in the handler: 500, and the arena as it was.
+  {
+    Arena small = arena_new(64 * KiB, NULL);
+    const Arena before = small;
+    res = router_handle(
+        &router,
+        (Request){.method = HTTP_METHOD_GET, .path = str_from_c("/greedy")},
+        &small);
+    pg_assert(res.status == 500);
+    pg_assert(small.start == before.start && small.out_of_memory == NULL);
+  }
+}
@@ -0,0 +1,2295 @@
+#pragma once
+
+#include "arena.h"
+#include "http.h"
+#include "http2.h"
+#include "router.h"
+#include "str.h"
+#include "timer.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Each connection owns an arena which is mmap'ed once and recycled with the
+// connection slot, so that steady-state connections do not mmap nor page
+// fault. The mapping is lazily backed by the kernel so a large capacity is
+// cheap.
+static const usize SERVER_CONNECTION_ARENA_SIZE = 16 * MiB;
+static const usize SERVER_BODY_MAX_LEN = ROUTER_BUFFERED_BODY_MAX_LEN;
+// Deadlines for a connection to send the headers of a request (from its
+// first byte, or from the connection start), its body, the next request on a
+// kept-alive connection, and to receive the responses.
+static const u64 SERVER_HEADERS_TIMEOUT_MS = 10 * 1000;
+static const u64 SERVER_BODY_TIMEOUT_MS = 30 * 1000;
+static const u64 SERVER_IDLE_TIMEOUT_MS = 60 * 1000;
+static const u64 SERVER_WRITE_TIMEOUT_MS = 30 * 1000;
+// Pipelined responses sent with one sendmsg(2) at most.
+#define SERVER_RESPONSES_BATCH_MAX 64U
+
+// Admission control, per worker. Work beyond these limits is rejected up
+// front with a precomputed 503, without parsing it, so that an overloaded
+// worker spends as little as possible on what it cannot serve.
+typedef struct {
+  u64 max_connections;
+  // Requests handled whose response is not sent yet.
+  u64 max_inflight_requests;
+  // Bytes received but not handled yet, plus bytes of responses not sent yet.
+  u64 max_queued_bytes;
+  // Longest request line and headers accepted, answered with a 431 past that.
+  u64 max_headers_len;
+  // Reset shed connections instead of answering them.
+  bool shed_with_reset;
+  pg_pad(7);
+} Server_limits;
+
+static const Server_limits SERVER_LIMITS_DEFAULT = {
+    .max_connections = 10 * 1000,
+    .max_inflight_requests = 4 * 1000,
+    .max_queued_bytes = 64 * MiB,
+    .max_headers_len = 16 * KiB,
+};
+
+// Descriptors a worker needs besides its connections: the listeners, the event
+// loop, the cached files, and one for a connection to shed.
+static const u64 SERVER_RESERVED_FDS = FILE_CACHE_ENTRIES_MAX + 64;
+
+// Seconds clients are told to wait before retrying, when shed.
+static const u64 SERVER_SHED_RETRY_AFTER_S = 1;
+
+// Counters of a worker, written by the worker only. Workers keep them in
+// memory shared with the supervisor, one cache line each, so that it can
+// report them.
+typedef struct {
+  u64 connections_accepted;
+  u64 connections_shed;
+  u64 requests_handled;
+  u64 requests_shed;
+  // Current values, subject to the limits.
+  u64 connections_open;
+  u64 inflight_requests;
+  u64 queued_bytes;
+  pg_pad(8);
+} Server_stats;
+
+// Set from the SIGUSR1 handler: print the stats.
+static volatile sig_atomic_t server_stats_requested = 0;
+
+// Set from the SIGTERM handler: stop accepting and exit once the connections
+// are served.
+static volatile sig_atomic_t server_drain_requested = 0;
+// Connections still open past this delay are dropped.
+static const u64 SERVER_DRAIN_TIMEOUT_MS = 30 * 1000;
+// The listeners are handed over with one SCM_RIGHTS message, limited to
+// SCM_MAX_FD descriptors.
+#define SERVER_LISTENERS_MAX 253U
+
+typedef enum {
+  CONNECTION_STATE_READING,
+  CONNECTION_STATE_WRITING,
+} Connection_state;
+
+typedef enum {
+  CONNECTION_TIMEOUT_NONE,
+  CONNECTION_TIMEOUT_IDLE,
+  CONNECTION_TIMEOUT_HEADERS,
+  CONNECTION_TIMEOUT_BODY,
+  CONNECTION_TIMEOUT_WRITE,
+} Connection_timeout;
+
+typedef enum {
+  CONNECTION_PROGRESS_NEED_MORE,
+  CONNECTION_PROGRESS_RESPONSE_READY,
+  CONNECTION_PROGRESS_ERROR,
+} Connection_progress;
+
+// A queued response: its head, its in-memory body, referenced where the
+// handler put it, then possibly a range of a cached file, sent without copying
+// it to user space. The three are sent with one scatter-gather write.
+typedef struct {
+  Str head;
+  Str body;
+  File_cache_entry *_Nullable file;
+  u64 file_offset;
+  u64 file_len;
+} Connection_output;
+
+Array_struct(Connection_output);
+
+typedef struct Connection Connection;
+struct Connection {
+  int fd;
+  Connection_state state;
+  // Arena as it was right after the connection slot was created. Rewinding
+  // to it frees everything allocated while serving the connection.
+  Arena arena_checkpoint;
+  Arena arena;
+  Str_builder in;
+  // Offset in `in` of the first request not handled yet.
+  usize consumed;
+  // Responses of the current batch of pipelined requests, in order. They are
+  // sent with one scatter-gather write.
+  Array(Connection_output) out;
+  // Index in `out` of the first response not completely sent.
+  u32 out_sent;
+  // What the connection currently counts for in the server stats.
+  u32 accounted_requests;
+  usize accounted_bytes;
+  // Request whose headers have been parsed, waiting for its body.
+  Request req;
+  // Bytes of the pending request already searched for the end of its headers.
+  usize headers_searched;
+  usize headers_len;
+  Http_body body;
+  // Set for the requests whose route streams the body.
+  Http_body_handler _Nullable on_body;
+  // Longest body accepted by the route of the request.
+  u64 body_max_len;
+  // Set once the client started the connection with the HTTP/2 preface. Lives
+  // in `http2_region`, mapped once per connection slot like the arena.
+  Http2_session *_Nullable http2;
+  Arena http2_region;
+  bool headers_parsed;
+  // Edge-triggered readiness not yet consumed by reading until EAGAIN.
+  bool readable;
+  // Set once a request asked to close the connection, or could not be
+  // parsed: the responses queued so far are still sent.
+  bool close_after_write;
+  // The `100 Continue` of the pending request is queued. Unlike its parsed
+  // headers, this survives the reset after sending it.
+  bool continue_sent;
+  // What `timer` is the deadline of.
+  Connection_timeout timeout;
+  Timer timer;
+  u64 requests_count;
+  Connection *_Nullable next_free;
+  // All the connection slots ever allocated, live or not.
+  Connection *_Nullable next_slot;
+};
+
+typedef struct {
+  const Router *_Nonnull router;
+  Server_limits limits;
+  Server_stats *_Nonnull stats;
+  // Accepting alongside the TCP listener, shared by all the workers, or -1.
+  int unix_listen_fd;
+  pg_pad(4);
+} Server_config;
+
+typedef struct {
+  const Router *_Nonnull router;
+  Server_limits limits;
+  Server_stats *_Nonnull stats;
+  int listen_fd;
+  int unix_listen_fd;
+  int epoll_fd;
+  pg_pad(4);
+  // Backing storage for the `Connection` structs, which are never freed but
+  // recycled through `free_list`.
+  Arena arena;
+  Connection *_Nullable free_list;
+  Connection *_Nullable slots;
+  Timer_wheel timers;
+  // Precomputed, sent as-is to connections timing out, respectively shed.
+  Str timeout_response;
+  Str overload_response;
+  // No longer accepting, and closing connections as soon as they are idle.
+  bool draining;
+  // Per listener, TCP then Unix: out of descriptors, accepting again on the
+  // next tick.
+  bool accept_paused[2];
+  pg_pad(5);
+  u64 drain_deadline_ms;
+} Server;
+
+// An I/O backend serving all connections of a listener. Never returns.
+typedef void (*Server_loop)(int listen_fd, Server_config config);
+
+// The stats are read concurrently by the supervisor: no torn values.
+static void server_stats_add(u64 *_Nonnull counter, u64 delta) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + delta,
+                   __ATOMIC_RELAXED);
+}
+
+static void server_stats_sub(u64 *_Nonnull counter, u64 delta) {
+  const u64 value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+  pg_assert(value >= delta);
+  __atomic_store_n(counter, value - delta, __ATOMIC_RELAXED);
+}
+
+__attribute__((warn_unused_result)) static Server_stats
+server_stats_load(const Server_stats *_Nonnull stats) {
+  return (Server_stats){
+      .connections_accepted =
+          __atomic_load_n(&stats->connections_accepted, __ATOMIC_RELAXED),
+      .connections_shed =
+          __atomic_load_n(&stats->connections_shed, __ATOMIC_RELAXED),
+      .requests_handled =
+          __atomic_load_n(&stats->requests_handled, __ATOMIC_RELAXED),
+      .requests_shed = __atomic_load_n(&stats->requests_shed, __ATOMIC_RELAXED),
+      .connections_open =
+          __atomic_load_n(&stats->connections_open, __ATOMIC_RELAXED),
+      .inflight_requests =
+          __atomic_load_n(&stats->inflight_requests, __ATOMIC_RELAXED),
+      .queued_bytes = __atomic_load_n(&stats->queued_bytes, __ATOMIC_RELAXED),
+  };
+}
+
+static void server_stats_print(const char *_Nonnull name, Server_stats stats) {
+  fprintf(stderr,
+          "%s: connections accepted=%lu shed=%lu open=%lu, requests "
+          "handled=%lu shed=%lu inflight=%lu, queued_bytes=%lu\n",
+          name, stats.connections_accepted, stats.connections_shed,
+          stats.connections_open, stats.requests_handled, stats.requests_shed,
+          stats.inflight_requests, stats.queued_bytes);
+}
+
+static void server_stats_signal_handler(int signo) {
+  if (signo == SIGUSR1)
+    server_stats_requested = 1;
+}
+
+// Print the stats on SIGUSR1. Not restarting syscalls so that blocking waits
+// return and notice the request.
+static void server_stats_install_signal_handler(void) {
+  const struct sigaction action = {.sa_handler = server_stats_signal_handler};
+  pg_assert(sigaction(SIGUSR1, &action, NULL) != -1);
+}
+
+// To be called after each wait of the event loop.
+static void server_stats_print_if_requested(const char *_Nonnull name,
+                                            const Server_stats *_Nonnull stats) {
+  if (!server_stats_requested)
+    return;
+
+  server_stats_requested = 0;
+  server_stats_print(name, server_stats_load(stats));
+}
+
+static void server_drain_signal_handler(int signo) {
+  if (signo == SIGTERM)
+    server_drain_requested = 1;
+}
+
+// Drain on SIGTERM instead of dying. Not restarting syscalls so that blocking
+// waits return and notice the request.
+static void server_drain_install_signal_handler(void) {
+  const struct sigaction action = {.sa_handler = server_drain_signal_handler};
+  pg_assert(sigaction(SIGTERM, &action, NULL) != -1);
+}
+
+// Raise the soft limit of open files to the hard one, and lower the connection
+// limit to what the descriptors allow, so that accept(2) does not run out of
+// them first. Inherited by the workers.
+static void server_limits_fit_open_files(Server_limits *_Nonnull limits) {
+  struct rlimit rlimit = {0};
+  pg_assert(getrlimit(RLIMIT_NOFILE, &rlimit) != -1);
+  if (rlimit.rlim_cur < rlimit.rlim_max) {
+    const rlim_t soft = rlimit.rlim_cur;
+    rlimit.rlim_cur = rlimit.rlim_max;
+    // The hard limit may be above what the kernel allows, e.g. infinity.
+    if (setrlimit(RLIMIT_NOFILE, &rlimit) == -1)
+      rlimit.rlim_cur = soft;
+  }
+
+  const u64 fds = rlimit.rlim_cur;
+  // Some room left at least, with a low limit.
+  const u64 max_connections =
+      fds > 2 * SERVER_RESERVED_FDS ? fds - SERVER_RESERVED_FDS : fds / 2;
+  if (limits->max_connections > max_connections) {
+    fprintf(stderr,
+            "Connections limited to %lu per worker by the open files limit "
+            "(%lu)\n",
+            max_connections, fds);
+    limits->max_connections = max_connections;
+  }
+}
+
+__attribute__((warn_unused_result)) static int server_listen_tcp(u16 port) {
+  const int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+  pg_assert(server_socket >= 0);
+
+  pg_assert(setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &(int){1},
+                       sizeof(int)) != -1);
+#ifdef SO_REUSEPORT
+  pg_assert(setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &(int){1},
+                       sizeof(int)) != -1);
+#endif
+
+  const uint16_t net_port = (uint16_t)__builtin_bswap16(port);
+
+  const struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = net_port,
+  };
+  pg_assert(bind(server_socket, (const void *)&addr, sizeof(addr)) == 0);
+
+  // Will anyways probably be capped to 128 by the kernel depending on the
+  // version (see man page).
+  const int backlog = 4096;
+  pg_assert(listen(server_socket, backlog) == 0);
+
+  return server_socket;
+}
+
+// Listen on the Unix socket at `path` for clients on the same host, which
+// skip the TCP/IP stack. A stale socket left by a previous server is replaced.
+__attribute__((warn_unused_result)) static int
+server_listen_unix(const char *_Nonnull path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Unix socket path too long: %s\n", path);
+    exit(1);
+  }
+  memcpy(addr.sun_path, path, strlen(path));
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  pg_assert(fd != -1);
+  if (unlink(path) == -1) {
+    pg_assert(errno == ENOENT);
+  }
+  if (bind(fd, (const void *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "Failed to bind(2) %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  const int backlog = 4096;
+  pg_assert(listen(fd, backlog) == 0);
+  return fd;
+}
+
+// Hint the kernel to prefer this listener among the reuseport group for
+// connections whose packets are processed on the CPU this process runs on.
+static void server_listener_prefer_current_cpu(int listen_fd) {
+#ifdef SO_INCOMING_CPU
+  const int cpu = sched_getcpu();
+  if (cpu != -1) {
+    pg_unused(setsockopt(listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+                         sizeof(cpu)));
+  }
+#else
+  pg_unused(listen_fd);
+#endif
+}
+
+__attribute__((warn_unused_result)) static Connection *_Nonnull
+server_connection_new(Server *_Nonnull server, int fd) {
+  Connection *conn = server->free_list;
+  if (conn) {
+    server->free_list = conn->next_free;
+  } else {
+    conn = arena_alloc(&server->arena, sizeof(Connection),
+                       _Alignof(Connection), 1);
+    conn->arena_checkpoint = arena_new(SERVER_CONNECTION_ARENA_SIZE, NULL);
+    conn->next_slot = server->slots;
+    server->slots = conn;
+  }
+
+  *conn = (Connection){
+      .fd = fd,
+      .state = CONNECTION_STATE_READING,
+      .arena_checkpoint = conn->arena_checkpoint,
+      .arena = conn->arena_checkpoint,
+      .http2_region = conn->http2_region,
+      .next_slot = conn->next_slot,
+  };
+  conn->in = sb_new(1 * KiB, &conn->arena);
+  conn->out = array_make(Connection_output, 0, SERVER_RESPONSES_BATCH_MAX,
+                         &conn->arena);
+
+  return conn;
+}
+
+// Drop the references the queued responses hold on the files they send.
+static void server_connection_release_files(Connection *_Nonnull conn) {
+  for (u32 i = 0; i < conn->out.len; i++) {
+    Connection_output *const output = &conn->out.data[i];
+    if (output->file != NULL) {
+      file_cache_release(&static_files_cache, output->file);
+      output->file = NULL;
+    }
+  }
+}
+
+// Drop what an HTTP/2 stream holds, and make its slot available.
+static void server_http2_stream_free(Http2_stream *_Nonnull stream) {
+  if (stream->file != NULL) {
+    file_cache_release(&static_files_cache, stream->file);
+  }
+  *stream = (Http2_stream){
+      .arena_checkpoint = stream->arena_checkpoint,
+      .arena = stream->arena_checkpoint,
+  };
+}
+
+// Free the slots of the streams done, once their frames are sent.
+static void server_http2_free_closed_streams(Http2_session *_Nonnull session) {
+  for (u32 i = 0; i < HTTP2_STREAMS_MAX; i++) {
+    if (session->streams[i].state == HTTP2_STREAM_CLOSED)
+      server_http2_stream_free(&session->streams[i]);
+  }
+}
+
+// Rewind the connection arena to its checkpoint between two requests, so that
+// steady-state requests reuse the same, already faulted-in, memory. The bytes
+// already received past the current request are kept at the start of the new
+// input buffer.
+static void server_connection_reset(Connection *_Nonnull conn, Str leftover) {
+  server_connection_release_files(conn);
+  conn->arena = conn->arena_checkpoint;
+
+  u8 *const data = conn->arena.start;
+  if (leftover.len > 0) {
+    memmove(data, leftover.data, leftover.len);
+  }
+
+  // Adopt the moved bytes in place, without `arena_alloc` zeroing them.
+  const usize cap = pg_max(1 * KiB, leftover.len) + 1;
+  pg_assert(data + cap <= conn->arena.end);
+  memset(data + leftover.len, 0, cap - leftover.len);
+  conn->arena.start += cap;
+
+  conn->state = CONNECTION_STATE_READING;
+  conn->in = (Str_builder){.data = data, .len = leftover.len, .cap = cap};
+  conn->consumed = 0;
+  conn->out = array_make(Connection_output, 0, SERVER_RESPONSES_BATCH_MAX,
+                         &conn->arena);
+  conn->out_sent = 0;
+  conn->req = (Request){0};
+  conn->headers_searched = conn->headers_len = 0;
+  conn->body = (Http_body){0};
+  conn->on_body = NULL;
+  conn->headers_parsed = false;
+  conn->close_after_write = false;
+}
+
+// Update what the connection counts for in the in-flight requests and queued
+// bytes, to its current state, or to nothing once closed.
+static void server_connection_account(Server *_Nonnull server,
+                                      Connection *_Nonnull conn, bool closed) {
+  u32 requests = 0;
+  usize bytes = 0;
+  if (!closed) {
+    requests = conn->out.len - conn->out_sent;
+    bytes = conn->in.len - conn->consumed;
+    for (u32 i = conn->out_sent; i < conn->out.len; i++) {
+      // Files are not in memory.
+      bytes += conn->out.data[i].head.len + conn->out.data[i].body.len;
+    }
+  }
+
+  server_stats_sub(&server->stats->inflight_requests, conn->accounted_requests);
+  server_stats_add(&server->stats->inflight_requests, requests);
+  server_stats_sub(&server->stats->queued_bytes, conn->accounted_bytes);
+  server_stats_add(&server->stats->queued_bytes, bytes);
+  conn->accounted_requests = requests;
+  conn->accounted_bytes = bytes;
+}
+
+// Return the connection slot to the free list, once nothing refers to its
+// file descriptor anymore.
+static void server_connection_release(Server *_Nonnull server,
+                                      Connection *_Nonnull conn) {
+  timer_wheel_remove(&server->timers, &conn->timer);
+  server_connection_release_files(conn);
+  if (conn->http2 != NULL) {
+    for (u32 i = 0; i < HTTP2_STREAMS_MAX; i++) {
+      server_http2_stream_free(&conn->http2->streams[i]);
+    }
+    conn->http2 = NULL;
+  }
+  server_connection_account(server, conn, true);
+  server_stats_sub(&server->stats->connections_open, 1);
+
+  conn->fd = -1;
+  conn->next_free = server->free_list;
+  server->free_list = conn;
+}
+
+static void server_connection_close(Server *_Nonnull server,
+                                    Connection *_Nonnull conn) {
+  // Also removes it from the epoll interest list.
+  close(conn->fd);
+
+  server_connection_release(server, conn);
+}
+
+// Arm the deadline of what the connection is now waiting for, unless it is
+// already armed: deadlines are absolute so that trickling bytes in or out
+// does not extend them.
+static void server_connection_arm_timeout(Server *_Nonnull server,
+                                          Connection *_Nonnull conn) {
+  Connection_timeout timeout = CONNECTION_TIMEOUT_NONE;
+  u64 delay_ms = 0;
+
+  if (conn->state == CONNECTION_STATE_WRITING) {
+    timeout = CONNECTION_TIMEOUT_WRITE;
+    delay_ms = SERVER_WRITE_TIMEOUT_MS;
+  } else if (conn->http2 != NULL) {
+    // Requests in progress, or waiting for the next ones.
+    const bool active = http2_session_active_streams(conn->http2) > 0;
+    timeout = active ? CONNECTION_TIMEOUT_BODY : CONNECTION_TIMEOUT_IDLE;
+    delay_ms = active ? SERVER_BODY_TIMEOUT_MS : SERVER_IDLE_TIMEOUT_MS;
+  } else if (conn->headers_parsed) {
+    timeout = CONNECTION_TIMEOUT_BODY;
+    delay_ms = SERVER_BODY_TIMEOUT_MS;
+  } else if (conn->in.len > conn->consumed || conn->requests_count == 0) {
+    timeout = CONNECTION_TIMEOUT_HEADERS;
+    delay_ms = SERVER_HEADERS_TIMEOUT_MS;
+  } else {
+    timeout = CONNECTION_TIMEOUT_IDLE;
+    delay_ms = SERVER_IDLE_TIMEOUT_MS;
+  }
+
+  if (conn->timeout == timeout && timer_is_armed(conn->timer))
+    return;
+
+  conn->timeout = timeout;
+  timer_wheel_arm(&server->timers, &conn->timer, delay_ms);
+}
+
+__attribute__((warn_unused_result)) static Connection *_Nonnull
+server_connection_from_timer(Timer *_Nonnull timer) {
+  return (Connection *)(void *)((u8 *)timer - offsetof(Connection, timer));
+}
+
+// Tell a client which timed out in the middle of a request, on a best effort
+// basis since the connection is about to be closed anyway. Connections which
+// never sent anything are closed silently, and so are HTTP/2 ones.
+static void server_connection_send_timeout_response(Server *_Nonnull server,
+                                                    Connection conn) {
+  const bool mid_request = conn.timeout == CONNECTION_TIMEOUT_BODY ||
+                           (conn.timeout == CONNECTION_TIMEOUT_HEADERS &&
+                            conn.in.len > conn.consumed);
+  if (!mid_request || conn.http2 != NULL)
+    return;
+
+  pg_unused(send(conn.fd, server->timeout_response.data,
+                 server->timeout_response.len, MSG_NOSIGNAL | MSG_DONTWAIT));
+}
+
+// Waiting for the next request on a kept-alive connection: closing it now
+// loses nothing.
+__attribute__((warn_unused_result)) static bool
+server_connection_is_idle(Connection conn) {
+  return conn.fd != -1 && conn.state == CONNECTION_STATE_READING &&
+         !conn.headers_parsed && conn.in.len == conn.consumed &&
+         (conn.http2 != NULL ? http2_session_active_streams(conn.http2) == 0
+                             : conn.requests_count > 0);
+}
+
+// From now on, connections are closed after their current requests. The
+// caller stops accepting and closes the idle connections.
+static void server_drain_start(Server *_Nonnull server) {
+  server->draining = true;
+  server->drain_deadline_ms = timer_now_ms() + SERVER_DRAIN_TIMEOUT_MS;
+}
+
+__attribute__((warn_unused_result)) static bool
+server_drain_done(const Server *_Nonnull server) {
+  return server->draining && (server->stats->connections_open == 0 ||
+                              timer_now_ms() >= server->drain_deadline_ms);
+}
+
+__attribute__((warn_unused_result)) static Str
+server_overload_response(Arena *_Nonnull arena) {
+  Str_builder retry_after = sb_new(16, arena);
+  retry_after = sb_append_u64(retry_after, SERVER_SHED_RETRY_AFTER_S, arena);
+
+  Response res = {.status = 503};
+  http_headers_add(&res.headers, str_from_c("Retry-After"),
+                   sb_build(retry_after), arena);
+  http_headers_add(&res.headers, str_from_c("Connection"), str_from_c("close"),
+                   arena);
+  return response_to_str(res, arena);
+}
+
+// Answer a socket which is not admitted with a 503 (or reset it), and close
+// it.
+static void server_shed_socket(int fd, Server_limits limits,
+                               Str overload_response) {
+  if (limits.shed_with_reset) {
+    const struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    pg_unused(setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)));
+  } else {
+    // Best effort: the socket buffer is empty so this does not block.
+    pg_unused(send(fd, overload_response.data, overload_response.len,
+                   MSG_NOSIGNAL | MSG_DONTWAIT));
+  }
+  close(fd);
+}
+
+__attribute__((warn_unused_result)) static Server
+server_new(int listen_fd, Server_config config) {
+  Server server = {
+      .router = config.router,
+      .limits = config.limits,
+      .stats = config.stats,
+      .listen_fd = listen_fd,
+      .unix_listen_fd = config.unix_listen_fd,
+      .epoll_fd = -1,
+      // The connection slots, up to the limit, and the precomputed responses.
+      // Only backed by memory as slots are created.
+      .arena = arena_new(
+          config.limits.max_connections * sizeof(Connection) + 64 * KiB, NULL),
+  };
+  server.timers.now_tick = timer_now_tick();
+
+  Response timeout_response = {.status = 408};
+  http_headers_add(&timeout_response.headers, str_from_c("Connection"),
+                   str_from_c("close"), &server.arena);
+  server.timeout_response = response_to_str(timeout_response, &server.arena);
+
+  server.overload_response = server_overload_response(&server.arena);
+
+  // A respawned worker starts afresh.
+  server.stats->connections_open = 0;
+  server.stats->inflight_requests = 0;
+  server.stats->queued_bytes = 0;
+
+  return server;
+}
+
+__attribute__((warn_unused_result)) static bool
+server_is_overloaded(const Server *_Nonnull server) {
+  return server->stats->inflight_requests >=
+             server->limits.max_inflight_requests ||
+         server->stats->queued_bytes >= server->limits.max_queued_bytes;
+}
+
+// Turn a freshly accepted socket into a connection, unless the worker is at
+// its connection limit in which case the socket is answered with a 503 (or
+// reset) and closed right away. Returns NULL when shed.
+__attribute__((warn_unused_result)) static Connection *_Nullable
+server_connection_admit(Server *_Nonnull server, int fd) {
+  server_stats_add(&server->stats->connections_accepted, 1);
+
+  if (server->stats->connections_open < server->limits.max_connections) {
+    server_stats_add(&server->stats->connections_open, 1);
+    return server_connection_new(server, fd);
+  }
+
+  server_stats_add(&server->stats->connections_shed, 1);
+  server_shed_socket(fd, server->limits, server->overload_response);
+  return NULL;
+}
+
+static void server_connection_queue_response(Connection *_Nonnull conn,
+                                             Response res) {
+  Connection_output output = {
+      .head = response_head_to_str(res, &conn->arena),
+      .body = res.body,
+      .file = res.file,
+      .file_offset = res.file_offset,
+      .file_len = res.file_len,
+  };
+
+  // Same response as for GET, without the body. Nor any body for the
+  // statuses which cannot have one.
+  if (conn->req.method == HTTP_METHOD_HEAD ||
+      !http_status_has_content_length(res.status)) {
+    output.body = (Str){0};
+    output.file_len = 0;
+  }
+
+  *array_push(&conn->out, &conn->arena) = output;
+}
+
+// Answer a request which cannot be handled with an error, and close the
+// connection once the responses queued so far are sent.
+static void server_connection_fail(Connection *_Nonnull conn, u16 status) {
+  Response res = {.status = status};
+  http_headers_add(&res.headers, str_from_c("Connection"), str_from_c("close"),
+                   &conn->arena);
+  server_connection_queue_response(conn, res);
+  conn->close_after_write = true;
+}
+
+// ------------------- HTTP/2
+
+// Switch the connection to HTTP/2 once it sent the preface. The session is
+// mapped the first time the connection slot serves HTTP/2, then recycled with
+// it.
+static void server_http2_start(Server *_Nonnull server,
+                               Connection *_Nonnull conn) {
+  if (conn->http2_region.start == NULL)
+    conn->http2_region = arena_new(http2_session_region_size(), NULL);
+  conn->http2 = http2_session_new(conn->http2_region);
+  conn->consumed = HTTP2_PREFACE.len;
+
+  // Frames go back and forth as windows open, unlike HTTP/1.1 responses which
+  // are written whole: the last segment of a write must not wait for an ACK.
+  pg_unused(setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1},
+                       sizeof(int)));
+
+  const Str_builder settings = http2_append_server_settings(
+      sb_new(32, &conn->arena), server->limits.max_headers_len, &conn->arena);
+  *array_push(&conn->out, &conn->arena) =
+      (Connection_output){.head = sb_build(settings)};
+}
+
+// Bytes of input past which HTTP/2 frames are necessarily complete, unless
+// they make a header block larger than accepted.
+__attribute__((warn_unused_result)) static usize
+server_http2_pending_max(const Server *_Nonnull server) {
+  return server->limits.max_headers_len + HTTP2_FRAME_HEADER_LEN +
+         HTTP2_FRAME_LEN_DEFAULT;
+}
+
+// The header block started by the HEADERS frame at the start of `in`,
+// followed by the CONTINUATION frames it needs, once all of them are
+// received: `*frames_len` is left to 0 until then.
+__attribute__((warn_unused_result)) static Http2_error
+server_http2_header_block(const Server *_Nonnull server,
+                          Connection *_Nonnull conn, Str in,
+                          Str *_Nonnull block, usize *_Nonnull frames_len) {
+  const Http2_frame_header first = http2_frame_header_parse(in.data);
+  Str payload = {.data = in.data + HTTP2_FRAME_HEADER_LEN, .len = first.len};
+  if (!http2_frame_unpad(first, &payload))
+    return HTTP2_ERROR_PROTOCOL_ERROR;
+
+  *frames_len = 0;
+  usize end = HTTP2_FRAME_HEADER_LEN + first.len;
+  if (first.flags & HTTP2_FLAG_END_HEADERS) {
+    *block = payload;
+    *frames_len = end;
+    return HTTP2_ERROR_NONE;
+  }
+
+  // Check that the frames are all there before copying anything.
+  const usize max_len = server_http2_pending_max(server);
+  for (bool end_headers = false; !end_headers;) {
+    if (end + HTTP2_FRAME_HEADER_LEN > max_len)
+      return HTTP2_ERROR_ENHANCE_YOUR_CALM;
+    if (in.len < end + HTTP2_FRAME_HEADER_LEN)
+      return HTTP2_ERROR_NONE;
+
+    const Http2_frame_header header = http2_frame_header_parse(in.data + end);
+    if (header.type != HTTP2_FRAME_CONTINUATION ||
+        header.stream_id != first.stream_id)
+      return HTTP2_ERROR_PROTOCOL_ERROR;
+    if (end + HTTP2_FRAME_HEADER_LEN + header.len > max_len)
+      return HTTP2_ERROR_ENHANCE_YOUR_CALM;
+    if (in.len < end + HTTP2_FRAME_HEADER_LEN + header.len)
+      return HTTP2_ERROR_NONE;
+
+    end += HTTP2_FRAME_HEADER_LEN + header.len;
+    end_headers = header.flags & HTTP2_FLAG_END_HEADERS;
+  }
+
+  Str_builder sb = sb_new(end, &conn->arena);
+  sb = sb_append(sb, payload, &conn->arena);
+  for (usize pos = HTTP2_FRAME_HEADER_LEN + first.len; pos < end;) {
+    const Http2_frame_header header = http2_frame_header_parse(in.data + pos);
+    pos += HTTP2_FRAME_HEADER_LEN;
+    sb = sb_append(sb, (Str){.data = in.data + pos, .len = header.len},
+                   &conn->arena);
+    pos += header.len;
+  }
+  *block = sb_build(sb);
+  *frames_len = end;
+  return HTTP2_ERROR_NONE;
+}
+
+// Queue the response of a stream: its header block, then its body in the
+// same write if it fits in a frame the windows allow. The rest is sent by
+// `server_http2_queue_data`.
+static void server_http2_respond(Connection *_Nonnull conn,
+                                 Http2_stream *_Nonnull stream, Response res) {
+  Http2_session *const session = conn->http2;
+  const Str block =
+      hpack_encode_response(res, http_date_now(), &stream->arena);
+
+  // Same response as for GET, without the body. Nor any body for the
+  // statuses which cannot have one.
+  if (stream->req.method == HTTP_METHOD_HEAD ||
+      !http_status_has_content_length(res.status)) {
+    res.body = (Str){0};
+    res.file_len = 0;
+  }
+  stream->out_body = res.body;
+  stream->file = res.file;
+  stream->file_offset = res.file_offset;
+  stream->file_len = res.file_len;
+  stream->state = HTTP2_STREAM_HALF_CLOSED_REMOTE;
+
+  const u64 body_len = res.body.len + res.file_len;
+  const u64 max_len = (u64)pg_max(
+      0, pg_min(pg_min(stream->send_window, session->send_window),
+                (i64)session->peer_max_frame_len));
+  const bool body_inline =
+      res.file_len == 0 && body_len > 0 && body_len <= max_len;
+
+  const usize frames_count = 2 + block.len / session->peer_max_frame_len;
+  Str_builder frames =
+      sb_new(block.len + frames_count * HTTP2_FRAME_HEADER_LEN, &conn->arena);
+  usize offset = 0;
+  do {
+    const usize len =
+        pg_min(block.len - offset, (usize)session->peer_max_frame_len);
+    u8 flags = offset + len == block.len ? HTTP2_FLAG_END_HEADERS : 0;
+    if (offset == 0 && body_len == 0)
+      flags |= HTTP2_FLAG_END_STREAM;
+    frames = http2_append_frame(
+        frames, offset == 0 ? HTTP2_FRAME_HEADERS : HTTP2_FRAME_CONTINUATION,
+        flags, stream->id, (Str){.data = block.data + offset, .len = len},
+        &conn->arena);
+    offset += len;
+  } while (offset < block.len);
+
+  Connection_output output = {0};
+  if (body_inline) {
+    frames = sb_grow(frames, HTTP2_FRAME_HEADER_LEN, &conn->arena);
+    http2_frame_header_write(sb_end_c(frames), (u32)body_len, HTTP2_FRAME_DATA,
+                             HTTP2_FLAG_END_STREAM, stream->id);
+    frames = sb_assume_appended_n(frames, HTTP2_FRAME_HEADER_LEN);
+    output.body = res.body;
+    stream->out_body = (Str){0};
+    stream->send_window -= (i64)body_len;
+    session->send_window -= (i64)body_len;
+  }
+  output.head = sb_build(frames);
+  *array_push(&conn->out, &conn->arena) = output;
+
+  if (body_len == 0 || body_inline)
+    stream->state = HTTP2_STREAM_CLOSED;
+}
+
+// Answer the request of a stream with an error, telling the client to stop
+// sending the rest of it, if any.
+static void server_http2_fail(Connection *_Nonnull conn,
+                              Http2_stream *_Nonnull stream, u16 status,
+                              bool request_complete,
+                              Str_builder *_Nonnull control) {
+  server_http2_respond(conn, stream, (Response){.status = status});
+  if (!request_complete) {
+    *control = http2_append_rst_stream(*control, stream->id,
+                                       HTTP2_ERROR_NONE, &conn->arena);
+  }
+}
+
+// Reset a stream on the server side.
+static void server_http2_reset(Connection *_Nonnull conn,
+                               Http2_stream *_Nonnull stream,
+                               Http2_error error,
+                               Str_builder *_Nonnull control) {
+  *control =
+      http2_append_rst_stream(*control, stream->id, error, &conn->arena);
+  http2_stream_close(stream);
+}
+
+// The request of the stream is complete: handle it.
+static void server_http2_end_stream(Server *_Nonnull server,
+                                    Connection *_Nonnull conn,
+                                    Http2_stream *_Nonnull stream,
+                                    Str_builder *_Nonnull control) {
+  if (stream->has_content_length &&
+      stream->body_received != stream->content_length) {
+    server_http2_reset(conn, stream, HTTP2_ERROR_PROTOCOL_ERROR, control);
+    return;
+  }
+
+  if (stream->on_body == NULL && stream->body.data != NULL)
+    stream->req.body = sb_build(stream->body);
+
+  const Response res =
+      router_handle(server->router, stream->req, &stream->arena);
+  server_http2_respond(conn, stream, res);
+
+  server_stats_add(&server->stats->requests_handled, 1);
+  conn->requests_count += 1;
+}
+
+__attribute__((warn_unused_result)) static Http2_error
+server_http2_on_headers(Server *_Nonnull server, Connection *_Nonnull conn,
+                        Http2_frame_header header, Str block,
+                        Str_builder *_Nonnull control) {
+  Http2_session *const session = conn->http2;
+  const bool end_stream = header.flags & HTTP2_FLAG_END_STREAM;
+  if (header.stream_id == 0)
+    return HTTP2_ERROR_PROTOCOL_ERROR;
+
+  Http2_stream *stream = http2_session_find_stream(session, header.stream_id);
+  Array(Header) fields = {0};
+
+  // Trailers, or a stream reset by the server: decoded anyway, to keep the
+  // dynamic table in sync, then dropped.
+  if (header.stream_id <= session->last_stream_id) {
+    if (hpack_decode(&session->hpack, block, server->limits.max_headers_len,
+                     &fields, stream != NULL ? &stream->arena : &conn->arena) ==
+        HPACK_DECODE_INVALID)
+      return HTTP2_ERROR_COMPRESSION_ERROR;
+    if (stream == NULL || stream->state == HTTP2_STREAM_CLOSED)
+      return HTTP2_ERROR_NONE;
+    if (stream->state != HTTP2_STREAM_OPEN)
+      return HTTP2_ERROR_STREAM_CLOSED;
+    if (!end_stream)
+      return HTTP2_ERROR_PROTOCOL_ERROR;
+
+    server_http2_end_stream(server, conn, stream, control);
+    return HTTP2_ERROR_NONE;
+  }
+
+  // Opened by the client.
+  if (header.stream_id % 2 == 0)
+    return HTTP2_ERROR_PROTOCOL_ERROR;
+  session->last_stream_id = header.stream_id;
+
+  const bool overloaded = server_is_overloaded(server);
+  stream = session->goaway_sent || overloaded
+               ? NULL
+               : http2_session_open_stream(session, header.stream_id);
+  const Hpack_decode_result decoded =
+      hpack_decode(&session->hpack, block, server->limits.max_headers_len,
+                   &fields, stream != NULL ? &stream->arena : &conn->arena);
+  if (decoded == HPACK_DECODE_INVALID)
+    return HTTP2_ERROR_COMPRESSION_ERROR;
+
+  if (stream == NULL) {
+    if (overloaded)
+      server_stats_add(&server->stats->requests_shed, 1);
+    *control = http2_append_rst_stream(*control, header.stream_id,
+                                       HTTP2_ERROR_REFUSED_STREAM,
+                                       &conn->arena);
+    return HTTP2_ERROR_NONE;
+  }
+
+  // Larger than announced in the settings.
+  if (decoded == HPACK_DECODE_TOO_LARGE) {
+    server_http2_fail(conn, stream, 431, end_stream, control);
+    return HTTP2_ERROR_NONE;
+  }
+
+  Request *const req = &stream->req;
+  if (!http2_request_from_fields(fields, req, &stream->arena)) {
+    server_http2_reset(conn, stream, HTTP2_ERROR_PROTOCOL_ERROR, control);
+    return HTTP2_ERROR_NONE;
+  }
+
+  const Header *const content_length =
+      http_find_known_header(req->headers, HTTP_HEADER_CONTENT_LENGTH);
+  if (content_length != NULL) {
+    if (!http_parse_content_length(content_length->value,
+                                   &stream->content_length)) {
+      server_http2_fail(conn, stream, 400, end_stream, control);
+      return HTTP2_ERROR_NONE;
+    }
+    stream->has_content_length = true;
+  }
+
+  // Buffered bodies are limited by default, streamed ones are not.
+  const Router_body route = router_body(server->router, *req);
+  stream->on_body = route.on_body;
+  stream->body_max_len = route.max_len > 0          ? route.max_len
+                         : stream->on_body == NULL ? SERVER_BODY_MAX_LEN
+                                                   : UINT64_MAX;
+  if (stream->content_length > stream->body_max_len) {
+    server_http2_fail(conn, stream, 413, end_stream, control);
+    return HTTP2_ERROR_NONE;
+  }
+
+  if (end_stream) {
+    server_http2_end_stream(server, conn, stream, control);
+  } else if (stream->on_body == NULL) {
+    stream->body = sb_new((usize)stream->content_length, &stream->arena);
+  }
+  return HTTP2_ERROR_NONE;
+}
+
+__attribute__((warn_unused_result)) static Http2_error
+server_http2_on_data(Server *_Nonnull server, Connection *_Nonnull conn,
+                     Http2_frame_header header, Str payload,
+                     Str_builder *_Nonnull control) {
+  Http2_session *const session = conn->http2;
+  const bool end_stream = header.flags & HTTP2_FLAG_END_STREAM;
+  if (header.stream_id == 0)
+    return HTTP2_ERROR_PROTOCOL_ERROR;
+
+  // Flow control counts the whole payload, padding included. The windows are
+  // replenished as the data is consumed, that is right away.
+  if (header.len > session->recv_window)
+    return HTTP2_ERROR_FLOW_CONTROL_ERROR;
+  session->recv_window -= header.len;
+  if (session->recv_window < HTTP2_WINDOW_DEFAULT / 2) {
+    *control = http2_append_window_update(
+        *control, 0, (u32)(HTTP2_WINDOW_DEFAULT - session->recv_window),
+        &conn->arena);
+    session->recv_window = HTTP2_WINDOW_DEFAULT;
+  }
+
+  Http2_stream *const stream =
+      http2_session_find_stream(session, header.stream_id);
+  if (stream == NULL || stream->state == HTTP2_STREAM_CLOSED) {
+    // Reset by the server, with frames still in flight.
+    return header.stream_id > session->last_stream_id
+               ? HTTP2_ERROR_PROTOCOL_ERROR
+               : HTTP2_ERROR_NONE;
+  }
+  if (stream->state != HTTP2_STREAM_OPEN) {
+    server_http2_reset(conn, stream, HTTP2_ERROR_STREAM_CLOSED, control);
+    return HTTP2_ERROR_NONE;
+  }
+
+  if (header.len > stream->recv_window)
+    return HTTP2_ERROR_FLOW_CONTROL_ERROR;
+  stream->recv_window -= header.len;
+  if (!end_stream && stream->recv_window < HTTP2_WINDOW_DEFAULT / 2) {
+    *control = http2_append_window_update(
+        *control, stream->id,
+        (u32)(HTTP2_WINDOW_DEFAULT - stream->recv_window), &conn->arena);
+    stream->recv_window = HTTP2_WINDOW_DEFAULT;
+  }
+
+  if (!http2_frame_unpad(header, &payload))
+    return HTTP2_ERROR_PROTOCOL_ERROR;
+
+  stream->body_received += payload.len;
+  if (stream->body_received > stream->body_max_len) {
+    server_http2_fail(conn, stream, 413, end_stream, control);
+    return HTTP2_ERROR_NONE;
+  }
+  if (stream->has_content_length &&
+      stream->body_received > stream->content_length) {
+    server_http2_reset(conn, stream, HTTP2_ERROR_PROTOCOL_ERROR, control);
+    return HTTP2_ERROR_NONE;
+  }
+
+  if (stream->on_body != NULL) {
+    if (payload.len > 0)
+      stream->on_body(&stream->req, payload, &stream->arena);
+  } else {
+    stream->body = sb_append(stream->body, payload, &stream->arena);
+  }
+
+  if (end_stream)
+    server_http2_end_stream(server, conn, stream, control);
+  return HTTP2_ERROR_NONE;
+}
+
+// Handle a complete frame, or header block. Errors of the connection are
+// returned, the others are answered by resetting the stream.
+__attribute__((warn_unused_result)) static Http2_error
+server_http2_on_frame(Server *_Nonnull server, Connection *_Nonnull conn,
+                      Http2_frame_header header, Str payload,
+                      Str_builder *_Nonnull control) {
+  Http2_session *const session = conn->http2;
+
+  switch (header.type) {
+  case HTTP2_FRAME_DATA:
+    return server_http2_on_data(server, conn, header, payload, control);
+  case HTTP2_FRAME_HEADERS:
+    return server_http2_on_headers(server, conn, header, payload, control);
+  case HTTP2_FRAME_PRIORITY: // Ignored: streams are served round-robin.
+    if (header.stream_id == 0)
+      return HTTP2_ERROR_PROTOCOL_ERROR;
+    return payload.len == 5 ? HTTP2_ERROR_NONE : HTTP2_ERROR_FRAME_SIZE_ERROR;
+  case HTTP2_FRAME_RST_STREAM: {
+    if (header.stream_id == 0 || header.stream_id > session->last_stream_id)
+      return HTTP2_ERROR_PROTOCOL_ERROR;
+    if (payload.len != 4)
+      return HTTP2_ERROR_FRAME_SIZE_ERROR;
+
+    Http2_stream *const stream =
+        http2_session_find_stream(session, header.stream_id);
+    if (stream != NULL)
+      http2_stream_close(stream);
+    return HTTP2_ERROR_NONE;
+  }
+  case HTTP2_FRAME_SETTINGS: {
+    if (header.stream_id != 0)
+      return HTTP2_ERROR_PROTOCOL_ERROR;
+    if (header.flags & HTTP2_FLAG_ACK)
+      return payload.len == 0 ? HTTP2_ERROR_NONE
+                              : HTTP2_ERROR_FRAME_SIZE_ERROR;
+
+    const Http2_error error = http2_session_apply_settings(session, payload);
+    if (error == HTTP2_ERROR_NONE) {
+      *control = http2_append_frame(*control, HTTP2_FRAME_SETTINGS,
+                                    HTTP2_FLAG_ACK, 0, (Str){0}, &conn->arena);
+    }
+    return error;
+  }
+  case HTTP2_FRAME_PING:
+    if (header.stream_id != 0)
+      return HTTP2_ERROR_PROTOCOL_ERROR;
+    if (payload.len != 8)
+      return HTTP2_ERROR_FRAME_SIZE_ERROR;
+    if (!(header.flags & HTTP2_FLAG_ACK)) {
+      *control = http2_append_frame(*control, HTTP2_FRAME_PING,
+                                    HTTP2_FLAG_ACK, 0, payload, &conn->arena);
+    }
+    return HTTP2_ERROR_NONE;
+  case HTTP2_FRAME_GOAWAY:
+    if (header.stream_id != 0)
+      return HTTP2_ERROR_PROTOCOL_ERROR;
+    session->goaway_received = true;
+    return HTTP2_ERROR_NONE;
+  case HTTP2_FRAME_WINDOW_UPDATE: {
+    if (payload.len != 4)
+      return HTTP2_ERROR_FRAME_SIZE_ERROR;
+    const u32 increment = http2_load_u32(payload.data) & 0x7fffffff;
+    if (header.stream_id == 0)
+      return http2_window_add(&session->send_window, increment);
+
+    Http2_stream *const stream =
+        http2_session_find_stream(session, header.stream_id);
+    if (stream == NULL) {
+      return header.stream_id > session->last_stream_id
+                 ? HTTP2_ERROR_PROTOCOL_ERROR
+                 : HTTP2_ERROR_NONE;
+    }
+    const Http2_error error = http2_window_add(&stream->send_window, increment);
+    if (error != HTTP2_ERROR_NONE)
+      server_http2_reset(conn, stream, error, control);
+    return HTTP2_ERROR_NONE;
+  }
+  case HTTP2_FRAME_PUSH_PROMISE: // Only servers push.
+  case HTTP2_FRAME_CONTINUATION: // Only after HEADERS, handled with them.
+    return HTTP2_ERROR_PROTOCOL_ERROR;
+  default: // Extensions.
+    return HTTP2_ERROR_NONE;
+  }
+}
+
+// Queue the DATA frames the windows allow, one per stream in turn so that
+// they progress together.
+static void server_http2_queue_data(Connection *_Nonnull conn) {
+  Http2_session *const session = conn->http2;
+
+  for (bool progress = true; progress;) {
+    progress = false;
+    for (u32 n = 0; n < HTTP2_STREAMS_MAX; n++) {
+      // Room for the control frames.
+      if (conn->out.len + 1 >= SERVER_RESPONSES_BATCH_MAX)
+        return;
+
+      Http2_stream *const stream =
+          &session->streams[(session->next_stream + n) % HTTP2_STREAMS_MAX];
+      const i64 window = pg_min(stream->send_window, session->send_window);
+      if (stream->state != HTTP2_STREAM_HALF_CLOSED_REMOTE || window <= 0)
+        continue;
+
+      // The body, then the file, in frames of their own.
+      const u64 pending = stream->out_body.len + stream->file_len;
+      const u64 available =
+          str_is_empty(stream->out_body) ? stream->file_len
+                                         : stream->out_body.len;
+      const u32 len = (u32)pg_min(
+          pg_min(available, (u64)window), (u64)session->peer_max_frame_len);
+      const bool last = len == pending;
+
+      Connection_output output = {
+          .head = http2_frame_header(len, HTTP2_FRAME_DATA,
+                                     last ? HTTP2_FLAG_END_STREAM : 0,
+                                     stream->id, &conn->arena),
+      };
+      if (!str_is_empty(stream->out_body)) {
+        output.body = (Str){.data = stream->out_body.data, .len = len};
+        stream->out_body = str_advance(stream->out_body, len);
+      } else {
+        // Released once sent, like the files of HTTP/1.1 responses.
+        file_cache_retain(stream->file);
+        output.file = stream->file;
+        output.file_offset = stream->file_offset;
+        output.file_len = len;
+        stream->file_offset += len;
+        stream->file_len -= len;
+      }
+      *array_push(&conn->out, &conn->arena) = output;
+
+      stream->send_window -= len;
+      session->send_window -= len;
+      if (last)
+        stream->state = HTTP2_STREAM_CLOSED;
+      progress = true;
+    }
+    session->next_stream = (session->next_stream + 1) % HTTP2_STREAMS_MAX;
+  }
+}
+
+// Handle every frame completely received so far, queuing the frames to send
+// in response, without doing any I/O.
+__attribute__((warn_unused_result)) static Connection_progress
+server_http2_process(Server *_Nonnull server, Connection *_Nonnull conn) {
+  Http2_session *const session = conn->http2;
+  if (array_is_empty(conn->out))
+    server_http2_free_closed_streams(session);
+
+  // Sent after the frames of the streams, e.g. to reset one once its
+  // response is sent.
+  Str_builder control = sb_new(64, &conn->arena);
+  Http2_error error = HTTP2_ERROR_NONE;
+  while (error == HTTP2_ERROR_NONE &&
+         conn->out.len + 1 < SERVER_RESPONSES_BATCH_MAX) {
+    const Str in = str_advance(sb_build(conn->in), conn->consumed);
+    if (in.len < HTTP2_FRAME_HEADER_LEN)
+      break;
+
+    const Http2_frame_header header = http2_frame_header_parse(in.data);
+    if (header.len > HTTP2_FRAME_LEN_DEFAULT) {
+      error = HTTP2_ERROR_FRAME_SIZE_ERROR;
+      break;
+    }
+    if (in.len < HTTP2_FRAME_HEADER_LEN + header.len)
+      break;
+
+    Str payload = {.data = in.data + HTTP2_FRAME_HEADER_LEN,
+                   .len = header.len};
+    usize frames_len = HTTP2_FRAME_HEADER_LEN + header.len;
+    if (header.type == HTTP2_FRAME_HEADERS) {
+      error = server_http2_header_block(server, conn, in, &payload,
+                                        &frames_len);
+      if (error != HTTP2_ERROR_NONE || frames_len == 0)
+        break;
+    }
+
+    error = server_http2_on_frame(server, conn, header, payload, &control);
+    conn->consumed += frames_len;
+  }
+
+  if (error != HTTP2_ERROR_NONE) {
+    control = http2_append_goaway(control, session->last_stream_id, error,
+                                  &conn->arena);
+    conn->close_after_write = true;
+  } else {
+    server_http2_queue_data(conn);
+
+    // The streams in progress are still served.
+    if (server->draining && !session->goaway_sent) {
+      control = http2_append_goaway(control, session->last_stream_id,
+                                    HTTP2_ERROR_NONE, &conn->arena);
+      session->goaway_sent = true;
+    }
+    if ((session->goaway_sent || session->goaway_received) &&
+        http2_session_active_streams(session) == 0)
+      conn->close_after_write = true;
+  }
+
+  if (control.len > 0) {
+    *array_push(&conn->out, &conn->arena) =
+        (Connection_output){.head = sb_build(control)};
+  }
+
+  if (!array_is_empty(conn->out))
+    return CONNECTION_PROGRESS_RESPONSE_READY;
+
+  // Frames are consumed one by one, unlike requests which reset the
+  // connection once answered: move what is left to the start of the buffer.
+  const Str pending = str_advance(sb_build(conn->in), conn->consumed);
+  if (pending.len > 0)
+    memmove(conn->in.data, pending.data, pending.len);
+  memset(conn->in.data + pending.len, 0, conn->in.len - pending.len);
+  conn->in.len = pending.len;
+  conn->consumed = 0;
+
+  return conn->close_after_write ? CONNECTION_PROGRESS_ERROR
+                                 : CONNECTION_PROGRESS_NEED_MORE;
+}
+
+// Parse and handle every request completely received so far, queuing their
+// responses, without doing any I/O.
+__attribute__((warn_unused_result)) static Connection_progress
+server_connection_process(Server *_Nonnull server, Connection *_Nonnull conn) {
+  // HTTP/2 with prior knowledge: the preface replaces the first request.
+  if (conn->http2 == NULL && conn->requests_count == 0 &&
+      conn->consumed == 0 && !conn->headers_parsed &&
+      http2_is_preface_prefix(sb_build(conn->in))) {
+    if (conn->in.len < HTTP2_PREFACE.len)
+      return CONNECTION_PROGRESS_NEED_MORE;
+    server_http2_start(server, conn);
+  }
+  if (conn->http2 != NULL)
+    return server_http2_process(server, conn);
+
+  while (!conn->close_after_write &&
+         conn->out.len < SERVER_RESPONSES_BATCH_MAX) {
+    const Str in = str_advance(sb_build(conn->in), conn->consumed);
+
+    // Shed new requests as soon as their first bytes arrive.
+    if (!conn->headers_parsed && !str_is_empty(in) &&
+        server_is_overloaded(server)) {
+      server_stats_add(&server->stats->requests_shed, 1);
+      *array_push(&conn->out, &conn->arena) =
+          (Connection_output){.head = server->overload_response};
+      conn->close_after_write = true;
+      break;
+    }
+
+    if (!conn->headers_parsed) {
+      const isize headers_sep_pos = str_find_resume(
+          in, str_from_c("\r\n\r\n"), &conn->headers_searched);
+      const usize headers_len =
+          headers_sep_pos == -1 ? in.len : (usize)headers_sep_pos + 4;
+      if (headers_len > server->limits.max_headers_len) {
+        server_connection_fail(conn, 431);
+        break;
+      }
+      if (headers_sep_pos == -1)
+        break;
+      conn->headers_len = headers_len;
+
+      const Read_result headers = {
+          .content = {.data = in.data, .len = conn->headers_len}};
+      conn->req = parse_request(headers, &conn->arena);
+      if (conn->req.error) {
+        conn->close_after_write = true;
+        break;
+      }
+
+      if (!http_body_init(conn->req, &conn->body)) {
+        server_connection_fail(conn, 400);
+        break;
+      }
+      // Buffered bodies are limited by default, streamed ones are not.
+      const Router_body route = router_body(server->router, conn->req);
+      conn->on_body = route.on_body;
+      conn->body_max_len = route.max_len > 0        ? route.max_len
+                           : conn->on_body == NULL ? SERVER_BODY_MAX_LEN
+                                                   : UINT64_MAX;
+      // Rejected before the client sends it, if it waits for a go-ahead.
+      if (conn->body.content_length > conn->body_max_len) {
+        server_connection_fail(conn, 413);
+        break;
+      }
+
+      const Http_expect expect = http_request_expect(conn->req);
+      if (expect == HTTP_EXPECT_UNSUPPORTED) {
+        server_connection_fail(conn, 417);
+        break;
+      }
+      // Useless once the body started arriving.
+      if (expect == HTTP_EXPECT_CONTINUE && !conn->continue_sent &&
+          !http_body_is_empty(conn->body) && in.len == conn->headers_len) {
+        *array_push(&conn->out, &conn->arena) =
+            (Connection_output){.head = HTTP_CONTINUE_RESPONSE};
+        conn->continue_sent = true;
+      }
+
+      conn->headers_parsed = true;
+    }
+
+    // A streamed body is dropped from the input buffer as it is handed over,
+    // which a reset must not happen in the middle of: the queued responses
+    // are sent first.
+    if (conn->on_body != NULL && !array_is_empty(conn->out))
+      break;
+
+    u8 *const body = in.data + conn->headers_len;
+    const Http_body_progress progress =
+        http_body_decode(&conn->body, body, in.len - conn->headers_len);
+    if (progress == HTTP_BODY_INVALID) {
+      server_connection_fail(conn, 400);
+      break;
+    }
+    // Only chunked bodies get here, the others being rejected upfront.
+    if (conn->body.streamed + conn->body.len > conn->body_max_len) {
+      server_connection_fail(conn, 413);
+      break;
+    }
+
+    if (conn->on_body != NULL) {
+      if (conn->body.len > 0) {
+        conn->on_body(&conn->req, (Str){.data = body, .len = conn->body.len},
+                      &conn->arena);
+      }
+      if (progress == HTTP_BODY_NEED_MORE) {
+        http_body_drop(&conn->body);
+        // Zeroed as the builder expects past its end.
+        const usize len = conn->consumed + conn->headers_len;
+        memset(conn->in.data + len, 0, conn->in.len - len);
+        conn->in.len = len;
+        break;
+      }
+    } else {
+      if (progress == HTTP_BODY_NEED_MORE) {
+        // Make room for the whole body at once, when its length is known.
+        if (!conn->body.chunked) {
+          conn->in = sb_grow(conn->in,
+                             (usize)conn->body.content_length - conn->body.len,
+                             &conn->arena);
+        } else if (array_is_empty(conn->out)) {
+          // Otherwise tiny chunks would fill the buffer with their framing.
+          // Not before the queued responses are sent: the reset which follows
+          // decodes the body again from its start.
+          conn->in.len = conn->consumed + conn->headers_len +
+                         http_body_compact(&conn->body, body,
+                                           in.len - conn->headers_len);
+        }
+        break;
+      }
+    }
+
+    const usize request_len = conn->headers_len + conn->body.raw_len;
+    conn->req.body = conn->on_body != NULL
+                         ? (Str){0}
+                         : (Str){.data = body, .len = conn->body.len};
+
+    Response res = router_handle(server->router, conn->req, &conn->arena);
+    if (!conn->req.keep_alive || server->draining) {
+      http_headers_add(&res.headers, str_from_c("Connection"),
+                       str_from_c("close"), &conn->arena);
+      conn->close_after_write = true;
+    } else if (conn->req.version_minor == 0) {
+      http_headers_add(&res.headers, str_from_c("Connection"),
+                       str_from_c("keep-alive"), &conn->arena);
+    }
+    server_connection_queue_response(conn, res);
+
+    server_stats_add(&server->stats->requests_handled, 1);
+    conn->requests_count += 1;
+    conn->consumed += request_len;
+    conn->headers_parsed = false;
+    conn->req = (Request){0};
+    conn->headers_searched = conn->headers_len = 0;
+    conn->body = (Http_body){0};
+    conn->on_body = NULL;
+    conn->continue_sent = false;
+  }
+
+  if (!array_is_empty(conn->out))
+    return CONNECTION_PROGRESS_RESPONSE_READY;
+
+  return conn->close_after_write ? CONNECTION_PROGRESS_ERROR
+                                 : CONNECTION_PROGRESS_NEED_MORE;
+}
+
+__attribute__((warn_unused_result)) static bool
+server_connection_all_sent(Connection conn) {
+  return conn.out_sent == conn.out.len;
+}
+
+// Describe the responses not sent yet as a scatter-gather array, for
+// sendmsg(2), which needs room for three entries per response. Files are
+// described from their mapping if `files_mapped`, otherwise the array stops
+// before the first file, which is sent with sendfile(2) once everything before
+// it is sent. `more` is then set.
+__attribute__((warn_unused_result)) static u32
+server_connection_iovecs(Connection conn, struct iovec *_Nonnull iovecs,
+                         bool files_mapped, bool *_Nonnull more) {
+  pg_assert(conn.out.len - conn.out_sent <= SERVER_RESPONSES_BATCH_MAX);
+
+  *more = false;
+  u32 count = 0;
+  for (u32 i = conn.out_sent; i < conn.out.len; i++) {
+    const Connection_output output = conn.out.data[i];
+    if (!str_is_empty(output.head)) {
+      iovecs[count++] = (struct iovec){.iov_base = output.head.data,
+                                       .iov_len = output.head.len};
+    }
+    if (!str_is_empty(output.body)) {
+      iovecs[count++] = (struct iovec){.iov_base = output.body.data,
+                                       .iov_len = output.body.len};
+    }
+    if (output.file_len == 0)
+      continue;
+
+    if (!files_mapped) {
+      *more = true;
+      break;
+    }
+    u8 *const mapping = file_cache_entry_map(output.file);
+    pg_assert(mapping != NULL);
+    iovecs[count++] = (struct iovec){.iov_base = mapping + output.file_offset,
+                                     .iov_len = output.file_len};
+  }
+  return count;
+}
+
+// Account for `n` bytes sent, possibly ending in the middle of a response.
+static void server_connection_advance_sent(Connection *_Nonnull conn,
+                                           usize n) {
+  while (n > 0) {
+    pg_assert(!server_connection_all_sent(*conn));
+
+    Connection_output *const output = &conn->out.data[conn->out_sent];
+    if (!str_is_empty(output->head)) {
+      const usize head_sent = pg_min(n, output->head.len);
+      output->head = str_advance(output->head, head_sent);
+      n -= head_sent;
+    }
+
+    if (!str_is_empty(output->body)) {
+      const usize body_sent = pg_min(n, output->body.len);
+      output->body = str_advance(output->body, body_sent);
+      n -= body_sent;
+    }
+
+    const usize file_sent = pg_min(n, output->file_len);
+    output->file_offset += file_sent;
+    output->file_len -= file_sent;
+    n -= file_sent;
+
+    if (str_is_empty(output->head) && str_is_empty(output->body) &&
+        output->file_len == 0) {
+      conn->out_sent += 1;
+    }
+  }
+}
+
+// Once the whole batch of responses has been sent, prepare the connection for
+// the next requests. Returns false if the connection should be closed
+// instead.
+__attribute__((warn_unused_result)) static bool
+server_connection_next_request(const Server *_Nonnull server,
+                               Connection *_Nonnull conn) {
+  pg_assert(conn->state == CONNECTION_STATE_WRITING);
+  pg_assert(server_connection_all_sent(*conn));
+
+  if (conn->close_after_write)
+    return false;
+
+  // Pipelined requests already received are still served, and so are the
+  // HTTP/2 streams in progress.
+  if (server->draining && conn->in.len == conn->consumed &&
+      (conn->http2 == NULL || http2_session_active_streams(conn->http2) == 0))
+    return false;
+
+  // A request may be partially received, including its parsed headers which
+  // would not survive the reset.
+  const Str leftover = str_advance(sb_build(conn->in), conn->consumed);
+  server_connection_reset(conn, leftover);
+  return true;
+}
+
+// Drive the connection as far as possible without blocking: read, handle and
+// write requests in a loop until the socket would block.
+static void server_connection_run(Server *_Nonnull server,
+                                  Connection *_Nonnull conn) {
+  for (;;) {
+    if (conn->state == CONNECTION_STATE_READING) {
+      // Edge-triggered: read until the socket is drained.
+      while (conn->readable) {
+        // Enough to answer with a 431, no need to buffer more. HTTP/2
+        // frames are handled as they complete instead.
+        if (conn->http2 != NULL ? conn->in.len - conn->consumed >
+                                      server_http2_pending_max(server)
+                                : !conn->headers_parsed &&
+                                      conn->in.len - conn->consumed >
+                                          server->limits.max_headers_len)
+          break;
+
+        if (sb_space(conn->in) == 0) {
+          // Handle the body received so far before reading more: a streamed
+          // one is then dropped, and a buffered one fails past its limit.
+          const usize pending = conn->in.len - conn->consumed;
+          if (conn->headers_parsed &&
+              (conn->on_body != NULL ||
+               pending > conn->headers_len + conn->body.raw_len))
+            break;
+          conn->in = sb_grow(conn->in, conn->in.cap, &conn->arena);
+        }
+
+        const isize read_n =
+            read(conn->fd, sb_end_c(conn->in), sb_space(conn->in));
+        if (read_n == -1) {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn->readable = false;
+            break;
+          }
+
+          server_connection_close(server, conn);
+          return;
+        }
+        if (read_n == 0) {
+          server_connection_close(server, conn);
+          return;
+        }
+
+        conn->in = sb_assume_appended_n(conn->in, (usize)read_n);
+      }
+
+      switch (server_connection_process(server, conn)) {
+      case CONNECTION_PROGRESS_NEED_MORE:
+        // Stopped reading to make room, see above.
+        if (conn->readable)
+          continue;
+        server_connection_account(server, conn, false);
+        server_connection_arm_timeout(server, conn);
+        return;
+      case CONNECTION_PROGRESS_ERROR:
+        server_connection_close(server, conn);
+        return;
+      case CONNECTION_PROGRESS_RESPONSE_READY:
+        conn->state = CONNECTION_STATE_WRITING;
+        break;
+      }
+    }
+
+    pg_assert(conn->state == CONNECTION_STATE_WRITING);
+    while (!server_connection_all_sent(*conn)) {
+      const Connection_output *const next = &conn->out.data[conn->out_sent];
+      isize write_n = 0;
+      if (str_is_empty(next->head) && str_is_empty(next->body)) {
+        pg_assert(next->file_len > 0);
+        off_t offset = (off_t)next->file_offset;
+        write_n = sendfile(conn->fd, next->file->fd, &offset, next->file_len);
+        // The file was truncated since: it cannot be sent as announced.
+        if (write_n == 0) {
+          server_connection_close(server, conn);
+          return;
+        }
+      } else {
+        struct iovec iovecs[3 * SERVER_RESPONSES_BATCH_MAX];
+        bool more = false;
+        const struct msghdr msg = {
+            .msg_iov = iovecs,
+            .msg_iovlen = server_connection_iovecs(*conn, iovecs, false, &more),
+        };
+        // The file follows right away: no need for a packet of its own.
+        write_n =
+            sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+      }
+      if (write_n == -1) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) { // Wait for EPOLLOUT.
+          server_connection_account(server, conn, false);
+          server_connection_arm_timeout(server, conn);
+          return;
+        }
+
+        server_connection_close(server, conn);
+        return;
+      }
+
+      server_connection_advance_sent(conn, (usize)write_n);
+    }
+
+    if (!server_connection_next_request(server, conn)) {
+      server_connection_close(server, conn);
+      return;
+    }
+  }
+}
+
+static void server_accept_all(Server *_Nonnull server, int listen_fd) {
+  for (;;) {
+    const int fd = accept4(listen_fd, NULL, NULL,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      // The listener does not trigger again for the connections already
+      // queued: retry once some descriptors are closed.
+      if (errno == EMFILE || errno == ENFILE) {
+        server->accept_paused[listen_fd == server->unix_listen_fd] = true;
+        return;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf(stderr, "Failed to accept(2): %s\n", strerror(errno));
+      return;
+    }
+
+    Connection *const conn = server_connection_admit(server, fd);
+    if (conn == NULL)
+      continue;
+    server_connection_arm_timeout(server, conn);
+
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = conn,
+    };
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      fprintf(stderr, "Failed to epoll_ctl(2): %s\n", strerror(errno));
+      server_connection_close(server, conn);
+    }
+  }
+}
+
+// Close connections whose deadline passed.
+static void server_expire_timeouts(Server *_Nonnull server) {
+  const u64 now_tick = timer_now_tick();
+
+  Timer *timer = NULL;
+  while ((timer = timer_wheel_expire(&server->timers, now_tick)) != NULL) {
+    Connection *const conn = server_connection_from_timer(timer);
+    server_connection_send_timeout_response(server, *conn);
+    server_connection_close(server, conn);
+  }
+}
+
+static void server_epoll_drain_start(Server *_Nonnull server) {
+  server_drain_start(server);
+
+  // Other processes (the supervisor, the next server) keep the listener open
+  // so it has to be removed explicitly from the interest list.
+  pg_assert(epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->listen_fd,
+                      NULL) != -1);
+  close(server->listen_fd);
+  if (server->unix_listen_fd != -1) {
+    pg_assert(epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL,
+                        server->unix_listen_fd, NULL) != -1);
+    close(server->unix_listen_fd);
+  }
+
+  for (Connection *it = server->slots; it != NULL; it = it->next_slot) {
+    if (!server_connection_is_idle(*it))
+      continue;
+
+    // The next request may already be there, its edge not processed yet:
+    // serve it (with `Connection: close`) rather than dropping it.
+    it->readable = true;
+    server_connection_run(server, it);
+    if (server_connection_is_idle(*it)) {
+      server_connection_close(server, it);
+    }
+  }
+}
+
+static void server_epoll_on_event(Server *_Nonnull server,
+                                  struct epoll_event event) {
+  Connection *const conn = event.data.ptr;
+
+  if (event.events & (EPOLLERR | EPOLLHUP)) {
+    server_connection_close(server, conn);
+    return;
+  }
+
+  // Remember readiness since we only get notified of edges, and the
+  // connection might not be reading at the moment.
+  if (event.events & (EPOLLIN | EPOLLRDHUP)) {
+    conn->readable = true;
+  }
+
+  if ((conn->state == CONNECTION_STATE_READING && conn->readable) ||
+      (conn->state == CONNECTION_STATE_WRITING && (event.events & EPOLLOUT))) {
+    server_connection_run(server, conn);
+  }
+}
+
+// Serve all connections from this process with an edge-triggered epoll event
+// loop. On SIGTERM, stop accepting and exit once the connections are served.
+static void server_run_epoll(int listen_fd, Server_config config) {
+  Server server = server_new(listen_fd, config);
+  server_drain_install_signal_handler();
+
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  pg_assert(server.epoll_fd != -1);
+
+  // The listeners are the only entries without a connection attached: the
+  // TCP one has none, the Unix one points to its descriptor.
+  const int listen_fds[] = {listen_fd, server.unix_listen_fd};
+  for (u32 i = 0; i < carray_count(listen_fds); i++) {
+    if (listen_fds[i] == -1)
+      continue;
+
+    const int flags = fcntl(listen_fds[i], F_GETFL);
+    pg_assert(flags != -1);
+    pg_assert(fcntl(listen_fds[i], F_SETFL, flags | O_NONBLOCK) != -1);
+
+    struct epoll_event listen_event = {
+        .events = EPOLLIN | EPOLLET,
+        .data.ptr = i == 0 ? NULL : &server.unix_listen_fd,
+    };
+    pg_assert(epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fds[i],
+                        &listen_event) != -1);
+  }
+
+  struct epoll_event events[256] = {0};
+  for (;;) {
+    server_stats_print_if_requested("epoll", server.stats);
+
+    if (server_drain_requested && !server.draining) {
+      server_epoll_drain_start(&server);
+    }
+    if (server_drain_done(&server))
+      exit(0);
+
+    // Wake up every tick while deadlines or accepts are pending.
+    const bool accept_paused =
+        server.accept_paused[0] || server.accept_paused[1];
+    const int timeout_ms = server.timers.armed_count > 0 || accept_paused
+                               ? (int)TIMER_TICK_MS
+                               : -1;
+    const int events_count = epoll_wait(
+        server.epoll_fd, events, (int)carray_count(events), timeout_ms);
+    if (events_count == -1) {
+      pg_assert(errno == EINTR);
+      continue;
+    }
+
+    for (int i = 0; i < events_count; i++) {
+      if (events[i].data.ptr == NULL ||
+          events[i].data.ptr == &server.unix_listen_fd) {
+        if (!server.draining) {
+          server_accept_all(&server, events[i].data.ptr == NULL
+                                         ? server.listen_fd
+                                         : server.unix_listen_fd);
+        }
+        continue;
+      }
+
+      server_epoll_on_event(&server, events[i]);
+    }
+
+    server_expire_timeouts(&server);
+
+    for (u32 i = 0; i < carray_count(listen_fds); i++) {
+      if (server.accept_paused[i] && !server.draining) {
+        server.accept_paused[i] = false;
+        server_accept_all(&server, listen_fds[i]);
+      }
+    }
+  }
+}
+
+// Serve a single connection, which already sent `received`, with an event
+// loop of its own until it is closed: for the fork mode, whose blocking
+// workers only speak HTTP/1.1, to hand HTTP/2 connections over.
+static void server_serve_connection(int fd, Server_config config,
+                                    Str received) {
+  Server server = server_new(-1, config);
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  pg_assert(server.epoll_fd != -1);
+
+  const int flags = fcntl(fd, F_GETFL);
+  pg_assert(flags != -1);
+  pg_assert(fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1);
+
+  Connection *const conn = server_connection_admit(&server, fd);
+  pg_assert(conn != NULL);
+  conn->in = sb_append(conn->in, received, &conn->arena);
+  server_connection_arm_timeout(&server, conn);
+
+  struct epoll_event event = {
+      .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+      .data.ptr = conn,
+  };
+  pg_assert(epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &event) != -1);
+
+  // What was received already is handled even if nothing else arrives.
+  conn->readable = true;
+  server_connection_run(&server, conn);
+
+  struct epoll_event events[8] = {0};
+  while (conn->fd != -1) {
+    const int events_count = epoll_wait(
+        server.epoll_fd, events, (int)carray_count(events), (int)TIMER_TICK_MS);
+    if (events_count == -1) {
+      pg_assert(errno == EINTR);
+      continue;
+    }
+
+    for (int i = 0; i < events_count && conn->fd != -1; i++) {
+      server_epoll_on_event(&server, events[i]);
+    }
+    server_expire_timeouts(&server);
+  }
+}
+
+// Pin the calling process to the n-th CPU (modulo) it is allowed to run on.
+static void server_pin_to_cpu(u32 n) {
+  cpu_set_t allowed = {0};
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    return;
+
+  const u32 allowed_count = (u32)CPU_COUNT(&allowed);
+  if (allowed_count == 0)
+    return;
+
+  u32 seen = 0;
+  for (u32 cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+
+    if (seen++ == n % allowed_count) {
+      cpu_set_t set = {0};
+      CPU_SET(cpu, &set);
+      if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        fprintf(stderr, "Failed to sched_setaffinity(2): %s\n",
+                strerror(errno));
+      return;
+    }
+  }
+}
+
+typedef struct {
+  int listen_fds[SERVER_LISTENERS_MAX];
+  // -1 once exited while draining, or when it could not be spawned.
+  pid_t pids[SERVER_LISTENERS_MAX];
+  u32 workers_count;
+  // Listening Unix socket for the next server to take over, or -1.
+  int control_fd;
+  // Shared with the workers, which inherit the mapping.
+  Server_stats *_Nonnull stats;
+  Server_loop loop;
+  Server_config config;
+  bool draining;
+  pg_pad(7);
+} Server_supervisor;
+
+__attribute__((warn_unused_result)) static pid_t
+server_spawn_worker(const Server_supervisor *_Nonnull supervisor,
+                    u32 worker_index) {
+  const pid_t pid = fork();
+  if (pid == -1) {
+    fprintf(stderr, "Failed to fork(2): %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (pid == 0) { // Child.
+    // Do not outlive the supervisor, but drain.
+    pg_assert(prctl(PR_SET_PDEATHSIG, SIGTERM) != -1);
+
+    // The supervisor only lets signals in while waiting.
+    sigset_t none = {0};
+    sigemptyset(&none);
+    pg_assert(sigprocmask(SIG_SETMASK, &none, NULL) != -1);
+
+    if (supervisor->control_fd != -1) {
+      close(supervisor->control_fd);
+    }
+    for (u32 i = 0; i < supervisor->workers_count; i++) {
+      if (i != worker_index) {
+        close(supervisor->listen_fds[i]);
+      }
+    }
+
+    const int listen_fd = supervisor->listen_fds[worker_index];
+    Server_config config = supervisor->config;
+    config.stats = &supervisor->stats[worker_index];
+
+    // Pin before picking the CPU for the listener.
+    server_pin_to_cpu(worker_index);
+    server_listener_prefer_current_cpu(listen_fd);
+    supervisor->loop(listen_fd, config);
+    exit(0);
+  }
+
+  return pid;
+}
+
+// Take over the listeners of the server currently owning the control socket
+// at `path`, if any. Returns the connection to it, on which to acknowledge
+// once the listeners are being served, or -1 if there is no such server.
+// Its Unix listener, if any, comes last, after the `count` TCP ones.
+__attribute__((warn_unused_result)) static int
+server_handoff_receive(const char *_Nonnull path, int *_Nonnull listen_fds,
+                       u32 *_Nonnull listen_fds_count,
+                       int *_Nonnull unix_listen_fd) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  pg_assert(strlen(path) < sizeof(addr.sun_path));
+  memcpy(addr.sun_path, path, strlen(path));
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  pg_assert(fd != -1);
+  if (connect(fd, (const void *)&addr, sizeof(addr)) == -1) {
+    // Stale or missing socket: nothing to take over.
+    pg_assert(errno == ENOENT || errno == ECONNREFUSED);
+    close(fd);
+    return -1;
+  }
+
+  u32 count = 0;
+  struct iovec iov = {.iov_base = &count, .iov_len = sizeof(count)};
+  union {
+    struct cmsghdr align;
+    u8 buf[CMSG_SPACE(sizeof(int) * (SERVER_LISTENERS_MAX + 1))];
+  } control = {0};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(count)) {
+    fprintf(stderr, "Failed to receive the listeners from %s: %s\n", path,
+            strerror(errno));
+    exit(1);
+  }
+
+  const struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&msg);
+  pg_assert(cmsg != NULL);
+  pg_assert(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS);
+  pg_assert(!(msg.msg_flags & MSG_CTRUNC));
+  pg_assert(0 < count && count <= SERVER_LISTENERS_MAX);
+  const bool has_unix = cmsg->cmsg_len == CMSG_LEN(sizeof(int) * (count + 1));
+  pg_assert(has_unix || cmsg->cmsg_len == CMSG_LEN(sizeof(int) * count));
+
+  memcpy(listen_fds, CMSG_DATA(cmsg), sizeof(int) * count);
+  *listen_fds_count = count;
+  *unix_listen_fd = -1;
+  if (has_unix) {
+    memcpy(unix_listen_fd, CMSG_DATA(cmsg) + sizeof(int) * count, sizeof(int));
+  }
+  return fd;
+}
+
+// Hand the listeners over to the next server connecting to the control
+// socket. Returns true once it acknowledged serving them.
+__attribute__((warn_unused_result)) static bool
+server_handoff_send(const Server_supervisor *_Nonnull supervisor) {
+  const int fd = accept4(supervisor->control_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd == -1)
+    return false;
+
+  // Do not hang on a next server which fails to start.
+  const struct timeval timeout = {.tv_sec = 10};
+  pg_unused(
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+
+  const u32 count = supervisor->workers_count;
+  const int unix_listen_fd = supervisor->config.unix_listen_fd;
+  const u32 fds_count = count + (unix_listen_fd != -1);
+  struct iovec iov = {.iov_base = (void *)&count, .iov_len = sizeof(count)};
+  union {
+    struct cmsghdr align;
+    u8 buf[CMSG_SPACE(sizeof(int) * (SERVER_LISTENERS_MAX + 1))];
+  } control = {0};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = CMSG_SPACE(sizeof(int) * fds_count),
+  };
+  struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds_count);
+  memcpy(CMSG_DATA(cmsg), supervisor->listen_fds, sizeof(int) * count);
+  if (unix_listen_fd != -1) {
+    memcpy(CMSG_DATA(cmsg) + sizeof(int) * count, &unix_listen_fd,
+           sizeof(int));
+  }
+
+  u8 ack = 0;
+  const isize read_n =
+      sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(count) ? read(fd, &ack, 1) : -1;
+  const int err = errno;
+  close(fd);
+
+  if (read_n != 1) {
+    fprintf(stderr, "Failed to hand the listeners over: %s\n",
+            read_n == 0 ? "the next server exited" : strerror(err));
+    return false;
+  }
+  return true;
+}
+
+// Listen for the next server on the control socket at `path`, replacing the
+// one of the previous server if any.
+__attribute__((warn_unused_result)) static int
+server_control_listen(const char *_Nonnull path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  pg_assert(strlen(path) < sizeof(addr.sun_path));
+  memcpy(addr.sun_path, path, strlen(path));
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  pg_assert(fd != -1);
+  if (unlink(path) == -1) {
+    pg_assert(errno == ENOENT);
+  }
+  if (bind(fd, (const void *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "Failed to bind(2) %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  pg_assert(listen(fd, 1) == 0);
+  return fd;
+}
+
+static void server_supervisor_print_stats(Server_supervisor supervisor) {
+  Server_stats total = {0};
+  for (u32 i = 0; i < supervisor.workers_count; i++) {
+    const Server_stats worker = server_stats_load(&supervisor.stats[i]);
+    total.connections_accepted += worker.connections_accepted;
+    total.connections_shed += worker.connections_shed;
+    total.requests_handled += worker.requests_handled;
+    total.requests_shed += worker.requests_shed;
+    total.connections_open += worker.connections_open;
+    total.inflight_requests += worker.inflight_requests;
+    total.queued_bytes += worker.queued_bytes;
+  }
+  server_stats_print("total", total);
+}
+
+// Stop accepting, in this process and in the workers which then exit once
+// their connections are served. The listeners live on in the next server, if
+// any.
+static void server_supervisor_drain_start(Server_supervisor *_Nonnull
+                                              supervisor) {
+  supervisor->draining = true;
+
+  for (u32 i = 0; i < supervisor->workers_count; i++) {
+    if (supervisor->pids[i] != -1) {
+      pg_unused(kill(supervisor->pids[i], SIGTERM));
+    }
+    close(supervisor->listen_fds[i]);
+  }
+  if (supervisor->config.unix_listen_fd != -1) {
+    close(supervisor->config.unix_listen_fd);
+    supervisor->config.unix_listen_fd = -1;
+  }
+
+  if (supervisor->control_fd != -1) {
+    close(supervisor->control_fd);
+    supervisor->control_fd = -1;
+  }
+}
+
+static void server_supervisor_signal_handler(int signo) {
+  pg_unused(signo); // Only there to interrupt ppoll(2).
+}
+
+// Spawn long-lived workers, each with its own SO_REUSEPORT listener so that
+// the kernel balances incoming connections between them without a shared
+// accept queue. Workers which die are respawned. The limits of `config`
+// apply to each worker.
+//
+// With a `unix_path`, the workers also share a listener on this Unix socket.
+//
+// With a `control_path`, the listeners are taken over from the server
+// running with the same control socket, if any, so that upgrading to a new
+// binary is done by simply starting it: the previous server hands its
+// listeners over (along with their pending connections) and drains. The
+// workers count is then the one of the previous server, and its Unix
+// listener is kept if there is still a `unix_path`.
+//
+// On SIGTERM the workers drain, and this returns once they all exited.
+static void server_run_workers(u16 port, u32 workers_count, Server_loop loop,
+                               Server_config config,
+                               const char *_Nullable unix_path,
+                               const char *_Nullable control_path) {
+  pg_assert(0 < workers_count && workers_count <= SERVER_LISTENERS_MAX);
+
+  Server_supervisor supervisor = {
+      .workers_count = workers_count,
+      .control_fd = -1,
+      .loop = loop,
+      .config = config,
+  };
+
+  // Only let signals in while waiting, so that none is missed.
+  sigset_t handled = {0};
+  sigemptyset(&handled);
+  sigaddset(&handled, SIGCHLD);
+  sigaddset(&handled, SIGTERM);
+  sigaddset(&handled, SIGUSR1);
+  sigset_t wait_mask = {0};
+  pg_assert(sigprocmask(SIG_BLOCK, &handled, &wait_mask) != -1);
+
+  const struct sigaction chld_action = {
+      .sa_handler = server_supervisor_signal_handler};
+  pg_assert(sigaction(SIGCHLD, &chld_action, NULL) != -1);
+  server_drain_install_signal_handler();
+
+  int unix_listen_fd = -1;
+  const int handoff_fd =
+      control_path ? server_handoff_receive(
+                         control_path, supervisor.listen_fds,
+                         &supervisor.workers_count, &unix_listen_fd)
+                   : -1;
+  if (handoff_fd != -1) {
+    fprintf(stderr, "Took over %u listeners from the previous server\n",
+            supervisor.workers_count + (unix_listen_fd != -1));
+  } else {
+    for (u32 i = 0; i < supervisor.workers_count; i++) {
+      supervisor.listen_fds[i] = server_listen_tcp(port);
+    }
+  }
+  if (unix_listen_fd != -1 && !unix_path) {
+    close(unix_listen_fd);
+    unix_listen_fd = -1;
+  } else if (unix_listen_fd == -1 && unix_path) {
+    unix_listen_fd = server_listen_unix(unix_path);
+  }
+  supervisor.config.unix_listen_fd = unix_listen_fd;
+
+  supervisor.stats = mmap(NULL, supervisor.workers_count * sizeof(Server_stats),
+                          PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED,
+                          -1, 0);
+  pg_assert(supervisor.stats != MAP_FAILED);
+
+  for (u32 i = 0; i < supervisor.workers_count; i++) {
+    supervisor.pids[i] = server_spawn_worker(&supervisor, i);
+    pg_assert(supervisor.pids[i] != -1);
+  }
+
+  if (handoff_fd != -1) { // The previous server can drain now.
+    pg_unused(write(handoff_fd, "", 1));
+    close(handoff_fd);
+  }
+  if (control_path) {
+    supervisor.control_fd = server_control_listen(control_path);
+  }
+
+  for (;;) {
+    int status = 0;
+    pid_t pid = 0;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (u32 i = 0; i < supervisor.workers_count; i++) {
+        if (supervisor.pids[i] != pid)
+          continue;
+
+        if (supervisor.draining) {
+          supervisor.pids[i] = -1;
+          break;
+        }
+
+        fprintf(stderr,
+                "Worker %u (pid=%d) exited with status %d, respawning\n", i,
+                pid, status);
+        supervisor.pids[i] = server_spawn_worker(&supervisor, i);
+        break;
+      }
+    }
+
+    u32 alive_count = 0;
+    bool respawn_failed = false;
+    for (u32 i = 0; i < supervisor.workers_count; i++) {
+      alive_count += supervisor.pids[i] != -1;
+      respawn_failed |= supervisor.pids[i] == -1 && !supervisor.draining;
+    }
+    if (supervisor.draining && alive_count == 0)
+      return;
+
+    if (server_stats_requested) {
+      server_stats_requested = 0;
+      server_supervisor_print_stats(supervisor);
+    }
+
+    if (server_drain_requested && !supervisor.draining) {
+      server_supervisor_drain_start(&supervisor);
+      continue;
+    }
+
+    struct pollfd control = {.fd = supervisor.control_fd, .events = POLLIN};
+    // Retry failed spawns every second.
+    const struct timespec retry_timeout = {.tv_sec = 1};
+    const int res =
+        ppoll(&control, supervisor.control_fd != -1 ? 1 : 0,
+              respawn_failed ? &retry_timeout : NULL, &wait_mask);
+    if (res == -1) {
+      pg_assert(errno == EINTR);
+      continue;
+    }
+
+    if (respawn_failed) {
+      for (u32 i = 0; i < supervisor.workers_count; i++) {
+        if (supervisor.pids[i] == -1) {
+          supervisor.pids[i] = server_spawn_worker(&supervisor, i);
+        }
+      }
+    }
+
+    if ((control.revents & POLLIN) && server_handoff_send(&supervisor)) {
+      fprintf(stderr, "Handed the listeners over, draining\n");
+      server_supervisor_drain_start(&supervisor);
+    }
+  }
+}
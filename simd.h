@@ -0,0 +1,38 @@
+#pragma once
+
+#include "arena.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Instruction sets the vectorized kernels can use. Kernels are compiled with
+// the `target` attribute, so that one binary runs on any x86-64 CPU and picks
+// the best kernel at runtime.
+typedef enum {
+  SIMD_LEVEL_SCALAR,
+  SIMD_LEVEL_SSE42,
+  SIMD_LEVEL_AVX2,
+} Simd_level;
+
+__attribute__((warn_unused_result)) static Simd_level simd_level_detect(void) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return SIMD_LEVEL_AVX2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return SIMD_LEVEL_SSE42;
+#endif
+  return SIMD_LEVEL_SCALAR;
+}
+
+// Best level supported by this CPU, detected once.
+__attribute__((warn_unused_result)) static Simd_level simd_level(void) {
+  static bool detected = false;
+  static Simd_level level = SIMD_LEVEL_SCALAR;
+  if (!detected) {
+    level = simd_level_detect();
+    detected = true;
+  }
+  return level;
+}
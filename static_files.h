@@ -0,0 +1,686 @@
+#pragma once
+
+#include "arena.h"
+#include "http.h"
+#include "str.h"
+#include "timer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// --------------------------- Open file cache
+
+// Files served recently stay open, with their metadata, so that serving them
+// again costs no open(2). The open file is checked with fstat(2) on every use,
+// since sending past a truncation would send less than the length announced.
+// Paths are checked against the file system, for files replaced or deleted,
+// at most every `FILE_CACHE_VALID_MS`, like nginx's `open_file_cache`.
+//
+// Responses hold a reference on the entry of the file they send, released once
+// sent: entries in use are never evicted, and entries gone stale while in use
+// are only closed once released. The unused entries form an LRU list, its tail
+// being evicted when the cache is full.
+
+#define FILE_CACHE_ENTRIES_MAX 1024U
+#define FILE_CACHE_BUCKETS 2048U // Must be a power of two.
+#define FILE_CACHE_PATH_MAX 1024U
+
+static const u64 FILE_CACHE_VALID_MS = 1000;
+
+struct File_cache_entry {
+  // Hash chain, `hash_pprev` being NULL when not in the table.
+  File_cache_entry *_Nullable hash_next;
+  File_cache_entry *_Nullable *_Nullable hash_pprev;
+  // LRU list, only for entries not in use.
+  File_cache_entry *_Nullable lru_prev;
+  File_cache_entry *_Nullable lru_next;
+  // Whole file, mapped on first use by backends which cannot sendfile(2).
+  u8 *_Nullable mapping;
+  u64 size;
+  u64 checked_ms;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int fd;
+  // Responses referring to the entry.
+  u32 refs;
+  u32 hash;
+  u32 path_len;
+  u8 etag_len;
+  u8 last_modified_len;
+  pg_pad(6);
+  char etag[48];
+  char last_modified[32];
+  u8 path[FILE_CACHE_PATH_MAX];
+};
+
+typedef struct {
+  File_cache_entry *_Nullable buckets[FILE_CACHE_BUCKETS];
+  // Most recently used first.
+  File_cache_entry *_Nullable lru_head;
+  File_cache_entry *_Nullable lru_tail;
+  // Closed entries, chained by `hash_next`.
+  File_cache_entry *_Nullable free_list;
+  File_cache_entry *_Nullable entries;
+  u32 entries_len;
+  pg_pad(4);
+} File_cache;
+
+// One per process: workers do not share their file descriptors.
+static File_cache static_files_cache = {0};
+
+__attribute__((warn_unused_result)) static u32 file_cache_hash(Str path) {
+  u32 hash = 2166136261U;
+  for (usize i = 0; i < path.len; i++) {
+    hash ^= path.data[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+static void file_cache_lru_unlink(File_cache *_Nonnull cache,
+                                  File_cache_entry *_Nonnull entry) {
+  if (entry->lru_prev) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    cache->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    cache->lru_tail = entry->lru_prev;
+  }
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void file_cache_lru_push(File_cache *_Nonnull cache,
+                                File_cache_entry *_Nonnull entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head) {
+    cache->lru_head->lru_prev = entry;
+  } else {
+    cache->lru_tail = entry;
+  }
+  cache->lru_head = entry;
+}
+
+static void file_cache_hash_unlink(File_cache_entry *_Nonnull entry) {
+  if (entry->hash_pprev == NULL)
+    return;
+
+  *entry->hash_pprev = entry->hash_next;
+  if (entry->hash_next) {
+    entry->hash_next->hash_pprev = entry->hash_pprev;
+  }
+  entry->hash_next = NULL;
+  entry->hash_pprev = NULL;
+}
+
+// Close an entry nothing refers to, and make it available again.
+static void file_cache_entry_free(File_cache *_Nonnull cache,
+                                  File_cache_entry *_Nonnull entry) {
+  pg_assert(entry->refs == 0);
+  pg_assert(entry->hash_pprev == NULL);
+
+  if (entry->mapping) {
+    munmap(entry->mapping, entry->size);
+  }
+  close(entry->fd);
+  entry->fd = -1;
+  entry->mapping = NULL;
+
+  entry->hash_next = cache->free_list;
+  cache->free_list = entry;
+}
+
+// Remove an entry from the lookups: it is closed right away if unused,
+// otherwise on its last release.
+static void file_cache_entry_invalidate(File_cache *_Nonnull cache,
+                                        File_cache_entry *_Nonnull entry) {
+  file_cache_hash_unlink(entry);
+  if (entry->refs > 0)
+    return;
+
+  file_cache_lru_unlink(cache, entry);
+  file_cache_entry_free(cache, entry);
+}
+
+__attribute__((warn_unused_result)) static File_cache_entry *_Nullable
+file_cache_entry_alloc(File_cache *_Nonnull cache) {
+  if (cache->entries == NULL) {
+    cache->entries =
+        mmap(NULL, FILE_CACHE_ENTRIES_MAX * sizeof(File_cache_entry),
+             PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    pg_assert(cache->entries != MAP_FAILED);
+  }
+
+  if (cache->free_list) {
+    File_cache_entry *const entry = cache->free_list;
+    cache->free_list = entry->hash_next;
+    return entry;
+  }
+  if (cache->entries_len < FILE_CACHE_ENTRIES_MAX) {
+    return &cache->entries[cache->entries_len++];
+  }
+  if (cache->lru_tail) { // Evict the least recently used.
+    File_cache_entry *const entry = cache->lru_tail;
+    file_cache_entry_invalidate(cache, entry);
+    pg_assert(cache->free_list == entry);
+    cache->free_list = entry->hash_next;
+    return entry;
+  }
+
+  return NULL; // All in use.
+}
+
+static void
+file_cache_entry_format_validators(File_cache_entry *_Nonnull entry) {
+  // Same shape as nginx's, from the modification time and size.
+  entry->etag_len = (u8)snprintf(entry->etag, sizeof(entry->etag),
+                                 "\"%lx-%lx\"", (u64)entry->mtime.tv_sec,
+                                 entry->size);
+
+  const time_t mtime = entry->mtime.tv_sec;
+  struct tm tm = {0};
+  pg_assert(gmtime_r(&mtime, &tm) != NULL);
+  entry->last_modified_len =
+      (u8)strftime(entry->last_modified, sizeof(entry->last_modified),
+                   "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// Look up or open the regular file at `path`, taking a reference on it, to be
+// released with `file_cache_release`. Returns NULL with `errno` set on error:
+// ENOENT if it is not a regular file, ENAMETOOLONG if the path is too long to
+// be cached and ENFILE if all the entries are in use.
+__attribute__((warn_unused_result)) static File_cache_entry *_Nullable
+file_cache_acquire(File_cache *_Nonnull cache, Str path, u64 now_ms) {
+  if (path.len >= FILE_CACHE_PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  char path_c[FILE_CACHE_PATH_MAX];
+  memcpy(path_c, path.data, path.len);
+  path_c[path.len] = 0;
+
+  const u32 hash = file_cache_hash(path);
+  File_cache_entry **const bucket =
+      &cache->buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+
+  File_cache_entry *entry = *bucket;
+  while (entry != NULL &&
+         !(entry->hash == hash && entry->path_len == path.len &&
+           memcmp(entry->path, path.data, path.len) == 0)) {
+    entry = entry->hash_next;
+  }
+
+  struct stat st = {0};
+  if (entry != NULL) {
+    // Modified since opened.
+    bool stale = fstat(entry->fd, &st) == -1 ||
+                 (u64)st.st_size != entry->size ||
+                 st.st_mtim.tv_sec != entry->mtime.tv_sec ||
+                 st.st_mtim.tv_nsec != entry->mtime.tv_nsec;
+    // Replaced or deleted since opened.
+    if (!stale && now_ms >= entry->checked_ms + FILE_CACHE_VALID_MS) {
+      stale = stat(path_c, &st) == -1 || st.st_dev != entry->dev ||
+              st.st_ino != entry->ino;
+      entry->checked_ms = now_ms;
+    }
+    if (stale) {
+      file_cache_entry_invalidate(cache, entry);
+      entry = NULL;
+    }
+  }
+
+  if (entry != NULL) {
+    if (entry->refs == 0) {
+      file_cache_lru_unlink(cache, entry);
+    }
+    entry->refs += 1;
+    return entry;
+  }
+
+  const int fd = open(path_c, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    errno = ENOENT;
+    return NULL;
+  }
+
+  entry = file_cache_entry_alloc(cache);
+  if (entry == NULL) {
+    close(fd);
+    errno = ENFILE;
+    return NULL;
+  }
+
+  *entry = (File_cache_entry){
+      .size = (u64)st.st_size,
+      .checked_ms = now_ms,
+      .dev = st.st_dev,
+      .ino = st.st_ino,
+      .mtime = st.st_mtim,
+      .fd = fd,
+      .refs = 1,
+      .hash = hash,
+      .path_len = (u32)path.len,
+  };
+  memcpy(entry->path, path.data, path.len);
+  file_cache_entry_format_validators(entry);
+
+  entry->hash_next = *bucket;
+  if (*bucket) {
+    (*bucket)->hash_pprev = &entry->hash_next;
+  }
+  entry->hash_pprev = bucket;
+  *bucket = entry;
+
+  return entry;
+}
+
+static void file_cache_release(File_cache *_Nonnull cache,
+                               File_cache_entry *_Nonnull entry) {
+  pg_assert(entry->refs > 0);
+  entry->refs -= 1;
+  if (entry->refs > 0)
+    return;
+
+  if (entry->hash_pprev == NULL) { // Invalidated while in use.
+    file_cache_entry_free(cache, entry);
+  } else {
+    file_cache_lru_push(cache, entry);
+  }
+}
+
+// Another reference on an entry already held, e.g. for each part of the file
+// sent separately.
+static void file_cache_retain(File_cache_entry *_Nonnull entry) {
+  pg_assert(entry->refs > 0);
+  entry->refs += 1;
+}
+
+// The whole file in memory, for backends which send from memory.
+__attribute__((warn_unused_result)) static u8 *_Nullable
+file_cache_entry_map(File_cache_entry *_Nonnull entry) {
+  if (entry->mapping == NULL && entry->size > 0) {
+    void *const mapping =
+        mmap(NULL, entry->size, PROT_READ, MAP_SHARED, entry->fd, 0);
+    pg_assert(mapping != MAP_FAILED);
+    entry->mapping = mapping;
+  }
+  return entry->mapping;
+}
+
+// --------------------------- Static files
+
+__attribute__((warn_unused_result)) static Str
+static_files_content_type(Str path) {
+  static const struct {
+    char *_Nonnull extension;
+    char *_Nonnull content_type;
+  } content_types[] = {
+      {".html", "text/html; charset=utf-8"},
+      {".css", "text/css; charset=utf-8"},
+      {".js", "text/javascript; charset=utf-8"},
+      {".json", "application/json"},
+      {".txt", "text/plain; charset=utf-8"},
+      {".svg", "image/svg+xml"},
+      {".png", "image/png"},
+      {".jpg", "image/jpeg"},
+      {".jpeg", "image/jpeg"},
+      {".gif", "image/gif"},
+      {".webp", "image/webp"},
+      {".ico", "image/x-icon"},
+      {".woff2", "font/woff2"},
+      {".wasm", "application/wasm"},
+      {".pdf", "application/pdf"},
+  };
+
+  for (u64 i = 0; i < carray_count(content_types); i++) {
+    if (str_ends_with_c(path, content_types[i].extension))
+      return str_from_c(content_types[i].content_type);
+  }
+  return str_from_c("application/octet-stream");
+}
+
+// Weak comparison of `If-None-Match` entity tags against ours.
+__attribute__((warn_unused_result)) static bool
+static_files_etag_matches(Str if_none_match, Str etag) {
+  Str remaining = if_none_match;
+  while (!str_is_empty(remaining)) {
+    const Str_split_result split = str_split(remaining, ',');
+    Str candidate = str_trim_left(split.left, ' ');
+    while (candidate.len > 0 && candidate.data[candidate.len - 1] == ' ') {
+      candidate.len -= 1;
+    }
+    if (str_starts_with(candidate, str_from_c("W/"))) {
+      candidate = str_advance(candidate, 2);
+    }
+
+    if (str_eq_c(candidate, "*") || str_eq(candidate, etag))
+      return true;
+
+    remaining = split.found ? split.right : (Str){0};
+  }
+  return false;
+}
+
+// Parse an HTTP date in the preferred format, e.g.
+// `Sun, 06 Nov 1994 08:49:37 GMT`. Returns -1 when invalid.
+__attribute__((warn_unused_result)) static i64 static_files_parse_date(Str s) {
+  char date_c[64] = {0};
+  if (s.len >= sizeof(date_c))
+    return -1;
+  memcpy(date_c, s.data, s.len);
+
+  struct tm tm = {0};
+  const char *const end = strptime(date_c, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != 0)
+    return -1;
+
+  return (i64)timegm(&tm);
+}
+
+typedef enum {
+  STATIC_FILES_RANGE_NONE,
+  STATIC_FILES_RANGE_OK,
+  STATIC_FILES_RANGE_UNSATISFIABLE,
+} Static_files_range;
+
+// Parse a single byte range, e.g. `bytes=0-99`, `bytes=100-` or `bytes=-100`,
+// into the offset and length of the part of a `size` bytes file to send.
+// Multiple ranges and invalid ones are ignored: the whole file is sent.
+__attribute__((warn_unused_result)) static Static_files_range
+static_files_parse_range(Str range, u64 size, u64 *_Nonnull offset,
+                         u64 *_Nonnull len) {
+  if (!str_starts_with(range, str_from_c("bytes=")))
+    return STATIC_FILES_RANGE_NONE;
+  range = str_advance(range, 6);
+
+  const Str_split_result split = str_split(range, '-');
+  if (!split.found || str_contains_element(range, ','))
+    return STATIC_FILES_RANGE_NONE;
+
+  const Str first = split.left, last = split.right;
+  for (usize i = 0; i < first.len; i++) {
+    if (!char_is_digit(first.data[i]))
+      return STATIC_FILES_RANGE_NONE;
+  }
+  for (usize i = 0; i < last.len; i++) {
+    if (!char_is_digit(last.data[i]))
+      return STATIC_FILES_RANGE_NONE;
+  }
+  // Too many digits to fit.
+  if (first.len > 19 || last.len > 19)
+    return STATIC_FILES_RANGE_NONE;
+
+  if (str_is_empty(first)) { // Suffix.
+    if (str_is_empty(last))
+      return STATIC_FILES_RANGE_NONE;
+
+    const u64 suffix_len = str_to_u64(last);
+    if (suffix_len == 0 || size == 0)
+      return STATIC_FILES_RANGE_UNSATISFIABLE;
+
+    *len = pg_min(suffix_len, size);
+    *offset = size - *len;
+    return STATIC_FILES_RANGE_OK;
+  }
+
+  const u64 start = str_to_u64(first);
+  if (start >= size)
+    return STATIC_FILES_RANGE_UNSATISFIABLE;
+
+  u64 end = size - 1;
+  if (!str_is_empty(last)) {
+    end = pg_min(str_to_u64(last), size - 1);
+    if (end < start)
+      return STATIC_FILES_RANGE_NONE;
+  }
+
+  *offset = start;
+  *len = end - start + 1;
+  return STATIC_FILES_RANGE_OK;
+}
+
+// Serve the file `root`/`path` for a GET or HEAD request, with conditional
+// and range requests. The body is not copied: the response refers to the open
+// file instead.
+__attribute__((warn_unused_result)) static Response
+static_files_serve(Str root, Str path, Request req, Arena *_Nonnull arena) {
+  // Names as on disk, e.g. `my%20file.png` is `my file.png`.
+  path = http_percent_decode(path, false, arena);
+
+  // No escaping the root, nor cutting the path short, once decoded.
+  if (!str_is_empty(path) && memchr(path.data, 0, path.len) != NULL)
+    return (Response){.status = 404};
+  for (Str remaining = path; !str_is_empty(remaining);) {
+    const Str_split_result split = str_split(remaining, '/');
+    if (str_eq_c(split.left, ".."))
+      return (Response){.status = 404};
+    remaining = split.found ? split.right : (Str){0};
+  }
+
+  Str_builder fs_path = sb_new(root.len + path.len + 16, arena);
+  fs_path = sb_append(fs_path, root, arena);
+  fs_path = sb_append_char(fs_path, '/', arena);
+  fs_path = sb_append(fs_path, path, arena);
+  if (str_is_empty(path) || str_ends_with_c(path, "/")) {
+    fs_path = sb_append_c(fs_path, "index.html", arena);
+  }
+
+  File_cache_entry *const entry =
+      file_cache_acquire(&static_files_cache, sb_build(fs_path),
+                         timer_now_ms());
+  if (entry == NULL) {
+    return (Response){.status = errno == ENFILE ? 503 : 404};
+  }
+
+  const Str etag = {.data = (u8 *)entry->etag, .len = entry->etag_len};
+  const Str last_modified = {.data = (u8 *)entry->last_modified,
+                             .len = entry->last_modified_len};
+
+  Response res = {.status = 200};
+  http_headers_add(&res.headers, str_from_c("ETag"), etag, arena);
+  http_headers_add(&res.headers, str_from_c("Last-Modified"), last_modified,
+                   arena);
+
+  // `If-None-Match` takes precedence over `If-Modified-Since`.
+  const Header *const if_none_match =
+      http_find_header(req.headers, str_from_c("If-None-Match"));
+  const Header *const if_modified_since =
+      http_find_header(req.headers, str_from_c("If-Modified-Since"));
+  bool not_modified = false;
+  if (if_none_match) {
+    not_modified = static_files_etag_matches(if_none_match->value, etag);
+  } else if (if_modified_since) {
+    const i64 since = static_files_parse_date(if_modified_since->value);
+    not_modified = since != -1 && entry->mtime.tv_sec <= since;
+  }
+  if (not_modified) {
+    file_cache_release(&static_files_cache, entry);
+    res.status = 304;
+    return res;
+  }
+
+  http_headers_add(&res.headers, str_from_c("Content-Type"),
+                   static_files_content_type(sb_build(fs_path)), arena);
+  http_headers_add(&res.headers, str_from_c("Accept-Ranges"),
+                   str_from_c("bytes"), arena);
+  res.file = entry;
+  res.file_offset = 0;
+  res.file_len = entry->size;
+
+  const Header *const range =
+      http_find_header(req.headers, str_from_c("Range"));
+  // Only honored if the client has the same version of the file.
+  const Header *const if_range =
+      http_find_header(req.headers, str_from_c("If-Range"));
+  if (range == NULL ||
+      (if_range && !str_eq(if_range->value, etag) &&
+       !str_eq(if_range->value, last_modified)))
+    return res;
+
+  u64 offset = 0, len = 0;
+  switch (static_files_parse_range(range->value, entry->size, &offset, &len)) {
+  case STATIC_FILES_RANGE_NONE:
+    return res;
+  case STATIC_FILES_RANGE_UNSATISFIABLE: {
+    Str_builder content_range = sb_new(32, arena);
+    content_range = sb_append_c(content_range, "bytes */", arena);
+    content_range = sb_append_u64(content_range, entry->size, arena);
+
+    file_cache_release(&static_files_cache, entry);
+    Response unsatisfiable = {.status = 416};
+    http_headers_add(&unsatisfiable.headers, str_from_c("Content-Range"),
+                     sb_build(content_range), arena);
+    return unsatisfiable;
+  }
+  case STATIC_FILES_RANGE_OK: {
+    Str_builder content_range = sb_new(64, arena);
+    content_range = sb_append_c(content_range, "bytes ", arena);
+    content_range = sb_append_u64(content_range, offset, arena);
+    content_range = sb_append_char(content_range, '-', arena);
+    content_range = sb_append_u64(content_range, offset + len - 1, arena);
+    content_range = sb_append_char(content_range, '/', arena);
+    content_range = sb_append_u64(content_range, entry->size, arena);
+
+    res.status = 206;
+    http_headers_add(&res.headers, str_from_c("Content-Range"),
+                     sb_build(content_range), arena);
+    res.file_offset = offset;
+    res.file_len = len;
+    return res;
+  }
+  }
+  pg_assert(0 && "unreachable");
+}
+
+static void test_static_files(void) {
+  Arena arena = arena_new(64 * KiB, NULL);
+
+  char dir_c[] = "/tmp/static_files_test_XXXXXX";
+  pg_assert(mkdtemp(dir_c) != NULL);
+  const Str dir = str_from_c(dir_c);
+
+  {
+    char *const file_path =
+        str_to_c(sb_build(sb_append_c(sb_clone(dir, &arena), "/a.txt", &arena)),
+                 &arena);
+    const int fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    pg_assert(fd != -1);
+    pg_assert(ut_write_all(fd, str_from_c("0123456789")) == 0);
+    close(fd);
+  }
+
+  Request req = {.method = HTTP_METHOD_GET};
+  Response res = static_files_serve(dir, str_from_c("a.txt"), req, &arena);
+  pg_assert(res.status == 200);
+  pg_assert(res.file != NULL && res.file_offset == 0 && res.file_len == 10);
+  const Header *const etag = http_find_header(res.headers, str_from_c("ETag"));
+  pg_assert(etag != NULL);
+  const Header *const last_modified =
+      http_find_header(res.headers, str_from_c("Last-Modified"));
+  pg_assert(last_modified != NULL);
+
+  // Cached.
+  File_cache_entry *const entry = res.file;
+  res = static_files_serve(dir, str_from_c("a.txt"), req, &arena);
+  pg_assert(res.file == entry && entry->refs == 2);
+  file_cache_release(&static_files_cache, entry);
+  file_cache_release(&static_files_cache, entry);
+
+  req.headers = (Http_headers){0};
+  http_headers_add(&req.headers, str_from_c("If-None-Match"), etag->value,
+                   &arena);
+  res = static_files_serve(dir, str_from_c("a.txt"), req, &arena);
+  pg_assert(res.status == 304 && res.file == NULL && entry->refs == 0);
+
+  req.headers = (Http_headers){0};
+  http_headers_add(&req.headers, str_from_c("If-Modified-Since"),
+                   last_modified->value, &arena);
+  res = static_files_serve(dir, str_from_c("a.txt"), req, &arena);
+  pg_assert(res.status == 304);
+
+  req.headers = (Http_headers){0};
+  http_headers_add(&req.headers, str_from_c("Range"), str_from_c("bytes=2-4"),
+                   &arena);
+  res = static_files_serve(dir, str_from_c("a.txt"), req, &arena);
+  pg_assert(res.status == 206 && res.file_offset == 2 && res.file_len == 3);
+  file_cache_release(&static_files_cache, res.file);
+
+  req.headers = (Http_headers){0};
+  http_headers_add(&req.headers, str_from_c("Range"), str_from_c("bytes=-4"),
+                   &arena);
+  res = static_files_serve(dir, str_from_c("a.txt"), req, &arena);
+  pg_assert(res.status == 206 && res.file_offset == 6 && res.file_len == 4);
+  file_cache_release(&static_files_cache, res.file);
+
+  req.headers = (Http_headers){0};
+  http_headers_add(&req.headers, str_from_c("Range"), str_from_c("bytes=10-"),
+                   &arena);
+  res = static_files_serve(dir, str_from_c("a.txt"), req, &arena);
+  pg_assert(res.status == 416 && res.file == NULL);
+
+  // Stale validator: the whole file.
+  http_headers_add(&req.headers, str_from_c("If-Range"), str_from_c("\"0-0\""),
+                   &arena);
+  res = static_files_serve(dir, str_from_c("a.txt"), req, &arena);
+  pg_assert(res.status == 200 && res.file_len == 10);
+  file_cache_release(&static_files_cache, res.file);
+
+  req.headers = (Http_headers){0};
+  res = static_files_serve(dir, str_from_c("../a.txt"), req, &arena);
+  pg_assert(res.status == 404);
+  res = static_files_serve(dir, str_from_c("b.txt"), req, &arena);
+  pg_assert(res.status == 404);
+  res = static_files_serve(dir, (Str){0}, req, &arena);
+  pg_assert(res.status == 404); // No index.
+
+  // Percent-decoded, and checked once decoded.
+  res = static_files_serve(dir, str_from_c("%2e%2e/a.txt"), req, &arena);
+  pg_assert(res.status == 404);
+  res = static_files_serve(dir, str_from_c("a.txt%00"), req, &arena);
+  pg_assert(res.status == 404);
+  {
+    char *const file_path = str_to_c(
+        sb_build(sb_append_c(sb_clone(dir, &arena), "/my file.txt", &arena)),
+        &arena);
+    const int fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    pg_assert(fd != -1);
+    close(fd);
+
+    res = static_files_serve(dir, str_from_c("my%20file.txt"), req, &arena);
+    pg_assert(res.status == 200 && res.file != NULL);
+    file_cache_release(&static_files_cache, res.file);
+    pg_assert(unlink(file_path) == 0);
+  }
+
+  // Picked up once the validity period passes.
+  file_cache_entry_invalidate(&static_files_cache, entry);
+  pg_assert(static_files_cache.free_list == entry);
+
+  char *const file_path =
+      str_to_c(sb_build(sb_append_c(sb_clone(dir, &arena), "/a.txt", &arena)),
+               &arena);
+
+  // Truncated while cached: noticed right away, not after the validity
+  // period, for the length announced to be the one sent.
+  res = static_files_serve(dir, str_from_c("a.txt"), req, &arena);
+  pg_assert(res.status == 200 && res.file_len == 10);
+  file_cache_release(&static_files_cache, res.file);
+  pg_assert(truncate(file_path, 4) == 0);
+  res = static_files_serve(dir, str_from_c("a.txt"), req, &arena);
+  pg_assert(res.status == 200 && res.file_len == 4);
+  file_cache_release(&static_files_cache, res.file);
+
+  pg_assert(unlink(file_path) == 0);
+  pg_assert(rmdir(dir_c) == 0);
+}
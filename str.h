@@ -163,6 +163,23 @@ __attribute__((warn_unused_result)) static bool str_eq_c(Str a,
   return str_eq(a, str_from_c(b));
 }
 
+__attribute__((warn_unused_result)) static u8 char_to_lower(u8 c) {
+  return ('A' <= c && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// ASCII only.
+__attribute__((warn_unused_result)) static bool str_eq_ignore_case(Str a,
+                                                                   Str b) {
+  if (a.len != b.len)
+    return false;
+
+  for (usize i = 0; i < a.len; i++) {
+    if (char_to_lower(a.data[i]) != char_to_lower(b.data[i]))
+      return false;
+  }
+  return true;
+}
+
 __attribute__((warn_unused_result)) static bool
 str_contains_element(Str haystack, u8 needle) {
   for (i64 i = 0; i < (i64)haystack.len - 1; i++) {
@@ -177,7 +194,7 @@ __attribute__((warn_unused_result)) static isize str_find(Str haystack,
   if (needle.len > haystack.len)
     return -1;
 
-  for (usize i = 0; i < haystack.len - needle.len; i++) {
+  for (usize i = 0; i <= haystack.len - needle.len; i++) {
     Str remaining = str_advance(haystack, i);
     if (str_starts_with(remaining, needle)) {
       return (isize)i;
@@ -186,6 +203,32 @@ __attribute__((warn_unused_result)) static isize str_find(Str haystack,
   return -1;
 }
 
+// Like `str_find`, for a haystack which grows between calls: `searched` bytes
+// at its start are known not to contain the start of `needle`, and are
+// skipped. On a miss, `searched` is advanced so that the next call only looks
+// at the bytes appended since, plus the last `needle.len - 1` ones.
+__attribute__((warn_unused_result)) static isize
+str_find_resume(Str haystack, Str needle, usize *_Nonnull searched) {
+  pg_assert(needle.len > 0);
+
+  usize i = *searched;
+  while (i + needle.len <= haystack.len) {
+    const u8 *const first =
+        memchr(haystack.data + i, needle.data[0], haystack.len - i);
+    if (first == NULL)
+      break;
+
+    i = (usize)(first - haystack.data);
+    if (str_starts_with(str_advance(haystack, i), needle))
+      return (isize)i;
+    i += 1;
+  }
+
+  if (haystack.len >= needle.len)
+    *searched = pg_max(*searched, haystack.len - needle.len + 1);
+  return -1;
+}
+
 __attribute__((warn_unused_result)) static Str str_trim_left(Str s, u8 c) {
   Str remaining = s;
   while (str_first(remaining) == c) {
@@ -255,6 +298,10 @@ sb_grow(Str_builder sb, usize more, Arena *_Nonnull arena) {
   // Optimization: if the current allocation is the last in the arena, do not
   // realloc, just bump the arena ptr.
   if (arena_is_ptr_last_allocation(arena, sb.data, sb.cap)) {
+    pg_assert(arena->start + (new_cap - sb.cap) <= arena->end);
+    // Zeroed like `arena_alloc` does: the arena may have been rewound over
+    // older data.
+    memset(arena->start, 0, new_cap - sb.cap);
     arena->start += new_cap - sb.cap;
     sb.cap = new_cap;
     return sb;
@@ -335,11 +382,79 @@ __attribute__((warn_unused_result)) static Str sb_build(Str_builder sb) {
   return (Str){.data = sb.data, .len = sb.len};
 }
 
+static const u64 u64_pow10[20] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+// "00" to "99".
+static const char u64_digit_pairs[200] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Number of decimal digits, without branching on the value: 1233 / 4096 is
+// about log10(2).
+__attribute__((warn_unused_result)) static u8 u64_digits_count(u64 n) {
+  const u32 log10_guess = ((64 - (u32)__builtin_clzll(n | 1)) * 1233) >> 12;
+  return (u8)(log10_guess + 1 - ((n | 1) < u64_pow10[log10_guess]));
+}
+
+// Write the `len` last decimal digits of `n` to `dst`, two at a time. Eight
+// digits are split off first so that the rest is in (faster) 32-bit
+// arithmetic.
+static void u64_write_digits(u64 n, u8 *_Nonnull dst, u8 len) {
+  u8 *it = dst + len;
+  while (it - dst > 8) {
+    u32 low = (u32)(n % 100000000);
+    n /= 100000000;
+    for (u64 i = 0; i < 4; i++) {
+      it -= 2;
+      memcpy(it, &u64_digit_pairs[(low % 100) * 2], 2);
+      low /= 100;
+    }
+  }
+
+  u32 rest = (u32)n;
+  while (it - dst >= 2) {
+    it -= 2;
+    memcpy(it, &u64_digit_pairs[(rest % 100) * 2], 2);
+    rest /= 100;
+  }
+  if (it != dst) {
+    *dst = (u8)('0' + rest % 10);
+  }
+}
+
 __attribute__((warn_unused_result)) static Str_builder
-sb_append_u64(Str_builder sb, usize n, Arena *_Nonnull arena) {
-  char tmp[25] = "";
-  snprintf(tmp, sizeof(tmp) - 1, "%lu", n);
-  return sb_append_c(sb, tmp, arena);
+sb_append_u64(Str_builder sb, u64 n, Arena *_Nonnull arena) {
+  const u8 len = u64_digits_count(n);
+  sb = sb_grow(sb, len, arena);
+  pg_assert(sb.data);
+
+  u64_write_digits(n, sb_end_c(sb), len);
+  sb.data[sb.len + len] = 0;
+  return sb_assume_appended_n(sb, len);
 }
 
 __attribute__((warn_unused_result)) static Str_builder
@@ -425,21 +540,6 @@ __attribute__((warn_unused_result)) static char *_Nonnull str_to_c(
   return c_str;
 }
 
-__attribute__((warn_unused_result)) static bool str_rcontains(Str haystack,
-                                                              Str needle) {
-  if (needle.len > haystack.len)
-    return false;
-
-  for (isize i = (isize)haystack.len - (isize)needle.len; i >= 0; i--) {
-    const Str to_search = str_advance(haystack, (usize)i);
-
-    if (str_starts_with(to_search, needle)) {
-      return true;
-    }
-  }
-  return false;
-}
-
 __attribute__((warn_unused_result)) static Read_result
 ut_file_read_all(char *_Nonnull path, Arena *_Nonnull arena) {
   const int fd = open(path, O_RDONLY);
@@ -465,13 +565,21 @@ ut_file_read_all(char *_Nonnull path, Arena *_Nonnull arena) {
   return res;
 }
 
+// Read until `needle` is received, growing `sb` as needed: if it does not end
+// within `max_len` bytes, fail with `EMSGSIZE`. Each read only searches the
+// bytes it brought.
 __attribute__((warn_unused_result)) static Read_result
-ut_read_from_fd_until(int fd, Str_builder sb, Str needle) {
+ut_read_from_fd_until(int fd, Str_builder sb, Str needle, usize max_len,
+                      Arena *_Nonnull arena) {
   pg_assert(fd > 0);
 
-  while (sb_space(sb) > 0) {
+  usize searched = 0;
+  for (;;) {
     pg_assert(sb.len <= sb.cap);
 
+    if (sb_space(sb) == 0)
+      sb = sb_grow(sb, pg_min(sb.cap, max_len + 1 - sb.len), arena);
+
     const i64 read_bytes = read(fd, sb_end_c(sb), sb_space(sb));
     if (read_bytes == -1)
       return (Read_result){.error = errno};
@@ -481,11 +589,12 @@ ut_read_from_fd_until(int fd, Str_builder sb, Str needle) {
     sb = sb_assume_appended_n(sb, (usize)read_bytes);
     pg_assert(sb.len <= sb.cap);
 
-    if (str_rcontains(sb_build(sb), needle))
+    const isize found = str_find_resume(sb_build(sb), needle, &searched);
+    if (found != -1 && (usize)found + needle.len <= max_len)
       return (Read_result){.content = sb_build(sb)};
+    if (found != -1 || sb.len > max_len)
+      return (Read_result){.error = EMSGSIZE};
   }
-
-  return (Read_result){.error = true};
 }
 
 __attribute__((warn_unused_result)) static Read_result
@@ -681,10 +790,12 @@ __attribute__((warn_unused_result)) static bool char_is_space(u8 c) {
 
 __attribute__((warn_unused_result)) static Str_builder
 sb_append_many(Str_builder sb, u8 c, usize count, Arena *_Nonnull arena) {
-  for (usize i = 0; i < count; i++) {
-    sb = sb_append_char(sb, c, arena);
-  }
-  return sb;
+  sb = sb_grow(sb, count, arena);
+  pg_assert(sb.data);
+
+  memset(sb_end_c(sb), c, count);
+  sb.data[sb.len + count] = 0;
+  return sb_assume_appended_n(sb, count);
 }
 
 __attribute__((warn_unused_result)) static usize str_to_u64(Str s) {
@@ -743,34 +854,49 @@ __attribute__((warn_unused_result)) static u8 hex_digit_to_u8(u8 c) {
   __builtin_unreachable();
 }
 
+// U+FFFD in place of a rune which is well formed but not valid: encoded with
+// more bytes than needed (overlong), a UTF-16 surrogate, or above U+10FFFF.
 __attribute__((warn_unused_result)) static Unicode_character
-utf8_replace_if_overlong(Unicode_character c) {
+utf8_replace_if_invalid(Unicode_character c) {
+  u32 code_point = 0;
+  u32 code_point_min = 0;
   switch (c.len) {
   case 1:
     return c;
   case 2:
-    if (c.data[0] == 0xc0)
-      return UNICODE_REPLACEMENT_CHARACTER;
-    return c;
+    code_point = (u32)(c.data[0] & 0x1f) << 6 | (c.data[1] & 0x3f);
+    code_point_min = 0x80;
+    break;
   case 3:
-    if (c.data[0] == 0xe0)
-      return UNICODE_REPLACEMENT_CHARACTER;
-    return c;
+    code_point = (u32)(c.data[0] & 0x0f) << 12 | (u32)(c.data[1] & 0x3f) << 6 |
+                 (c.data[2] & 0x3f);
+    code_point_min = 0x800;
+    break;
   case 4:
-    if (c.data[0] == 0xf0)
+    // Leads of 5 bytes and more, from before RFC 3629, are all above.
+    if (c.data[0] > 0xf4)
       return UNICODE_REPLACEMENT_CHARACTER;
-    return c;
+
+    code_point = (u32)(c.data[0] & 0x07) << 18 | (u32)(c.data[1] & 0x3f) << 12 |
+                 (u32)(c.data[2] & 0x3f) << 6 | (c.data[3] & 0x3f);
+    code_point_min = 0x10000;
+    break;
   default:
     pg_assert(0 && "unreachable");
   }
+
+  if (code_point < code_point_min || code_point > 0x10ffff ||
+      (0xd800 <= code_point && code_point <= 0xdfff))
+    return UNICODE_REPLACEMENT_CHARACTER;
+  return c;
 }
 
 __attribute__((warn_unused_result)) static Unicode_character u4_to_utf8(u32 c) {
-  if (c < 0x7f)
+  if (c <= 0x7f)
     return (Unicode_character){.data = {(u8)c}, .len = 1};
 
   if (c <= 0x7ff) {
-    return utf8_replace_if_overlong((Unicode_character){
+    return utf8_replace_if_invalid((Unicode_character){
         .data =
             {
                 [0] = 0xc0 | ((c >> 6) & 0x1f),
@@ -781,7 +907,7 @@ __attribute__((warn_unused_result)) static Unicode_character u4_to_utf8(u32 c) {
   }
 
   if (c <= 0xffff)
-    return utf8_replace_if_overlong((Unicode_character){
+    return utf8_replace_if_invalid((Unicode_character){
         .data =
             {
                 [0] = 0xe0 | ((c >> 12) & 0xf),
@@ -792,7 +918,7 @@ __attribute__((warn_unused_result)) static Unicode_character u4_to_utf8(u32 c) {
     });
 
   if (c <= 0x10ffff)
-    return utf8_replace_if_overlong((Unicode_character){
+    return utf8_replace_if_invalid((Unicode_character){
         .data =
             {
                 [0] = 0xf0 | ((c >> 18) & 0x7),
@@ -848,5 +974,5 @@ __attribute__((warn_unused_result)) static u8 utf8_rune_announced_length(u8 c) {
 }
 
 __attribute__((warn_unused_result)) static u8 utf8_is_continuation_byte(u8 c) {
-  return (c & 0x80) == 0x80;
+  return (c & 0xc0) == 0x80;
 }
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "arena.h"
+
+#include <time.h>
+
+// Hierarchical timer wheel (Varghese & Lauck): O(1) insertion and removal,
+// and expiration in amortized O(1) per timer. Timers are intrusive nodes
+// embedded in the objects they belong to.
+//
+// Level 0 has one slot per tick, level 1 one slot per 64 ticks, etc. A timer
+// is stored in the lowest level covering its remaining delay, and moves down
+// one level (cascades) when the wheel turns to the slot it is in.
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_SLOT_BITS)
+
+static const u64 TIMER_TICK_MS = 100;
+
+typedef struct Timer Timer;
+struct Timer {
+  // Doubly linked list with a pointer to the previous `next` field (or to the
+  // slot), so that the slots are plain pointers and the wheel can be copied
+  // while empty. `pprev` is NULL when the timer is not armed.
+  Timer *_Nullable next;
+  Timer *_Nullable *_Nullable pprev;
+  u64 expires_tick;
+};
+
+typedef struct {
+  Timer *_Nullable slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  u64 now_tick;
+  u64 armed_count;
+} Timer_wheel;
+
+__attribute__((warn_unused_result)) static u64 timer_now_ms(void) {
+  struct timespec ts = {0};
+  pg_assert(clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0);
+  return (u64)ts.tv_sec * 1000 + (u64)ts.tv_nsec / 1000000;
+}
+
+__attribute__((warn_unused_result)) static u64 timer_now_tick(void) {
+  return timer_now_ms() / TIMER_TICK_MS;
+}
+
+__attribute__((warn_unused_result)) static bool timer_is_armed(Timer timer) {
+  return timer.pprev != NULL;
+}
+
+static void timer_wheel_link(Timer_wheel *_Nonnull wheel,
+                             Timer *_Nonnull timer) {
+  // Already expired timers go in the current slot, visited first.
+  const u64 tick = pg_max(timer->expires_tick, wheel->now_tick);
+
+  // The lowest level where the expiration and the current tick only differ
+  // in the slot index: the slot is then visited (and cascaded) before the
+  // expiration. Timers too far away for the last level get cascaded again
+  // into it until they fit.
+  u32 level = 0;
+  while (level + 1 < TIMER_WHEEL_LEVELS &&
+         (tick >> (TIMER_WHEEL_SLOT_BITS * (level + 1))) !=
+             (wheel->now_tick >> (TIMER_WHEEL_SLOT_BITS * (level + 1)))) {
+    level += 1;
+  }
+  const u32 slot =
+      (u32)(tick >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+
+  Timer **const head = &wheel->slots[level][slot];
+  timer->next = *head;
+  if (*head != NULL) {
+    (*head)->pprev = &timer->next;
+  }
+  timer->pprev = head;
+  *head = timer;
+}
+
+static void timer_wheel_unlink(Timer *_Nonnull timer) {
+  pg_assert(timer_is_armed(*timer));
+
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+static void timer_wheel_remove(Timer_wheel *_Nonnull wheel,
+                               Timer *_Nonnull timer) {
+  if (!timer_is_armed(*timer))
+    return;
+
+  timer_wheel_unlink(timer);
+  pg_assert(wheel->armed_count > 0);
+  wheel->armed_count -= 1;
+}
+
+// (Re-)arm the timer to expire in `delay_ms`.
+static void timer_wheel_arm(Timer_wheel *_Nonnull wheel, Timer *_Nonnull timer,
+                            u64 delay_ms) {
+  timer_wheel_remove(wheel, timer);
+
+  timer->expires_tick =
+      wheel->now_tick + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  timer_wheel_link(wheel, timer);
+  wheel->armed_count += 1;
+}
+
+// Move the timers of the slots the wheel just turned to, one level down.
+static void timer_wheel_cascade(Timer_wheel *_Nonnull wheel) {
+  for (u32 level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    const u32 shift = TIMER_WHEEL_SLOT_BITS * level;
+    if ((wheel->now_tick & ((1UL << shift) - 1)) != 0)
+      return;
+
+    const u32 slot =
+        (u32)(wheel->now_tick >> shift) & (TIMER_WHEEL_SLOTS - 1);
+
+    // Detach the whole list first since timers may be relinked in the same
+    // slot.
+    Timer *it = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+
+    while (it != NULL) {
+      Timer *const next = it->next;
+      timer_wheel_link(wheel, it);
+      it = next;
+    }
+  }
+}
+
+// Return one timer which expired at or before `now_tick`, removed from the
+// wheel, or NULL when there is none left. To be called in a loop.
+__attribute__((warn_unused_result)) static Timer *_Nullable
+timer_wheel_expire(Timer_wheel *_Nonnull wheel, u64 now_tick) {
+  for (;;) {
+    Timer *const timer =
+        wheel->slots[0][wheel->now_tick & (TIMER_WHEEL_SLOTS - 1)];
+    if (timer != NULL) {
+      timer_wheel_remove(wheel, timer);
+      return timer;
+    }
+
+    if (wheel->now_tick >= now_tick)
+      return NULL;
+
+    if (wheel->armed_count == 0) { // Nothing to cascade nor expire.
+      wheel->now_tick = now_tick;
+      return NULL;
+    }
+
+    wheel->now_tick += 1;
+    timer_wheel_cascade(wheel);
+  }
+}
+
+static void test_timer_wheel(void) {
+  Timer_wheel wheel = {.now_tick = 1000};
+
+  Timer timers[6] = {0};
+  const u64 delays_ms[] = {0, 100, 6400, 500000, 30 * 1000, 400000};
+  for (u64 i = 0; i < carray_count(timers); i++) {
+    timer_wheel_arm(&wheel, &timers[i], delays_ms[i]);
+  }
+  // Disarmed timers never expire.
+  timer_wheel_remove(&wheel, &timers[4]);
+  pg_assert(!timer_is_armed(timers[4]));
+
+  pg_assert(timer_wheel_expire(&wheel, 1000) == &timers[0]);
+  pg_assert(timer_wheel_expire(&wheel, 1000) == NULL);
+
+  pg_assert(timer_wheel_expire(&wheel, 1001) == &timers[1]);
+  pg_assert(timer_wheel_expire(&wheel, 1063) == NULL);
+  pg_assert(timer_wheel_expire(&wheel, 1064) == &timers[2]);
+  pg_assert(timer_wheel_expire(&wheel, 1064) == NULL);
+
+  // Cascaded down from level 2, then level 1.
+  pg_assert(timer_wheel_expire(&wheel, 4999) == NULL);
+  pg_assert(timer_wheel_expire(&wheel, 5000) == &timers[5]);
+  pg_assert(timer_wheel_expire(&wheel, 5999) == NULL);
+  pg_assert(timer_is_armed(timers[3]));
+  pg_assert(timer_wheel_expire(&wheel, 1000000) == &timers[3]);
+  pg_assert(wheel.now_tick == 6000);
+  pg_assert(timer_wheel_expire(&wheel, 1000000) == NULL);
+  pg_assert(wheel.armed_count == 0);
+}
@@ -0,0 +1,542 @@
+#pragma once
+
+#include "arena.h"
+#include "server.h"
+#include "str.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+// io_uring backend, using the raw syscalls (no liburing):
+// - One multishot accept for the listener.
+// - recv(2) with buffers picked by the kernel from a registered buffer ring,
+//   copied in the connection input buffer and immediately recycled.
+// - The responses to all the pipelined requests received are sent with one
+//   sendmsg(2). On keep-alive connections the next requests are then
+//   received; otherwise the send is linked to the close(2) of the socket.
+//   There is no sendfile(2) operation: files are sent from a read-only
+//   mapping of the cached file instead, still without copying them.
+// - Connections past their deadline get their pending operation cancelled,
+//   which closes them through the usual error path. So do idle connections
+//   when draining, after the accept is cancelled.
+// All operations queued while processing a batch of completions are submitted
+// with a single io_uring_enter(2).
+
+static const u32 URING_ENTRIES = 4096;
+static const u32 URING_BUFFERS_COUNT = 1024; // Must be a power of two.
+static const u32 URING_BUFFER_LEN = 4 * KiB;
+static const u16 URING_BUFFER_GROUP = 0;
+
+// Stored in the low bits of `user_data`, the rest being the `Connection`
+// pointer, or for accepts whether the listener is the Unix one.
+typedef enum {
+  URING_OP_ACCEPT,
+  URING_OP_RECV,
+  URING_OP_SEND,
+  URING_OP_CLOSE,
+  URING_OP_CANCEL,
+} Uring_op;
+
+static const u64 URING_OP_MASK = 7;
+
+typedef struct {
+  int fd;
+  u32 sq_mask;
+  u32 sq_entries;
+  // Local copy of the submission queue tail, published to the kernel on
+  // submit.
+  u32 sq_tail;
+  u32 *_Nonnull sq_khead;
+  u32 *_Nonnull sq_ktail;
+  struct io_uring_sqe *_Nonnull sqes;
+  u32 *_Nonnull cq_khead;
+  u32 *_Nonnull cq_ktail;
+  struct io_uring_cqe *_Nonnull cqes;
+  u32 cq_mask;
+
+  u16 buffers_tail;
+  pg_pad(2);
+  struct io_uring_buf_ring *_Nonnull buffers_ring;
+  u8 *_Nonnull buffers;
+} Uring;
+
+typedef struct {
+  Server server;
+  Uring ring;
+} Uring_server;
+
+__attribute__((warn_unused_result)) static int
+uring_setup(u32 entries, struct io_uring_params *_Nonnull params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+__attribute__((warn_unused_result)) static int
+uring_enter(int fd, u32 to_submit, u32 min_complete, u32 flags,
+            struct io_uring_getevents_arg *_Nullable arg) {
+  if (arg != NULL) {
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, arg != NULL ? sizeof(*arg) : 0);
+}
+
+__attribute__((warn_unused_result)) static int
+uring_register(int fd, u32 opcode, void *_Nonnull arg, u32 nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_buffer_recycle(Uring *_Nonnull ring, u16 buffer_id) {
+  struct io_uring_buf *const buf =
+      &ring->buffers_ring
+           ->bufs[ring->buffers_tail & (URING_BUFFERS_COUNT - 1)];
+  buf->addr = (u64)(usize)(ring->buffers + buffer_id * URING_BUFFER_LEN);
+  buf->len = URING_BUFFER_LEN;
+  buf->bid = buffer_id;
+
+  ring->buffers_tail += 1;
+  __atomic_store_n(&ring->buffers_ring->tail, ring->buffers_tail,
+                   __ATOMIC_RELEASE);
+}
+
+__attribute__((warn_unused_result)) static Uring uring_new(void) {
+  struct io_uring_params params = {
+      .flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+               IORING_SETUP_SINGLE_ISSUER,
+  };
+  int fd = uring_setup(URING_ENTRIES, &params);
+  if (fd == -1 && errno == EINVAL) { // Older kernel.
+    params = (struct io_uring_params){0};
+    fd = uring_setup(URING_ENTRIES, &params);
+  }
+  if (fd == -1) {
+    fprintf(stderr, "Failed to io_uring_setup(2): %s\n", strerror(errno));
+    exit(1);
+  }
+  pg_assert(params.features & IORING_FEAT_SINGLE_MMAP);
+  pg_assert(params.features & IORING_FEAT_NODROP);
+  pg_assert(params.features & IORING_FEAT_EXT_ARG);
+
+  const usize sq_len = params.sq_off.array + params.sq_entries * sizeof(u32);
+  const usize cq_len =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  u8 *const rings = mmap(NULL, pg_max(sq_len, cq_len), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  pg_assert(rings != MAP_FAILED);
+
+  struct io_uring_sqe *const sqes =
+      mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+           IORING_OFF_SQES);
+  pg_assert(sqes != MAP_FAILED);
+
+  Uring ring = {
+      .fd = fd,
+      .sq_mask = *(u32 *)(void *)(rings + params.sq_off.ring_mask),
+      .sq_entries = params.sq_entries,
+      .sq_khead = (u32 *)(void *)(rings + params.sq_off.head),
+      .sq_ktail = (u32 *)(void *)(rings + params.sq_off.tail),
+      .sqes = sqes,
+      .cq_khead = (u32 *)(void *)(rings + params.cq_off.head),
+      .cq_ktail = (u32 *)(void *)(rings + params.cq_off.tail),
+      .cqes = (struct io_uring_cqe *)(void *)(rings + params.cq_off.cqes),
+      .cq_mask = *(u32 *)(void *)(rings + params.cq_off.ring_mask),
+  };
+  ring.sq_tail = *ring.sq_ktail;
+
+  // Identity mapping between the submission queue and the SQE array, set
+  // once.
+  u32 *const sq_array = (u32 *)(void *)(rings + params.sq_off.array);
+  for (u32 i = 0; i < params.sq_entries; i++) {
+    sq_array[i] = i;
+  }
+
+  // Provided buffers.
+  {
+    ring.buffers_ring =
+        mmap(NULL, URING_BUFFERS_COUNT * sizeof(struct io_uring_buf),
+             PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    pg_assert(ring.buffers_ring != MAP_FAILED);
+
+    ring.buffers = mmap(NULL, URING_BUFFERS_COUNT * URING_BUFFER_LEN,
+                        PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+                        -1, 0);
+    pg_assert(ring.buffers != MAP_FAILED);
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (u64)(usize)ring.buffers_ring,
+        .ring_entries = URING_BUFFERS_COUNT,
+        .bgid = URING_BUFFER_GROUP,
+    };
+    if (uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+      fprintf(stderr, "Failed to register the io_uring buffer ring: %s\n",
+              strerror(errno));
+      exit(1);
+    }
+
+    for (u32 i = 0; i < URING_BUFFERS_COUNT; i++) {
+      uring_buffer_recycle(&ring, (u16)i);
+    }
+  }
+
+  return ring;
+}
+
+// Publish the queued SQEs and optionally wait for completions, at most
+// `timeout_ms` if non-zero.
+static void uring_submit(Uring *_Nonnull ring, u32 wait_count,
+                         u64 timeout_ms) {
+  const u32 to_submit = ring->sq_tail - *ring->sq_ktail;
+  __atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+
+  if (to_submit == 0 && wait_count == 0)
+    return;
+
+  struct __kernel_timespec ts = {
+      .tv_sec = (i64)(timeout_ms / 1000),
+      .tv_nsec = (i64)(timeout_ms % 1000) * 1000 * 1000,
+  };
+  struct io_uring_getevents_arg arg = {.ts = (u64)(usize)&ts};
+
+  const int res =
+      uring_enter(ring->fd, to_submit, wait_count,
+                  wait_count > 0 ? IORING_ENTER_GETEVENTS : 0,
+                  wait_count > 0 && timeout_ms > 0 ? &arg : NULL);
+  if (res == -1) {
+    // On EBUSY/EAGAIN the caller reaps completions and we retry the
+    // remaining SQEs on the next submit.
+    pg_assert(errno == EINTR || errno == EBUSY || errno == EAGAIN ||
+              errno == ETIME);
+  }
+}
+
+// Make sure `count` SQEs can be queued without an intermediate submit, so
+// that linked chains are submitted as a whole.
+static void uring_reserve(Uring *_Nonnull ring, u32 count) {
+  pg_assert(count <= ring->sq_entries);
+
+  while (ring->sq_tail + count -
+             __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE) >
+         ring->sq_entries) {
+    uring_submit(ring, 0, 0);
+  }
+}
+
+__attribute__((warn_unused_result)) static struct io_uring_sqe *_Nonnull
+uring_get_sqe(Uring *_Nonnull ring, Connection *_Nullable conn, Uring_op op) {
+  uring_reserve(ring, 1);
+
+  struct io_uring_sqe *const sqe = &ring->sqes[ring->sq_tail & ring->sq_mask];
+  ring->sq_tail += 1;
+
+  *sqe = (struct io_uring_sqe){.user_data = (u64)(usize)conn | op};
+  return sqe;
+}
+
+__attribute__((warn_unused_result)) static u64
+uring_accept_user_data(bool unix_listener) {
+  return (unix_listener ? URING_OP_MASK + 1 : 0) | URING_OP_ACCEPT;
+}
+
+static void uring_queue_accept(Uring *_Nonnull ring, int listen_fd,
+                               bool unix_listener) {
+  struct io_uring_sqe *const sqe = uring_get_sqe(ring, NULL, URING_OP_ACCEPT);
+  sqe->user_data = uring_accept_user_data(unix_listener);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void uring_queue_recv(Uring *_Nonnull ring, Connection *_Nonnull conn) {
+  struct io_uring_sqe *const sqe = uring_get_sqe(ring, conn, URING_OP_RECV);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->len = 0; // Whole provided buffer.
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+}
+
+static void uring_queue_close(Uring *_Nonnull ring, Connection *_Nonnull conn) {
+  struct io_uring_sqe *const sqe = uring_get_sqe(ring, conn, URING_OP_CLOSE);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = conn->fd;
+}
+
+// Cancel the operation in flight for the connection, which then completes with
+// -ECANCELED. Matched by `user_data`, not by file descriptor, so that it never
+// hits a reused descriptor.
+static void uring_queue_cancel(Uring *_Nonnull ring, Connection *_Nonnull conn) {
+  const Uring_op pending = conn->state == CONNECTION_STATE_READING
+                               ? URING_OP_RECV
+                               : URING_OP_SEND;
+
+  struct io_uring_sqe *const sqe = uring_get_sqe(ring, conn, URING_OP_CANCEL);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (u64)(usize)conn | pending;
+  sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+}
+
+// Send the queued responses with one scatter-gather write.
+static struct io_uring_sqe *_Nonnull uring_queue_send(Uring *_Nonnull ring,
+                                                      Connection *_Nonnull conn) {
+  // Must stay valid until the operation completes.
+  struct msghdr *const msg = arena_alloc(&conn->arena, sizeof(struct msghdr),
+                                         _Alignof(struct msghdr), 1);
+  struct iovec *const iovecs =
+      arena_alloc(&conn->arena, sizeof(struct iovec), _Alignof(struct iovec),
+                  3 * (conn->out.len - conn->out_sent));
+  msg->msg_iov = iovecs;
+  // No sendfile(2) with io_uring: files are sent from their mapping.
+  bool more = false;
+  msg->msg_iovlen = server_connection_iovecs(*conn, iovecs, true, &more);
+
+  struct io_uring_sqe *const sqe = uring_get_sqe(ring, conn, URING_OP_SEND);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->fd;
+  sqe->addr = (u64)(usize)msg;
+  sqe->len = 1;
+  // MSG_WAITALL retries short sends in the kernel, which would otherwise
+  // break a link.
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  return sqe;
+}
+
+// Send the whole response then close the socket, as one linked chain.
+static void uring_queue_send_and_close(Uring *_Nonnull ring,
+                                       Connection *_Nonnull conn) {
+  uring_reserve(ring, 2);
+
+  struct io_uring_sqe *const sqe = uring_queue_send(ring, conn);
+  // On failure the linked close is cancelled, which is what we observe.
+  sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+
+  uring_queue_close(ring, conn);
+}
+
+// No deadline applies to the connection anymore once the close is queued.
+static void uring_connection_close(Uring_server *_Nonnull s,
+                                   Connection *_Nonnull conn) {
+  timer_wheel_remove(&s->server.timers, &conn->timer);
+  uring_queue_close(&s->ring, conn);
+}
+
+// Handle what has been received so far and queue the next operation.
+static void uring_connection_process(Uring_server *_Nonnull s,
+                                     Connection *_Nonnull conn) {
+  switch (server_connection_process(&s->server, conn)) {
+  case CONNECTION_PROGRESS_NEED_MORE:
+    server_connection_account(&s->server, conn, false);
+    server_connection_arm_timeout(&s->server, conn);
+    uring_queue_recv(&s->ring, conn);
+    return;
+  case CONNECTION_PROGRESS_ERROR:
+    uring_connection_close(s, conn);
+    return;
+  case CONNECTION_PROGRESS_RESPONSE_READY:
+    conn->state = CONNECTION_STATE_WRITING;
+    server_connection_account(&s->server, conn, false);
+    server_connection_arm_timeout(&s->server, conn);
+    if (conn->close_after_write) {
+      uring_queue_send_and_close(&s->ring, conn);
+    } else {
+      pg_unused(uring_queue_send(&s->ring, conn));
+    }
+    return;
+  }
+}
+
+static void uring_on_recv(Uring_server *_Nonnull s, Connection *_Nonnull conn,
+                          const struct io_uring_cqe *_Nonnull cqe) {
+  if (cqe->res == -ENOBUFS) { // Retry once buffers are recycled.
+    uring_queue_recv(&s->ring, conn);
+    return;
+  }
+
+  if (cqe->res <= 0) {
+    uring_connection_close(s, conn);
+    return;
+  }
+
+  pg_assert(cqe->flags & IORING_CQE_F_BUFFER);
+  const u16 buffer_id = (u16)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+  const Str data = {
+      .data = s->ring.buffers + buffer_id * URING_BUFFER_LEN,
+      .len = (usize)cqe->res,
+  };
+  conn->in = sb_append(conn->in, data, &conn->arena);
+  uring_buffer_recycle(&s->ring, buffer_id);
+
+  uring_connection_process(s, conn);
+}
+
+static void uring_on_send(Uring_server *_Nonnull s, Connection *_Nonnull conn,
+                          const struct io_uring_cqe *_Nonnull cqe) {
+  if (conn->close_after_write) {
+    // Only posted on failure; the linked close reports it.
+    pg_assert(cqe->res < 0);
+    return;
+  }
+
+  if (cqe->res < 0) {
+    uring_connection_close(s, conn);
+    return;
+  }
+
+  server_connection_advance_sent(conn, (usize)cqe->res);
+  if (!server_connection_all_sent(*conn)) { // Interrupted despite MSG_WAITALL.
+    pg_unused(uring_queue_send(&s->ring, conn));
+    return;
+  }
+
+  if (!server_connection_next_request(&s->server, conn)) {
+    uring_connection_close(s, conn);
+    return;
+  }
+  uring_connection_process(s, conn);
+}
+
+static void uring_on_completion(Uring_server *_Nonnull s,
+                                const struct io_uring_cqe *_Nonnull cqe) {
+  Connection *const conn = (Connection *)(usize)(cqe->user_data & ~URING_OP_MASK);
+  const Uring_op op = (Uring_op)(cqe->user_data & URING_OP_MASK);
+
+  switch (op) {
+  case URING_OP_ACCEPT: {
+    // Out of descriptors: accepting again right away would fail the same.
+    const bool out_of_fds = cqe->res == -EMFILE || cqe->res == -ENFILE;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      const bool unix_listener = conn != NULL;
+      const int listen_fd =
+          unix_listener ? s->server.unix_listen_fd : s->server.listen_fd;
+      if (s->server.draining) { // Cancelled.
+        close(listen_fd);
+      } else if (out_of_fds) {
+        s->server.accept_paused[unix_listener] = true;
+      } else {
+        uring_queue_accept(&s->ring, listen_fd, unix_listener);
+      }
+    }
+
+    if (cqe->res < 0) {
+      if (cqe->res != -ECANCELED && !out_of_fds) {
+        fprintf(stderr, "Failed to accept(2): %s\n", strerror(-cqe->res));
+      }
+      return;
+    }
+
+    Connection *const accepted = server_connection_admit(&s->server, cqe->res);
+    if (accepted == NULL)
+      return;
+    server_connection_arm_timeout(&s->server, accepted);
+    uring_queue_recv(&s->ring, accepted);
+    return;
+  }
+  case URING_OP_RECV:
+    pg_assert(conn);
+    uring_on_recv(s, conn, cqe);
+    return;
+  case URING_OP_SEND:
+    pg_assert(conn);
+    uring_on_send(s, conn, cqe);
+    return;
+  case URING_OP_CLOSE:
+    pg_assert(conn);
+    if (cqe->res == -ECANCELED) { // The linked send failed.
+      close(conn->fd);
+    }
+    server_connection_release(&s->server, conn);
+    return;
+  case URING_OP_CANCEL: // Only posted on failure: the operation just completed.
+    return;
+  }
+}
+
+static void uring_expire_timeouts(Uring_server *_Nonnull s) {
+  const u64 now_tick = timer_now_tick();
+
+  Timer *timer = NULL;
+  while ((timer = timer_wheel_expire(&s->server.timers, now_tick)) != NULL) {
+    Connection *const conn = server_connection_from_timer(timer);
+    server_connection_send_timeout_response(&s->server, *conn);
+    uring_queue_cancel(&s->ring, conn);
+  }
+}
+
+static void uring_drain_start(Uring_server *_Nonnull s) {
+  server_drain_start(&s->server);
+
+  // The listeners are closed once their accept completes.
+  for (u32 i = 0; i < 2; i++) {
+    const bool unix_listener = i == 1;
+    if (unix_listener && s->server.unix_listen_fd == -1)
+      continue;
+    // No accept to cancel.
+    if (s->server.accept_paused[i]) {
+      s->server.accept_paused[i] = false;
+      close(unix_listener ? s->server.unix_listen_fd : s->server.listen_fd);
+      continue;
+    }
+
+    struct io_uring_sqe *const sqe =
+        uring_get_sqe(&s->ring, NULL, URING_OP_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_accept_user_data(unix_listener);
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+  }
+
+  for (Connection *it = s->server.slots; it != NULL; it = it->next_slot) {
+    if (server_connection_is_idle(*it)) {
+      uring_queue_cancel(&s->ring, it);
+    }
+  }
+}
+
+// Serve all connections from this process with io_uring. On SIGTERM, stop
+// accepting and exit once the connections are served.
+static void server_run_uring(int listen_fd, Server_config config) {
+  Uring_server s = {
+      .server = server_new(listen_fd, config),
+      .ring = uring_new(),
+  };
+  server_drain_install_signal_handler();
+
+  uring_queue_accept(&s.ring, listen_fd, false);
+  if (s.server.unix_listen_fd != -1) {
+    uring_queue_accept(&s.ring, s.server.unix_listen_fd, true);
+  }
+
+  for (;;) {
+    if (server_drain_requested && !s.server.draining) {
+      uring_drain_start(&s);
+    }
+    if (server_drain_done(&s.server))
+      exit(0);
+
+    // Wake up every tick while deadlines or accepts are pending.
+    const bool accept_paused =
+        s.server.accept_paused[0] || s.server.accept_paused[1];
+    uring_submit(&s.ring, 1,
+                 s.server.timers.armed_count > 0 || accept_paused
+                     ? TIMER_TICK_MS
+                     : 0);
+
+    u32 head = *s.ring.cq_khead;
+    const u32 tail = __atomic_load_n(s.ring.cq_ktail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const struct io_uring_cqe cqe = s.ring.cqes[head & s.ring.cq_mask];
+      uring_on_completion(&s, &cqe);
+    }
+    __atomic_store_n(s.ring.cq_khead, head, __ATOMIC_RELEASE);
+
+    uring_expire_timeouts(&s);
+
+    for (u32 i = 0; i < 2; i++) {
+      if (s.server.accept_paused[i] && !s.server.draining) {
+        s.server.accept_paused[i] = false;
+        uring_queue_accept(
+            &s.ring, i == 0 ? listen_fd : s.server.unix_listen_fd, i == 1);
+      }
+    }
+    server_stats_print_if_requested("io_uring", s.server.stats);
+  }
+}
@@ -0,0 +1,434 @@
+#pragma once
+
+#include "simd.h"
+#include "str.h"
+
+// UTF-8 validation (RFC 3629): no overlong encodings, no UTF-16 surrogates,
+// nothing above U+10FFFF, no truncated or stray continuation bytes.
+//
+// The vector kernels use the lookup table method (Keiser and Lemire,
+// "Validating UTF-8 In Less Than One Instruction Per Byte"): each error is a
+// property of two consecutive bytes, found by indexing three 16-entry tables
+// with the high nibble of the previous byte, its low nibble, and the high
+// nibble of the current byte, and and-ing the bits of the errors they agree
+// on. Only the continuation bytes expected 2 and 3 bytes after a lead are
+// checked separately. Blocks without any non-ASCII byte skip all of it.
+
+// Which error each bit of the tables stands for, from the two bytes.
+#define UTF8_TOO_SHORT (1 << 0)      // 11______ 0_______ or 11______ 11______
+#define UTF8_TOO_LONG (1 << 1)       // 0_______ 10______
+#define UTF8_OVERLONG_3 (1 << 2)     // 11100000 100_____
+#define UTF8_TOO_LARGE (1 << 3)      // 11110100 1001____ and above
+#define UTF8_SURROGATE (1 << 4)      // 11101101 101_____
+#define UTF8_OVERLONG_2 (1 << 5)     // 1100000_ 10______
+#define UTF8_TOO_LARGE_1000 (1 << 6) // 11110101 1000____ and above
+#define UTF8_OVERLONG_4 (1 << 6)     // 11110000 1000____
+#define UTF8_TWO_CONTS (1 << 7)      // 10______ 10______ (checked separately)
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+// Whether `data` is valid UTF-8.
+typedef bool (*Utf8_validate_kernel)(const u8 *_Nonnull data, usize len);
+
+__attribute__((warn_unused_result)) static bool
+utf8_validate_scalar(const u8 *_Nonnull data, usize len) {
+  usize i = 0;
+  while (i < len) {
+    // ASCII, 8 bytes at a time.
+    if (i + 8 <= len) {
+      u64 word = 0;
+      memcpy(&word, data + i, sizeof(word));
+      if ((word & 0x8080808080808080ULL) == 0) {
+        i += 8;
+        continue;
+      }
+    }
+
+    const u8 c = data[i];
+    if (c < 0x80) {
+      i += 1;
+      continue;
+    }
+
+    // Well-formed sequences, from table 3-7 of the Unicode standard: the
+    // range of the second byte depends on the first.
+    usize continuations_count = 0;
+    u8 second_min = 0x80, second_max = 0xbf;
+    if (0xc2 <= c && c <= 0xdf) {
+      continuations_count = 1;
+    } else if (0xe0 <= c && c <= 0xef) {
+      continuations_count = 2;
+      second_min = c == 0xe0 ? 0xa0 : 0x80;
+      second_max = c == 0xed ? 0x9f : 0xbf;
+    } else if (0xf0 <= c && c <= 0xf4) {
+      continuations_count = 3;
+      second_min = c == 0xf0 ? 0x90 : 0x80;
+      second_max = c == 0xf4 ? 0x8f : 0xbf;
+    } else {
+      return false;
+    }
+
+    if (len - i <= continuations_count)
+      return false;
+    if (data[i + 1] < second_min || second_max < data[i + 1])
+      return false;
+    for (usize k = 2; k <= continuations_count; k++) {
+      if ((data[i + k] & 0xc0) != 0x80)
+        return false;
+    }
+    i += 1 + continuations_count;
+  }
+  return true;
+}
+
+#if defined(__x86_64__)
+// The tables, for `pshufb`: indexed by the high nibble of the previous byte,
+// its low nibble, and the high nibble of the current byte.
+static const u8 utf8_byte_1_high[16] = {
+    // 0_______: ASCII.
+    UTF8_TOO_LONG,
+    UTF8_TOO_LONG,
+    UTF8_TOO_LONG,
+    UTF8_TOO_LONG,
+    UTF8_TOO_LONG,
+    UTF8_TOO_LONG,
+    UTF8_TOO_LONG,
+    UTF8_TOO_LONG,
+    // 10______: continuation.
+    UTF8_TWO_CONTS,
+    UTF8_TWO_CONTS,
+    UTF8_TWO_CONTS,
+    UTF8_TWO_CONTS,
+    // 1100____, 1101____: lead of 2.
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    UTF8_TOO_SHORT,
+    // 1110____: lead of 3.
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    // 1111____: lead of 4 (or more).
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+};
+
+static const u8 utf8_byte_1_low[16] = {
+    // ____0000
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+    // ____0001
+    UTF8_CARRY | UTF8_OVERLONG_2,
+    // ____001_
+    UTF8_CARRY,
+    UTF8_CARRY,
+    // ____0100
+    UTF8_CARRY | UTF8_TOO_LARGE,
+    // ____0101 to ____1100
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    // ____1101
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+    // ____111_
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+};
+
+static const u8 utf8_byte_2_high[16] = {
+    // 0_______: ASCII.
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT,
+    // 1000____
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+        UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    // 1001____
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+        UTF8_TOO_LARGE,
+    // 101_____
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+        UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+        UTF8_TOO_LARGE,
+    // 11______: lead.
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT,
+};
+
+// Bytes above these, at the end of a block, announce more bytes than remain in
+// it: a lead of 2 as the last byte, of 3 as the last two, of 4 as the last
+// three.
+static const u8 utf8_incomplete_max[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1,
+};
+
+// Errors of the 16 bytes of `input`, following those of `prev_input`: any bit
+// set is an error.
+__attribute__((warn_unused_result, target("sse4.2"),
+               always_inline)) static inline __m128i
+utf8_sse42_errors(__m128i input, __m128i prev_input) {
+  const __m128i nibble_mask = _mm_set1_epi8(0x0f);
+  const __m128i prev1 = _mm_alignr_epi8(input, prev_input, 16 - 1);
+
+  const __m128i byte_1_high = _mm_shuffle_epi8(
+      _mm_loadu_si128((const __m128i *)(const void *)utf8_byte_1_high),
+      _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble_mask));
+  const __m128i byte_1_low = _mm_shuffle_epi8(
+      _mm_loadu_si128((const __m128i *)(const void *)utf8_byte_1_low),
+      _mm_and_si128(prev1, nibble_mask));
+  const __m128i byte_2_high = _mm_shuffle_epi8(
+      _mm_loadu_si128((const __m128i *)(const void *)utf8_byte_2_high),
+      _mm_and_si128(_mm_srli_epi16(input, 4), nibble_mask));
+  const __m128i special_cases =
+      _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+  // Continuations must be where a lead of 3 or 4 announces them 2 or 3 bytes
+  // before, as flagged by `UTF8_TWO_CONTS`, and nowhere else.
+  const __m128i prev2 = _mm_alignr_epi8(input, prev_input, 16 - 2);
+  const __m128i prev3 = _mm_alignr_epi8(input, prev_input, 16 - 3);
+  const __m128i third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80));
+  const __m128i fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80));
+  const __m128i must_be_continuation = _mm_and_si128(
+      _mm_or_si128(third_byte, fourth_byte), _mm_set1_epi8((char)0x80));
+  return _mm_xor_si128(must_be_continuation, special_cases);
+}
+
+__attribute__((warn_unused_result, target("sse4.2"),
+               always_inline)) static inline __m128i
+utf8_sse42_incomplete(__m128i input) {
+  return _mm_subs_epu8(
+      input,
+      _mm_loadu_si128((const __m128i *)(const void *)(utf8_incomplete_max +
+                                                      16)));
+}
+
+__attribute__((warn_unused_result, target("sse4.2"))) static bool
+utf8_validate_sse42(const u8 *_Nonnull data, usize len) {
+  __m128i errors = _mm_setzero_si128();
+  __m128i prev_input = _mm_setzero_si128();
+  __m128i prev_incomplete = _mm_setzero_si128();
+
+  for (usize i = 0; i < len; i += 16) {
+    __m128i input = {0};
+    if (i + 16 <= len) {
+      input = _mm_loadu_si128((const __m128i *)(const void *)(data + i));
+    } else {
+      // The tail, padded with ASCII.
+      u8 tail[16] = {0};
+      memcpy(tail, data + i, len - i);
+      input = _mm_loadu_si128((const __m128i *)(const void *)tail);
+    }
+
+    if (_mm_movemask_epi8(input) == 0) {
+      // ASCII: only the previous block can be in error, if it ended early.
+      errors = _mm_or_si128(errors, prev_incomplete);
+    } else {
+      errors = _mm_or_si128(errors, utf8_sse42_errors(input, prev_input));
+      prev_incomplete = utf8_sse42_incomplete(input);
+    }
+    prev_input = input;
+  }
+  errors = _mm_or_si128(errors, prev_incomplete);
+  return _mm_testz_si128(errors, errors);
+}
+
+__attribute__((warn_unused_result, target("avx2"),
+               always_inline)) static inline __m256i
+utf8_avx2_prev(__m256i input, __m256i prev_input, int n) {
+  // The previous 128-bit lane of each byte: the high lane of `prev_input`,
+  // and the low lane of `input`.
+  const __m256i shifted_in = _mm256_permute2x128_si256(prev_input, input, 0x21);
+  switch (n) {
+  case 1:
+    return _mm256_alignr_epi8(input, shifted_in, 16 - 1);
+  case 2:
+    return _mm256_alignr_epi8(input, shifted_in, 16 - 2);
+  case 3:
+    return _mm256_alignr_epi8(input, shifted_in, 16 - 3);
+  default:
+    pg_assert(0 && "unreachable");
+  }
+}
+
+__attribute__((warn_unused_result, target("avx2"),
+               always_inline)) static inline __m256i
+utf8_avx2_errors(__m256i input, __m256i prev_input) {
+  const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+  const __m256i prev1 = utf8_avx2_prev(input, prev_input, 1);
+
+  const __m256i byte_1_high = _mm256_shuffle_epi8(
+      _mm256_broadcastsi128_si256(
+          _mm_loadu_si128((const __m128i *)(const void *)utf8_byte_1_high)),
+      _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble_mask));
+  const __m256i byte_1_low = _mm256_shuffle_epi8(
+      _mm256_broadcastsi128_si256(
+          _mm_loadu_si128((const __m128i *)(const void *)utf8_byte_1_low)),
+      _mm256_and_si256(prev1, nibble_mask));
+  const __m256i byte_2_high = _mm256_shuffle_epi8(
+      _mm256_broadcastsi128_si256(
+          _mm_loadu_si128((const __m128i *)(const void *)utf8_byte_2_high)),
+      _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble_mask));
+  const __m256i special_cases = _mm256_and_si256(
+      _mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+  const __m256i prev2 = utf8_avx2_prev(input, prev_input, 2);
+  const __m256i prev3 = utf8_avx2_prev(input, prev_input, 3);
+  const __m256i third_byte =
+      _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80));
+  const __m256i fourth_byte =
+      _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80));
+  const __m256i must_be_continuation = _mm256_and_si256(
+      _mm256_or_si256(third_byte, fourth_byte), _mm256_set1_epi8((char)0x80));
+  return _mm256_xor_si256(must_be_continuation, special_cases);
+}
+
+__attribute__((warn_unused_result, target("avx2"))) static bool
+utf8_validate_avx2(const u8 *_Nonnull data, usize len) {
+  __m256i errors = _mm256_setzero_si256();
+  __m256i prev_input = _mm256_setzero_si256();
+  __m256i prev_incomplete = _mm256_setzero_si256();
+  const __m256i incomplete_max =
+      _mm256_loadu_si256((const __m256i *)(const void *)utf8_incomplete_max);
+
+  for (usize i = 0; i < len; i += 32) {
+    __m256i input = {0};
+    if (i + 32 <= len) {
+      input = _mm256_loadu_si256((const __m256i *)(const void *)(data + i));
+    } else {
+      // The tail, padded with ASCII.
+      u8 tail[32] = {0};
+      memcpy(tail, data + i, len - i);
+      input = _mm256_loadu_si256((const __m256i *)(const void *)tail);
+    }
+
+    if (_mm256_movemask_epi8(input) == 0) {
+      // ASCII: only the previous block can be in error, if it ended early.
+      errors = _mm256_or_si256(errors, prev_incomplete);
+    } else {
+      errors = _mm256_or_si256(errors, utf8_avx2_errors(input, prev_input));
+      prev_incomplete = _mm256_subs_epu8(input, incomplete_max);
+    }
+    prev_input = input;
+  }
+  errors = _mm256_or_si256(errors, prev_incomplete);
+  return _mm256_testz_si256(errors, errors);
+}
+#endif
+
+__attribute__((warn_unused_result)) static Utf8_validate_kernel
+utf8_validate_kernel_for(Simd_level level) {
+  switch (level) {
+#if defined(__x86_64__)
+  case SIMD_LEVEL_AVX2:
+    return utf8_validate_avx2;
+  case SIMD_LEVEL_SSE42:
+    return utf8_validate_sse42;
+#endif
+  default:
+    return utf8_validate_scalar;
+  }
+}
+
+// Picked at startup for this CPU, or by the tests.
+static Utf8_validate_kernel _Nullable utf8_validate_kernel = NULL;
+
+__attribute__((warn_unused_result)) static bool utf8_valid(Str s) {
+  if (utf8_validate_kernel == NULL) {
+    utf8_validate_kernel = utf8_validate_kernel_for(simd_level());
+  }
+
+  // Short strings, like most JSON keys and values, are usually ASCII: check
+  // them a word at a time, the last word overlapping the previous one, rather
+  // than padding them for the kernel.
+  if (s.len < 32) {
+    u64 bytes = 0;
+    if (s.len >= sizeof(u64)) {
+      u64 word = 0;
+      for (usize i = 0; i + sizeof(u64) < s.len; i += sizeof(u64)) {
+        memcpy(&word, s.data + i, sizeof(word));
+        bytes |= word;
+      }
+      memcpy(&word, s.data + s.len - sizeof(u64), sizeof(word));
+      bytes |= word;
+    } else {
+      for (usize i = 0; i < s.len; i++) {
+        bytes |= s.data[i];
+      }
+    }
+    if ((bytes & 0x8080808080808080ULL) == 0)
+      return true;
+  }
+
+  return s.len == 0 || utf8_validate_kernel(s.data, s.len);
+}
+
+static void test_utf8(void) {
+  char *const valid[] = {
+      "",
+      "caf\xc3\xa9",
+      "\xe2\x82\xac",
+      "\xf0\x9f\x8e\x84",
+      "\xed\x9f\xbf",         // U+D7FF
+      "\xee\x80\x80",         // U+E000
+      "\xf4\x8f\xbf\xbf",     // U+10FFFF
+      "\x7f\xc2\x80\xdf\xbf", // Boundaries of 1 and 2 bytes.
+      "\xe0\xa0\x80\xef\xbf\xbf",
+      "\xf0\x90\x80\x80",
+  };
+  char *const invalid[] = {
+      "\x80",             // Stray continuation.
+      "\xc3",             // Truncated.
+      "\xe2\x82",         // Truncated.
+      "\xf0\x9f\x8e",     // Truncated.
+      "\xc3\x28",         // Not a continuation.
+      "\xe2\x28\xa1",     // Not a continuation.
+      "\xe2\x82\x28",     // Not a continuation.
+      "\xf0\x9f\x28\x84", // Not a continuation.
+      "\xf0\x9f\x8e\x28", // Not a continuation.
+      "\xc0\xaf",         // Overlong.
+      "\xc1\xbf",         // Overlong.
+      "\xe0\x80\xaf",     // Overlong.
+      "\xe0\x9f\xbf",     // Overlong.
+      "\xf0\x80\x80\xaf", // Overlong.
+      "\xf0\x8f\xbf\xbf", // Overlong.
+      "\xed\xa0\x80",     // Surrogate.
+      "\xed\xbf\xbf",     // Surrogate.
+      "\xf4\x90\x80\x80", // Above U+10FFFF.
+      "\xf5\x80\x80\x80", // Above U+10FFFF.
+      "\xf8\x88\x80\x80\x80",
+      "\xff",
+      "\xc3\xa9\xa9", // Continuation too many.
+      "\xe2\x82\xac\x80",
+  };
+
+  const Simd_level max_level = simd_level();
+  for (u32 level = SIMD_LEVEL_SCALAR; level <= max_level; level++) {
+    utf8_validate_kernel = utf8_validate_kernel_for((Simd_level)level);
+
+    for (u64 i = 0; i < carray_count(valid) + carray_count(invalid); i++) {
+      const bool want = i < carray_count(valid);
+      const Str in = str_from_c(want ? valid[i]
+                                     : invalid[i - carray_count(valid)]);
+
+      // At every offset of the blocks, and across their boundaries.
+      for (u64 offset = 0; offset < 70; offset++) {
+        u8 buf[80] = {0};
+        memset(buf, 'a', sizeof(buf));
+        memcpy(buf + offset, in.data, in.len);
+
+        pg_assert(utf8_valid((Str){.data = buf, .len = offset + in.len}) ==
+                  want);
+        pg_assert(utf8_valid((Str){.data = buf, .len = sizeof(buf)}) == want);
+      }
+    }
+  }
+  utf8_validate_kernel = utf8_validate_kernel_for(max_level);
+}